@@ -21,6 +21,10 @@
 
 #include "ApplicationPaths.h"
 
+#include <cstdlib>
+#include <filesystem>
+#include <system_error>
+
 // This code from https://stackoverflow.com/a/60250581/7083698
 
 #if defined(_WIN32)
@@ -118,5 +122,47 @@ std::string getExecutableDir() {
 }
 #endif
 
+std::string getCacheDir() {
+    // Follow each platform's convention for per-user cache data
+    std::filesystem::path cacheDir;
+#if defined(_WIN32)
+    char const * localAppData = std::getenv("LOCALAPPDATA");
+    if(localAppData != nullptr && localAppData[0] != 0)
+    {
+        cacheDir = std::filesystem::path(localAppData) / "fxload";
+    }
+#else
+    char const * home = std::getenv("HOME");
+#if defined(__APPLE__)
+    if(home != nullptr && home[0] != 0)
+    {
+        cacheDir = std::filesystem::path(home) / "Library" / "Caches" / "fxload";
+    }
+#else
+    char const * xdgCacheHome = std::getenv("XDG_CACHE_HOME");
+    if(xdgCacheHome != nullptr && xdgCacheHome[0] != 0)
+    {
+        cacheDir = std::filesystem::path(xdgCacheHome) / "fxload";
+    }
+    else if(home != nullptr && home[0] != 0)
+    {
+        cacheDir = std::filesystem::path(home) / ".cache" / "fxload";
+    }
+#endif
+#endif
+
+    if(cacheDir.empty())
+    {
+        return "";
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(cacheDir, ec);
+    if(ec)
+    {
+        return "";
+    }
+    return cacheDir.string();
 }
 
+}
@@ -31,6 +31,10 @@ namespace AppPaths {
   std::string getExecutablePath();
   std::string getExecutableDir();
 
+  // Get fxload's per-user cache directory, creating it if needed.
+  // Returns an empty string if there is no usable location.
+  std::string getCacheDir();
+
 #if defined(_WIN32)
   static const std::string PATH_SEP = "\\";
 #else
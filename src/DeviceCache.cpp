@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2026 Mbed CE
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#include "DeviceCache.h"
+#include "ApplicationPaths.h"
+
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+
+#if defined(_WIN32)
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/file.h>
+    #include <unistd.h>
+#endif
+
+// Held while a cache file is read back and rewritten
+static std::mutex saveMutex;
+
+/*
+ * Exclusive lock on a file next to a cache file, held while it is read
+ * back and rewritten so saves from different processes don't interleave.
+ * If the lock file can't be opened, saving goes ahead unlocked.
+ */
+class CacheFileLock
+{
+#if defined(_WIN32)
+    HANDLE handle;
+#else
+    int fd;
+#endif
+
+public:
+    explicit CacheFileLock(std::string const & path)
+    {
+#if defined(_WIN32)
+        handle = CreateFileA((path + ".lock").c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                             nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if(handle != INVALID_HANDLE_VALUE)
+        {
+            OVERLAPPED overlapped = {};
+            LockFileEx(handle, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped);
+        }
+#else
+        fd = open((path + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if(fd >= 0)
+        {
+            while(flock(fd, LOCK_EX) != 0 && errno == EINTR)
+            {
+            }
+        }
+#endif
+    }
+
+    // Closing the file releases the lock
+    ~CacheFileLock()
+    {
+#if defined(_WIN32)
+        if(handle != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(handle);
+        }
+#else
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+#endif
+    }
+
+    CacheFileLock(CacheFileLock const &) = delete;
+    CacheFileLock & operator=(CacheFileLock const &) = delete;
+};
+
+/*
+ * A temporary file name next to path that no other process uses, so that
+ * two of them writing at once don't write into the same file
+ */
+static std::string get_temp_path(std::string const & path)
+{
+#if defined(_WIN32)
+    unsigned long pid = GetCurrentProcessId();
+#else
+    unsigned long pid = static_cast<unsigned long>(getpid());
+#endif
+    return path + ".tmp" + std::to_string(pid);
+}
+
+/*
+ * Moves a fully written temporary file over path in one step, so readers
+ * see either the old file or the new one, never neither
+ */
+static bool replace_file(std::string const & tempPath, std::string const & path)
+{
+#if defined(_WIN32)
+    bool ok = MoveFileExA(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    bool ok = std::rename(tempPath.c_str(), path.c_str()) == 0;
+#endif
+    if(!ok)
+    {
+        std::remove(tempPath.c_str());
+    }
+    return ok;
+}
+
+static void read_entries(std::string const & path, std::map<std::string, std::string> & entries)
+{
+    std::ifstream file(path);
+    std::string line;
+    while(std::getline(file, line))
+    {
+        std::string::size_type tabIdx = line.find('\t');
+        if(tabIdx == std::string::npos || tabIdx == 0)
+        {
+            continue;
+        }
+        entries[line.substr(0, tabIdx)] = line.substr(tabIdx + 1);
+    }
+}
+
+DeviceCache::DeviceCache(std::string const & name)
+{
+    std::string cacheDir = AppPaths::getCacheDir();
+    if(cacheDir.empty())
+    {
+        // Nowhere to keep it, so the cache just stays empty
+        return;
+    }
+    path = cacheDir + AppPaths::PATH_SEP + name;
+    read_entries(path, entries);
+}
+
+std::string DeviceCache::get(std::string const & key) const
+{
+    auto entry = entries.find(key);
+    return entry == entries.end() ? "" : entry->second;
+}
+
+void DeviceCache::set(std::string const & key, std::string const & value)
+{
+    entries[key] = value;
+    changedKeys.insert(key);
+}
+
+void DeviceCache::erase(std::string const & key)
+{
+    entries.erase(key);
+    changedKeys.insert(key);
+}
+
+bool DeviceCache::save()
+{
+    if(path.empty())
+    {
+        return false;
+    }
+
+    // Other threads of this process (in fxloadd, its worker and event
+    // loop) and other fxload processes may have saved their own keys
+    // since this was loaded; merge ours into theirs
+    std::lock_guard<std::mutex> lock(saveMutex);
+    CacheFileLock fileLock(path);
+    std::map<std::string, std::string> merged;
+    read_entries(path, merged);
+    for(std::string const & key : changedKeys)
+    {
+        auto entry = entries.find(key);
+        if(entry == entries.end())
+        {
+            merged.erase(key);
+        }
+        else
+        {
+            merged[key] = entry->second;
+        }
+    }
+    entries = std::move(merged);
+    changedKeys.clear();
+
+    // Write to a temporary file of our own and move it into place, so that
+    // a crash or a concurrent fxload process never sees a half-written cache.
+    std::string tempPath = get_temp_path(path);
+    {
+        std::ofstream file(tempPath, std::ios::trunc);
+        for(auto const & entry : entries)
+        {
+            file << entry.first << '\t' << entry.second << '\n';
+        }
+        if(!file)
+        {
+            file.close();
+            std::remove(tempPath.c_str());
+            return false;
+        }
+    }
+    return replace_file(tempPath, path);
+}
+
+std::string get_device_port_path(libusb_device *dev)
+{
+    uint8_t portNumbers[7];
+    int numPorts = libusb_get_port_numbers(dev, portNumbers, sizeof(portNumbers));
+
+    std::string path = std::to_string(libusb_get_bus_number(dev));
+    for(int i = 0; i < numPorts; i++)
+    {
+        path += (i == 0 ? "-" : ".") + std::to_string(portNumbers[i]);
+    }
+    return path;
+}
+
+std::string get_device_cache_key(libusb_device_handle *dev_h)
+{
+    libusb_device *dev = libusb_get_device(dev_h);
+
+    struct libusb_device_descriptor desc;
+    libusb_get_device_descriptor(dev, &desc);
+
+    char vidPid[10];
+    snprintf(vidPid, sizeof(vidPid), "%04x:%04x", desc.idVendor, desc.idProduct);
+
+    unsigned char serial[255];
+    if(desc.iSerialNumber != 0 && libusb_get_string_descriptor_ascii(dev_h, desc.iSerialNumber, serial, sizeof(serial)) > 0)
+    {
+        return std::string(vidPid) + " sn=" + reinterpret_cast<char const *>(serial);
+    }
+    return std::string(vidPid) + " port=" + get_device_port_path(dev);
+}
+
+/*
+ * Returns the file the image loaded into a device is kept in
+ */
+static std::string get_device_image_path(std::string const & key)
+{
+    std::string cacheDir = AppPaths::getCacheDir();
+    if(cacheDir.empty())
+    {
+        return "";
+    }
+
+    std::string fileName = key;
+    for(char & c : fileName)
+    {
+        if(!isalnum(static_cast<unsigned char>(c)))
+        {
+            c = '_';
+        }
+    }
+    return cacheDir + AppPaths::PATH_SEP + "loaded-" + fileName + ".hex";
+}
+
+bool load_device_image(std::string const & key, ezusb_image *image)
+{
+    std::string path = get_device_image_path(key);
+    FILE * file = path.empty() ? nullptr : fopen(path.c_str(), "rb");
+    if(file == nullptr)
+    {
+        return false;
+    }
+
+    int status = ezusb_image_load_ihex(image, file);
+    fclose(file);
+    return status == 0 && ezusb_image_normalize(image) == 0;
+}
+
+bool save_device_image(std::string const & key, ezusb_image const *image)
+{
+    std::string path = get_device_image_path(key);
+    if(path.empty())
+    {
+        return false;
+    }
+
+    // Same dance as DeviceCache::save(), so a half-written image is never used
+    std::string tempPath = get_temp_path(path);
+    FILE * file = fopen(tempPath.c_str(), "w");
+    if(file == nullptr)
+    {
+        return false;
+    }
+    int status = ezusb_image_save_ihex(image, file);
+    if(fclose(file) != 0 || status != 0)
+    {
+        std::remove(tempPath.c_str());
+        return false;
+    }
+    return replace_file(tempPath, path);
+}
+
+void forget_device_image(std::string const & key)
+{
+    std::string path = get_device_image_path(key);
+    if(!path.empty())
+    {
+        std::remove(path.c_str());
+    }
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2026 Mbed CE
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#ifndef FXLOAD_DEVICECACHE_H
+#define FXLOAD_DEVICECACHE_H
+
+#include <map>
+#include <set>
+#include <string>
+
+#include "libusb.h"
+#include "ezusb_image.h"
+
+/*
+ * Small persistent key-value store, kept as a text file in fxload's cache
+ * directory.  Used to remember things learned about a particular device
+ * (its transfer tuning, for example) from one run to the next.
+ *
+ * Keys and values may not contain tabs or newlines.
+ */
+class DeviceCache
+{
+    std::string path;
+    std::map<std::string, std::string> entries;
+    std::set<std::string> changedKeys; // set or erased since loading
+
+public:
+    // Loads the named cache file, if it exists.
+    explicit DeviceCache(std::string const & name);
+
+    // Returns the value stored for a key, or an empty string if there is none.
+    std::string get(std::string const & key) const;
+
+    void set(std::string const & key, std::string const & value);
+
+    void erase(std::string const & key);
+
+    // Writes the keys changed through this object back to disk, keeping
+    // anything other threads or fxload processes saved in the meantime.
+    // Returns false on failure.
+    bool save();
+};
+
+/*
+ * Returns a string identifying the physical port a device is plugged into,
+ * in the same "bus-port.port.port" form the Linux kernel uses.
+ */
+std::string get_device_port_path(libusb_device *dev);
+
+/*
+ * Returns a key identifying one particular device for the cache: its VID:PID
+ * plus its serial number, or its port path if it has no serial number.
+ */
+std::string get_device_cache_key(libusb_device_handle *dev_h);
+
+/*
+ * The image last loaded into a device's RAM, kept in the cache directory
+ * (as Intel HEX) under the device's cache key, so a later load can write
+ * only what changed.  load_device_image() returns false if there is none.
+ */
+bool load_device_image(std::string const & key, ezusb_image *image);
+bool save_device_image(std::string const & key, ezusb_image const *image);
+void forget_device_image(std::string const & key);
+
+#endif //FXLOAD_DEVICECACHE_H
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2026 Mbed CE
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#include "DeviceOps.h"
+#include "ApplicationPaths.h"
+#include "DeviceCache.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+const std::map<std::string, ezusb_chip_t> DeviceTypeNames
+{
+    {"AN21", AN21},
+    {"FX", FX},
+    {"FX2", FX2},
+    {"FX2LP", FX2LP},
+    {"auto", NONE},
+};
+
+ezusb_chip_t detect_chip_type(libusb_device_handle *dev_h)
+{
+    struct libusb_device_descriptor desc;
+    libusb_get_device_descriptor(libusb_get_device(dev_h), &desc);
+    ezusb_chip_t type = ezusb_chip_from_ids(desc.idVendor, desc.idProduct);
+    if(type == NONE)
+    {
+        logerror("Can't tell the chip type of %04x:%04x, please pass -t\n", desc.idVendor, desc.idProduct);
+        return NONE;
+    }
+
+    logverbose(EZUSB_LOG_INFO, "chip type %s, from ID %04x:%04x\n", ezusb_name[type], desc.idVendor, desc.idProduct);
+    return type;
+}
+
+libusb_device_handle *open_device_at_port(std::string const & portPath)
+{
+    libusb_device **devices;
+    ssize_t count = libusb_get_device_list(nullptr, &devices);
+    libusb_device_handle *handle = nullptr;
+    for(ssize_t i = 0; i < count && handle == nullptr; i++)
+    {
+        if(get_device_port_path(devices[i]) == portPath && libusb_open(devices[i], &handle) != 0)
+        {
+            handle = nullptr;
+        }
+    }
+    if(count >= 0)
+    {
+        libusb_free_device_list(devices, 1);
+    }
+    return handle;
+}
+
+std::string get_default_stage1_loader()
+{
+    std::string app_install_dir = AppPaths::getExecutableDir();
+    return app_install_dir + AppPaths::PATH_SEP + ".." + AppPaths::PATH_SEP + "share" + AppPaths::PATH_SEP + "fxload" + AppPaths::PATH_SEP + "Vend_Ax.hex";
+}
+
+/*
+ * Journal of EEPROM records written so far, so a job that is interrupted
+ * (cable pulled, process killed) can be resumed instead of starting over.
+ * Entries are kept per device and record which image and config byte
+ * they belong to; they are removed once the job completes.
+ */
+struct eeprom_journal
+{
+    DeviceCache cache{"eeprom-journal"};
+    std::string key;
+    std::string job;
+    std::function<void(size_t)> onProgress;
+
+    eeprom_journal(libusb_device_handle *dev_h, ezusb_image const * image, ezusb_chip_t type, int config)
+        : key(get_device_cache_key(dev_h))
+    {
+        char jobId[64];
+        snprintf(jobId, sizeof(jobId), "%016llx %s %d", static_cast<unsigned long long>(ezusb_image_hash(image)), ezusb_name[type], config);
+        job = jobId;
+    }
+
+    // Returns how many records an earlier run of this same job wrote
+    size_t recordsDone() const
+    {
+        std::string entry = cache.get(key);
+        size_t separator = entry.rfind(' ');
+        if(separator == std::string::npos || entry.substr(0, separator) != job)
+        {
+            return 0;
+        }
+        return std::strtoull(entry.c_str() + separator + 1, nullptr, 10);
+    }
+
+    static void progress(void *context, size_t done)
+    {
+        auto *journal = static_cast<eeprom_journal *>(context);
+        journal->cache.set(journal->key, journal->job + " " + std::to_string(done));
+        journal->cache.save();
+        if(journal->onProgress)
+        {
+            journal->onProgress(done);
+        }
+    }
+
+    void finish()
+    {
+        cache.erase(key);
+        cache.save();
+    }
+};
+
+int load_stage1_loader(libusb_device_handle *dev_h, ezusb_chip_t type, std::string const & path, bool dryRun)
+{
+    logverbose(EZUSB_LOG_INFO, "1st stage:  load 2nd stage loader\n");
+    ScopedImage loader;
+    int status = ezusb_image_load_file(&loader.image, path.c_str());
+    if(status == 0 && !dryRun)
+    {
+        if(ezusb_probe_loader(dev_h, &loader.image, type))
+        {
+            printf("Stage 1 loader already running, not loading it again\n");
+            ezusb_attach_fast_loader(dev_h);
+            return 0;
+        }
+
+        // the loader replaces whatever --incremental last loaded
+        forget_device_image(get_device_cache_key(dev_h));
+    }
+    if(status == 0)
+    {
+        status = ezusb_load_ram_image(dev_h, &loader.image, type, 0);
+    }
+    if(status == 0)
+    {
+        // use the loader's bulk endpoint, if it has one
+        ezusb_attach_fast_loader(dev_h);
+    }
+    if(status < 0)
+    {
+        logerror("unable to download %s\n", path.c_str());
+    }
+    return status;
+}
+
+int program_eeprom(libusb_device_handle *dev_h, ezusb_image const * image, ezusb_chip_t type, int config,
+                   std::function<void(size_t)> const & onProgress)
+{
+    eeprom_journal journal(dev_h, image, type, config);
+    journal.onProgress = onProgress;
+    size_t done = journal.recordsDone();
+    if(done > 0)
+    {
+        printf("Resuming an interrupted EEPROM write (%zu records already written)\n", done);
+    }
+    int status = ezusb_resume_eeprom_image(dev_h, image, type, config, done, eeprom_journal::progress, &journal);
+    if(status == 0)
+    {
+        journal.finish();
+    }
+    return status;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2026 Mbed CE
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#ifndef FXLOAD_DEVICEOPS_H
+#define FXLOAD_DEVICEOPS_H
+
+#include <functional>
+#include <map>
+#include <string>
+
+#include "libusb.h"
+#include "ezusb.h"
+#include "ezusb_image.h"
+
+/*
+ * Operations on an opened device that are shared by fxload and fxloadd.
+ */
+
+// Map of string names to enum values
+extern const std::map<std::string, ezusb_chip_t> DeviceTypeNames;
+
+/*
+ * Works out the chip type of an opened device when "-t auto" is used,
+ * from the default VID/PID of unconfigured devices only; nothing is read
+ * from the device.  Returns NONE for IDs that aren't known.
+ */
+ezusb_chip_t detect_chip_type(libusb_device_handle *dev_h);
+
+/*
+ * Opens whatever device is plugged into the port with this path (as
+ * get_device_port_path() gives it), e.g. to find a device again after it
+ * re-enumerated.  Returns null if there is none, or it can't be opened.
+ */
+libusb_device_handle *open_device_at_port(std::string const & portPath);
+
+// Path of the Vend_Ax.hex stage 1 loader installed with fxload
+std::string get_default_stage1_loader();
+
+/*
+ * Loads the stage 1 loader that EEPROM and external memory requests go
+ * through, unless a probe finds it still running from an earlier run.
+ * Dry runs always go through the motions.  If the loader has a bulk
+ * endpoint, later writes use it (see ezusb_attach_fast_loader()), so
+ * ezusb_detach_fast_loader() must be called before closing the device.
+ * Returns 0 on success.
+ */
+int load_stage1_loader(libusb_device_handle *dev_h, ezusb_chip_t type, std::string const & path, bool dryRun);
+
+/*
+ * Writes an image to EEPROM through the stage 1 loader, picking up where
+ * an interrupted run of the same job left off.  onProgress, if given, is
+ * called with the number of records written so far.  Returns 0 on success.
+ */
+int program_eeprom(libusb_device_handle *dev_h, ezusb_image const * image, ezusb_chip_t type, int config,
+                   std::function<void(size_t)> const & onProgress = nullptr);
+
+#endif //FXLOAD_DEVICEOPS_H
@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2026 Mbed CE
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#include "EventLoop.h"
+
+#include <cerrno>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include "ezusb_log.h"
+
+// How often to look for USB events if libusb can't give its descriptors
+static const int LIBUSB_POLL_INTERVAL_MS = 10;
+
+#ifdef __linux__
+// Most epoll events collected per wait; any more are picked up next time
+static const int MAX_EPOLL_EVENTS = 64;
+
+static const struct
+{
+    short poll;
+    uint32_t epoll;
+} EVENT_BITS[] = {
+    {POLLIN, EPOLLIN},
+    {POLLPRI, EPOLLPRI},
+    {POLLOUT, EPOLLOUT},
+    {POLLERR, EPOLLERR},
+    {POLLHUP, EPOLLHUP},
+};
+
+static uint32_t to_epoll_events(short events)
+{
+    uint32_t result = 0;
+    for(auto const & bit : EVENT_BITS)
+    {
+        result |= (events & bit.poll) ? bit.epoll : 0;
+    }
+    return result;
+}
+
+static short from_epoll_events(uint32_t events)
+{
+    short result = 0;
+    for(auto const & bit : EVENT_BITS)
+    {
+        result |= (events & bit.epoll) ? bit.poll : 0;
+    }
+    return result;
+}
+#endif
+
+EventLoop::EventLoop()
+{
+#ifdef __linux__
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(epollFd < 0)
+    {
+        logverbose(EZUSB_LOG_INFO, "epoll_create1: %s, using poll() instead\n", strerror(errno));
+    }
+#endif
+
+    if(pipe(wakeFds) != 0)
+    {
+        logerror("pipe: %s\n", strerror(errno));
+        wakeFds[0] = wakeFds[1] = -1;
+        return;
+    }
+    for(int fd : wakeFds)
+    {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    // Posted work is run at the end of runOnce(); this just drains the pipe
+    int readFd = wakeFds[0];
+    add(readFd, POLLIN, [readFd](short)
+    {
+        char buffer[64];
+        while(read(readFd, buffer, sizeof(buffer)) > 0)
+        {
+        }
+    });
+}
+
+EventLoop::~EventLoop()
+{
+    if(libusbAttached)
+    {
+        libusb_set_pollfd_notifiers(nullptr, nullptr, nullptr, nullptr);
+    }
+    for(int fd : wakeFds)
+    {
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+    }
+    if(epollFd >= 0)
+    {
+        close(epollFd);
+    }
+}
+
+void EventLoop::add(int fd, short events, Handler handler)
+{
+    bool known = watches.count(fd) > 0;
+    watches[fd] = Watch{events, std::move(handler)};
+
+#ifdef __linux__
+    if(epollFd >= 0)
+    {
+        struct epoll_event event = {};
+        event.events = to_epoll_events(events);
+        event.data.fd = fd;
+        if(epoll_ctl(epollFd, known ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event) != 0)
+        {
+            logerror("epoll_ctl(%d): %s\n", fd, strerror(errno));
+        }
+    }
+#else
+    (void)known;
+#endif
+}
+
+void EventLoop::remove(int fd)
+{
+    if(watches.erase(fd) == 0)
+    {
+        return;
+    }
+
+#ifdef __linux__
+    if(epollFd >= 0)
+    {
+        // Fails harmlessly if the descriptor has already been closed
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    }
+#endif
+}
+
+void LIBUSB_CALL EventLoop::libusbFdAdded(int fd, short events, void *user_data)
+{
+    EventLoop *loop = static_cast<EventLoop *>(user_data);
+    loop->add(fd, events, [loop](short) { loop->libusbReady = true; });
+}
+
+void LIBUSB_CALL EventLoop::libusbFdRemoved(int fd, void *user_data)
+{
+    static_cast<EventLoop *>(user_data)->remove(fd);
+}
+
+void EventLoop::attachLibusb()
+{
+    libusbAttached = true;
+    libusb_set_pollfd_notifiers(nullptr, libusbFdAdded, libusbFdRemoved, this);
+
+    const struct libusb_pollfd **pollFds = libusb_get_pollfds(nullptr);
+    if(pollFds == nullptr)
+    {
+        logverbose(EZUSB_LOG_INFO, "libusb can't share its descriptors, polling for USB events\n");
+        libusbPolled = true;
+        return;
+    }
+    for(const struct libusb_pollfd **pollFd = pollFds; *pollFd != nullptr; pollFd++)
+    {
+        libusbFdAdded((*pollFd)->fd, (*pollFd)->events, this);
+    }
+    libusb_free_pollfds(pollFds);
+}
+
+void EventLoop::post(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(postedMutex);
+        posted.push_back(std::move(task));
+    }
+
+    // A full pipe already has a wakeup waiting
+    char wake = 0;
+    if(wakeFds[1] >= 0 && write(wakeFds[1], &wake, 1) < 0 && errno != EAGAIN)
+    {
+        logerror("waking the event loop: %s\n", strerror(errno));
+    }
+}
+
+// Time until libusb next needs to handle a timeout, or -1 if it doesn't
+int EventLoop::libusbTimeoutMs() const
+{
+    struct timeval timeout;
+    if(libusb_get_next_timeout(nullptr, &timeout) != 1)
+    {
+        return -1;
+    }
+    return static_cast<int>(timeout.tv_sec * 1000 + (timeout.tv_usec + 999) / 1000);
+}
+
+bool EventLoop::runOnce(int timeoutMs)
+{
+    if(libusbAttached)
+    {
+        int usbTimeoutMs = libusbPolled ? LIBUSB_POLL_INTERVAL_MS : libusbTimeoutMs();
+        if(usbTimeoutMs >= 0 && (timeoutMs < 0 || usbTimeoutMs < timeoutMs))
+        {
+            timeoutMs = usbTimeoutMs;
+        }
+    }
+
+    std::vector<std::pair<int, short>> ready;
+#ifdef __linux__
+    if(epollFd >= 0)
+    {
+        struct epoll_event events[MAX_EPOLL_EVENTS];
+        int count = epoll_wait(epollFd, events, MAX_EPOLL_EVENTS, timeoutMs);
+        if(count < 0 && errno != EINTR)
+        {
+            logerror("epoll_wait: %s\n", strerror(errno));
+            return false;
+        }
+        for(int i = 0; i < count; i++)
+        {
+            int fd = events[i].data.fd;
+            ready.emplace_back(fd, from_epoll_events(events[i].events));
+        }
+    }
+    else
+#endif
+    {
+        std::vector<struct pollfd> pollFds;
+        for(auto const & watch : watches)
+        {
+            pollFds.push_back({watch.first, watch.second.events, 0});
+        }
+        int count = poll(pollFds.data(), pollFds.size(), timeoutMs);
+        if(count < 0 && errno != EINTR)
+        {
+            logerror("poll: %s\n", strerror(errno));
+            return false;
+        }
+        for(size_t i = 0; count > 0 && i < pollFds.size(); i++)
+        {
+            if(pollFds[i].revents != 0)
+            {
+                ready.emplace_back(pollFds[i].fd, pollFds[i].revents);
+            }
+        }
+    }
+
+    for(auto const & event : ready)
+    {
+        // An earlier handler may have removed it; copied since the handler
+        // may remove itself
+        auto watch = watches.find(event.first);
+        if(watch != watches.end())
+        {
+            Handler handler = watch->second.handler;
+            handler(event.second);
+        }
+    }
+
+    // Completes transfers, calling their callbacks, and expires timeouts
+    if(libusbAttached && (libusbReady || libusbPolled || libusbTimeoutMs() == 0))
+    {
+        libusbReady = false;
+        struct timeval noWait = {0, 0};
+        libusb_handle_events_timeout_completed(nullptr, &noWait, nullptr);
+    }
+
+    // Anything these post runs next time round
+    std::vector<std::function<void()>> tasks;
+    {
+        std::lock_guard<std::mutex> lock(postedMutex);
+        tasks.swap(posted);
+    }
+    for(auto & task : tasks)
+    {
+        task();
+    }
+    return true;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2026 Mbed CE
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#ifndef FXLOAD_EVENTLOOP_H
+#define FXLOAD_EVENTLOOP_H
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "libusb.h"
+
+/*
+ * Waits on any number of file descriptors from one thread, calling each
+ * one's handler when it's ready.  On Linux this uses epoll, so a wait
+ * costs the same however many descriptors there are; elsewhere the set
+ * is passed to poll() each time.  Not for Windows.
+ *
+ * libusb's own descriptors can be added too, so USB transfers complete
+ * from the same loop as everything else.  Work can also be posted to the
+ * loop, from its own callbacks or from other threads, to run once they
+ * have returned.
+ */
+class EventLoop
+{
+public:
+    // Gets the poll() revents bits for the descriptor
+    using Handler = std::function<void(short revents)>;
+
+private:
+    struct Watch
+    {
+        short events;
+        Handler handler;
+    };
+
+    int epollFd = -1;
+    std::map<int, Watch> watches;
+
+    // Written to wake the loop when work is posted
+    int wakeFds[2] = {-1, -1};
+    std::mutex postedMutex;
+    std::vector<std::function<void()>> posted;
+
+    bool libusbAttached = false;
+    bool libusbReady = false;
+    bool libusbPolled = false; // libusb has no descriptors to wait on
+
+    static void LIBUSB_CALL libusbFdAdded(int fd, short events, void *user_data);
+    static void LIBUSB_CALL libusbFdRemoved(int fd, void *user_data);
+    int libusbTimeoutMs() const;
+
+public:
+    EventLoop();
+    ~EventLoop();
+
+    EventLoop(EventLoop const &) = delete;
+    EventLoop & operator=(EventLoop const &) = delete;
+
+    // Calls handler whenever fd is ready for any of events (POLLIN etc.).
+    // Adding a descriptor again replaces its handler.
+    void add(int fd, short events, Handler handler);
+
+    // Stops watching fd; safe to call from any handler, for any fd.
+    void remove(int fd);
+
+    // Watches the default libusb context's descriptors, following its
+    // changes to them, and handles its events and timeouts as they come.
+    void attachLibusb();
+
+    // Runs task on the loop's thread at the end of a runOnce(), after the
+    // handlers and USB callbacks have returned, so it may start anything,
+    // including transfers of its own.  Safe to call from any thread.
+    void post(std::function<void()> task);
+
+    // Waits up to timeoutMs (-1 for no limit, or until a signal arrives)
+    // and runs the handlers of whatever became ready.  Returns false on
+    // errors other than being interrupted.
+    bool runOnce(int timeoutMs);
+};
+
+#endif //FXLOAD_EVENTLOOP_H
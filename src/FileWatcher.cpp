@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2026 Mbed CE
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#include "FileWatcher.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "ezusb_log.h"
+
+namespace fs = std::filesystem;
+
+// How often to look at the file when it can't be watched
+static const std::chrono::milliseconds POLL_INTERVAL(250);
+
+// How long a build may keep touching the file before it's considered done
+static const int SETTLE_TIME_MS = 100;
+
+FileWatcher::FileWatcher(std::string const & path):
+path(path)
+{
+    fs::path filePath(path);
+    fileName = filePath.filename().string();
+
+#ifdef __linux__
+    std::string dir = filePath.parent_path().string();
+    if(dir.empty())
+    {
+        dir = ".";
+    }
+
+    // Watch the directory: builds often replace the file rather than rewrite it
+    inotifyFd = inotify_init1(IN_CLOEXEC);
+    if(inotifyFd >= 0 && inotify_add_watch(inotifyFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        logverbose(EZUSB_LOG_INFO, "can't watch %s (%s), polling instead\n", dir.c_str(), strerror(errno));
+        close(inotifyFd);
+        inotifyFd = -1;
+    }
+#endif
+
+    std::error_code ec;
+    lastSize = fs::file_size(filePath, ec);
+    lastWriteTime = fs::last_write_time(filePath, ec).time_since_epoch().count();
+}
+
+FileWatcher::~FileWatcher()
+{
+#ifdef __linux__
+    if(inotifyFd >= 0)
+    {
+        close(inotifyFd);
+    }
+#endif
+}
+
+#ifdef __linux__
+/*
+ * Reads the events available on an inotify descriptor, waiting up to
+ * timeoutMs for some to arrive.  Returns 1 if one of them was for the
+ * named file, 0 if not, or -1 on error.
+ */
+static int readInotifyEvents(int fd, std::string const & fileName, int timeoutMs)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int ready = poll(&pfd, 1, timeoutMs);
+    if(ready <= 0)
+    {
+        return ready < 0 && errno != EINTR ? -1 : 0;
+    }
+
+    alignas(struct inotify_event) char buffer[4096];
+    ssize_t len = read(fd, buffer, sizeof(buffer));
+    if(len < 0)
+    {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    int matched = 0;
+    for(char * pos = buffer; pos < buffer + len; )
+    {
+        auto * event = reinterpret_cast<struct inotify_event *>(pos);
+        if(event->len > 0 && fileName == event->name)
+        {
+            matched = 1;
+        }
+        pos += sizeof(struct inotify_event) + event->len;
+    }
+    return matched;
+}
+#endif
+
+bool FileWatcher::waitForChange()
+{
+#ifdef __linux__
+    if(inotifyFd >= 0)
+    {
+        int rc;
+        while((rc = readInotifyEvents(inotifyFd, fileName, -1)) == 0)
+        {
+        }
+        if(rc < 0)
+        {
+            logerror("%s: error watching file: %s\n", path.c_str(), strerror(errno));
+            return false;
+        }
+
+        // Let the build finish, taking any further events with this one
+        while(readInotifyEvents(inotifyFd, fileName, SETTLE_TIME_MS) > 0)
+        {
+        }
+        return true;
+    }
+#endif
+
+    while(true)
+    {
+        std::this_thread::sleep_for(POLL_INTERVAL);
+
+        std::error_code sizeError, timeError;
+        uintmax_t size = fs::file_size(path, sizeError);
+        int64_t writeTime = fs::last_write_time(path, timeError).time_since_epoch().count();
+        if(sizeError || timeError)
+        {
+            // probably being replaced right now
+            continue;
+        }
+        if(size != lastSize || writeTime != lastWriteTime)
+        {
+            lastSize = size;
+            lastWriteTime = writeTime;
+            std::this_thread::sleep_for(std::chrono::milliseconds(SETTLE_TIME_MS));
+            return true;
+        }
+    }
+}
+
+bool FileWatcher::hashFile(std::string const & path, uint64_t & hash)
+{
+    std::ifstream file(path, std::ios::binary);
+    if(!file)
+    {
+        return false;
+    }
+
+    hash = 0xcbf29ce484222325ULL; // FNV-1a
+    char buffer[4096];
+    while(file.read(buffer, sizeof(buffer)) || file.gcount() > 0)
+    {
+        for(std::streamsize i = 0; i < file.gcount(); i++)
+        {
+            hash = (hash ^ static_cast<unsigned char>(buffer[i])) * 0x100000001b3ULL;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2026 Mbed CE
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#ifndef FXLOAD_FILEWATCHER_H
+#define FXLOAD_FILEWATCHER_H
+
+#include <cstdint>
+#include <string>
+
+/*
+ * Waits for a file to be rewritten, e.g. by a firmware build.  On Linux
+ * this uses inotify on the file's directory, so files replaced by rename
+ * are seen too; elsewhere the file's size and timestamp are polled.
+ */
+class FileWatcher
+{
+    std::string path;
+    std::string fileName;
+    int inotifyFd = -1;
+
+    // For polling: what the file looked like last time
+    uintmax_t lastSize = 0;
+    int64_t lastWriteTime = 0;
+
+public:
+    explicit FileWatcher(std::string const & path);
+    ~FileWatcher();
+
+    FileWatcher(FileWatcher const &) = delete;
+    FileWatcher & operator=(FileWatcher const &) = delete;
+
+    // Blocks until the file may have changed.  Returns false if it can no
+    // longer be watched.
+    bool waitForChange();
+
+    // Hash of the file's contents, so callers can skip rewrites that didn't
+    // change anything.  Returns false if the file can't be read.
+    static bool hashFile(std::string const & path, uint64_t & hash);
+};
+
+#endif //FXLOAD_FILEWATCHER_H
@@ -0,0 +1,627 @@
+/*
+ * Copyright (c) 2026 Mbed CE
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#include "LoadEngine.h"
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <map>
+
+#include "ezusb_log.h"
+
+// Same as the synchronous code's control requests
+static const unsigned int TRANSFER_TIMEOUT_MS = 10000;
+static const unsigned int PROBE_TIMEOUT_MS = 1000;
+
+// Index of the stage 1 loader probe, which isn't part of the program
+static const size_t PROBE = static_cast<size_t>(-1);
+
+/*
+ * Collects the requests the synchronous code sends into a program
+ */
+struct Recorder
+{
+    LoadProgram & program;
+    ezusb_chip_traits const * chip;
+    bool loader;
+};
+
+static int record_request(void *context, const char *label, unsigned char requestType, unsigned char request,
+                          unsigned short value, unsigned short index, unsigned char *data, uint16_t length)
+{
+    Recorder & recorder = *static_cast<Recorder *>(context);
+    bool in = (requestType & LIBUSB_ENDPOINT_IN) != 0;
+    bool cpucs = !in && request == RW_INTERNAL && value == recorder.chip->cpucs_addr && length == 1;
+
+    // Reads get the answer the rest of the plan assumes, which is then
+    // what the device must give
+    if(in)
+    {
+        memset(data, 0, length);
+        if(request == GET_EEPROM_SIZE && length > 0)
+        {
+            data[0] = 1;
+        }
+    }
+
+    LoadRequest planned;
+    planned.label = label;
+    planned.requestType = requestType;
+    planned.request = request;
+    planned.value = value;
+    planned.index = index;
+    planned.data.assign(data, data + length);
+    planned.pipelined = !in && !cpucs && (request == RW_INTERNAL || request == RW_MEMORY);
+    planned.record = !recorder.loader && strcmp(label, "write EEPROM segment") == 0;
+
+    if(recorder.loader)
+    {
+        planned.state = "stage1";
+    }
+    else if(cpucs)
+    {
+        planned.state = data[0] & 1 ? "halt" : "reset";
+    }
+    else if(request == RW_MEMORY)
+    {
+        planned.state = "external";
+    }
+    else if(request == RW_INTERNAL)
+    {
+        planned.state = "internal";
+    }
+    else if(request == GET_EEPROM_SIZE)
+    {
+        planned.state = "check";
+    }
+    else
+    {
+        planned.state = in ? "verify" : "eeprom";
+    }
+
+    recorder.program.requests.push_back(std::move(planned));
+    return length;
+}
+
+// Runs steps() with its requests going into the program instead of a device
+template<typename Steps>
+static int record_steps(LoadProgram & program, ezusb_chip_t type, bool loader, Steps steps)
+{
+    ezusb_chip_traits const * chip = ezusb_get_chip_traits(type);
+    if(chip == nullptr)
+    {
+        logerror("?? Unrecognized microcontroller type %s ??\n", ezusb_name[type]);
+        return -1;
+    }
+
+    Recorder recorder{program, chip, loader};
+    ezusb_set_transport(record_request, &recorder);
+    int status = steps();
+    ezusb_set_transport(nullptr, nullptr);
+    return status;
+}
+
+int plan_ram_load(LoadProgram & program, ezusb_image const * image, ezusb_chip_t type)
+{
+    return record_steps(program, type, false, [&] { return ezusb_load_ram_image(nullptr, image, type, 0); });
+}
+
+int plan_eeprom_load(LoadProgram & program, ezusb_image const * loader, ezusb_image const * image,
+                     ezusb_chip_t type, int config)
+{
+    if(loader != nullptr)
+    {
+        int status = record_steps(program, type, true, [&] { return ezusb_load_ram_image(nullptr, loader, type, 0); });
+        if(status != 0)
+        {
+            return status;
+        }
+        program.loaderEnd = program.requests.size();
+
+        LoadRequest probe;
+        probe.label = "probe for 2nd stage loader";
+        probe.state = "stage1";
+        probe.requestType = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+        probe.request = GET_EEPROM_SIZE;
+        probe.data.resize(1);
+        program.loaderProbe.push_back(std::move(probe));
+        for(LoadRequest const & planned : program.requests)
+        {
+            if(planned.pipelined)
+            {
+                LoadRequest read = planned;
+                read.label = planned.request == RW_MEMORY ? "read back external" : "read back on-chip";
+                read.requestType = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+                read.pipelined = false;
+                program.loaderProbe.push_back(std::move(read));
+            }
+        }
+    }
+
+    int status = record_steps(program, type, false, [&] { return ezusb_load_eeprom_image(nullptr, image, type, config); });
+    if(status != 0)
+    {
+        return status;
+    }
+
+    // The last record is the CPU reset that ends the boot, not image data
+    for(auto planned = program.requests.rbegin(); planned != program.requests.rend(); ++planned)
+    {
+        if(planned->record)
+        {
+            planned->record = false;
+            break;
+        }
+    }
+    program.records = std::count_if(program.requests.begin(), program.requests.end(),
+                                    [](LoadRequest const & planned) { return planned.record; });
+    return 0;
+}
+
+int plan_eeprom_verify(LoadProgram & program, ezusb_image const * loader, ezusb_image const * image,
+                       ezusb_chip_t type, int config)
+{
+    LoadProgram writes;
+    int status = plan_eeprom_load(writes, loader, image, type, config);
+    if(status != 0)
+    {
+        return status;
+    }
+
+    // What each EEPROM byte ends up holding; later writes win
+    std::map<uint16_t, unsigned char> contents;
+    for(size_t i = writes.loaderEnd; i < writes.requests.size(); i++)
+    {
+        LoadRequest const & planned = writes.requests[i];
+        if(planned.request != RW_EEPROM || (planned.requestType & LIBUSB_ENDPOINT_IN))
+        {
+            continue;
+        }
+        for(size_t offset = 0; offset < planned.data.size(); offset++)
+        {
+            contents[static_cast<uint16_t>(planned.value + offset)] = planned.data[offset];
+        }
+    }
+
+    program.requests.assign(writes.requests.begin(), writes.requests.begin() + writes.loaderEnd);
+    program.loaderEnd = writes.loaderEnd;
+    program.loaderProbe = std::move(writes.loaderProbe);
+    program.records = 0;
+
+    // Read it back in runs of consecutive addresses
+    for(auto byte = contents.begin(); byte != contents.end();)
+    {
+        LoadRequest read;
+        read.label = "read back EEPROM";
+        read.state = "verify";
+        read.requestType = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+        read.request = RW_EEPROM;
+        read.value = byte->first;
+        do
+        {
+            read.data.push_back(byte->second);
+            ++byte;
+        }
+        while(byte != contents.end() && byte->first == read.value + read.data.size()
+              && read.data.size() < EZUSB_MAX_EEPROM_CHUNK);
+        program.requests.push_back(std::move(read));
+    }
+    return 0;
+}
+
+struct LoadEngine::Pending
+{
+    Run * run;
+    size_t index; // into the program, or PROBE
+    struct libusb_transfer * transfer;
+};
+
+struct LoadEngine::Run
+{
+    LoadEngine & engine;
+    libusb_device_handle * device;
+    LoadProgram program;
+    ProgressFn onProgress;
+    DoneFn onDone;
+    std::list<Run>::iterator self;
+
+    std::vector<bool> done; // per request
+    size_t next = 0; // first request not yet submitted
+    std::list<Pending> inFlight;
+    bool barrier = false; // what's in flight must complete on its own
+    bool probing = false;
+    size_t probeStep = 0; // into program.loaderProbe
+
+    // A write was rejected: once nothing is in flight, go back to it
+    size_t retryFrom = PROBE;
+
+    int status = 0;
+    std::string error;
+
+    std::string state;
+    size_t recordsDone = 0;
+
+    // One transfer per request that may be in flight at once
+    ezusb_pool * pool = nullptr;
+
+    Run(LoadEngine & engine, libusb_device_handle * device, LoadProgram && program, ProgressFn && onProgress, DoneFn && onDone):
+        engine(engine),
+        device(device),
+        program(std::move(program)),
+        onProgress(std::move(onProgress)),
+        onDone(std::move(onDone)),
+        done(this->program.requests.size(), false)
+    {}
+
+    ~Run()
+    {
+        ezusb_pool_free(pool);
+    }
+
+    Run(Run const &) = delete;
+    Run & operator=(Run const &) = delete;
+};
+
+static std::string format_error(const char *format, ...) PRINTF_FORMAT_ATTRIBUTE_AT(1, 2);
+static std::string format_error(const char *format, ...)
+{
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    return message;
+}
+
+// The libusb error matching a failed transfer
+static int transfer_error(enum libusb_transfer_status status)
+{
+    switch(status)
+    {
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        return LIBUSB_ERROR_TIMEOUT;
+    case LIBUSB_TRANSFER_STALL:
+        return LIBUSB_ERROR_PIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        return LIBUSB_ERROR_NO_DEVICE;
+    case LIBUSB_TRANSFER_OVERFLOW:
+        return LIBUSB_ERROR_OVERFLOW;
+    case LIBUSB_TRANSFER_CANCELLED:
+        return LIBUSB_ERROR_INTERRUPTED;
+    default:
+        return LIBUSB_ERROR_IO;
+    }
+}
+
+LoadEngine::LoadEngine(unsigned queueDepth):
+    queueDepth(std::max(queueDepth, 1u))
+{}
+
+LoadEngine::~LoadEngine()
+{
+    cancel();
+}
+
+void LoadEngine::cancel()
+{
+    stopping = true;
+    for(Run & run : runs)
+    {
+        for(Pending & pending : run.inFlight)
+        {
+            libusb_cancel_transfer(pending.transfer);
+        }
+    }
+    while(std::any_of(runs.begin(), runs.end(), [](Run const & run) { return !run.inFlight.empty(); }))
+    {
+        libusb_handle_events(nullptr);
+    }
+    runs.clear();
+    stopping = false;
+}
+
+void LoadEngine::start(libusb_device_handle * device, LoadProgram program, ProgressFn onProgress, DoneFn onDone)
+{
+    runs.emplace_back(*this, device, std::move(program), std::move(onProgress), std::move(onDone));
+    Run & run = runs.back();
+    run.self = std::prev(runs.end());
+
+    // Buffers for the largest request, as far as RAM writes get split
+    size_t longest = 1;
+    for(LoadRequest const & planned : run.program.requests)
+    {
+        longest = std::max(longest, planned.pipelined ? std::min<size_t>(planned.data.size(), ramChunk) : planned.data.size());
+    }
+    for(LoadRequest const & planned : run.program.loaderProbe)
+    {
+        longest = std::max(longest, planned.data.size());
+    }
+    run.pool = ezusb_pool_new(device, queueDepth, longest);
+    if(run.pool == nullptr)
+    {
+        run.status = LIBUSB_ERROR_NO_MEM;
+        run.error = "out of memory for transfers";
+        finish(run);
+        return;
+    }
+
+    // Skip loading the stage 1 loader if it's still running, as
+    // ezusb_probe_loader() finds out; pump() sends the probe
+    run.probing = run.program.loaderEnd > 0 && !run.program.loaderProbe.empty();
+    pump(run);
+}
+
+int LoadEngine::submit(Run & run, size_t index, LoadRequest const & planned, unsigned int timeout)
+{
+    // There are as many as can be in flight
+    struct libusb_transfer * transfer = ezusb_pool_get(run.pool);
+    if(transfer == nullptr)
+    {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+
+    uint16_t length = static_cast<uint16_t>(planned.data.size());
+    libusb_fill_control_setup(transfer->buffer, planned.requestType, planned.request, planned.value, planned.index, length);
+    if(!(planned.requestType & LIBUSB_ENDPOINT_IN))
+    {
+        memcpy(transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE, planned.data.data(), length);
+    }
+
+    run.inFlight.push_back(Pending{&run, index, transfer});
+    libusb_fill_control_transfer(transfer, run.device, transfer->buffer, transferDone, &run.inFlight.back(), timeout);
+
+    int status = libusb_submit_transfer(transfer);
+    if(status < 0)
+    {
+        run.inFlight.pop_back();
+        ezusb_pool_put(run.pool, transfer);
+        return status;
+    }
+    logverbose(EZUSB_LOG_DEBUG, "queue %s, addr 0x%04x len %4d (0x%04x)\n", planned.label.c_str(), planned.value, length, length);
+    return 0;
+}
+
+/*
+ * Handles a failed request: RAM writes too big for the device are split
+ * and retried, anything else fails the job.
+ */
+void LoadEngine::failed(Run & run, size_t index, int status)
+{
+    LoadRequest const & planned = run.program.requests[index];
+    if(planned.pipelined && planned.data.size() > EZUSB_MIN_RAM_CHUNK && ezusb_write_too_big(status))
+    {
+        uint16_t chunk = static_cast<uint16_t>(std::max<size_t>((planned.data.size() + 1) / 2, EZUSB_MIN_RAM_CHUNK));
+        if(chunk < ramChunk)
+        {
+            ramChunk = chunk;
+            logverbose(EZUSB_LOG_INFO, "%zu byte write rejected (%d), using %d byte chunks\n",
+                       planned.data.size(), status, ramChunk);
+        }
+        run.retryFrom = std::min(run.retryFrom, index);
+        return;
+    }
+
+    if(run.status == 0)
+    {
+        run.status = status;
+        run.error = format_error("%s at 0x%04x failed: %s", planned.label.c_str(), planned.value, libusb_error_name(status));
+    }
+}
+
+// Replaces a request by ones of at most chunk bytes each
+void LoadEngine::split(Run & run, size_t index, size_t chunk)
+{
+    std::vector<LoadRequest> & requests = run.program.requests;
+    LoadRequest whole = std::move(requests[index]);
+    std::vector<LoadRequest> parts;
+    for(size_t offset = 0; offset < whole.data.size(); offset += chunk)
+    {
+        LoadRequest part;
+        part.label = whole.label;
+        part.state = whole.state;
+        part.requestType = whole.requestType;
+        part.request = whole.request;
+        part.value = static_cast<uint16_t>(whole.value + offset);
+        part.index = whole.index;
+        part.data.assign(whole.data.begin() + offset, whole.data.begin() + std::min(offset + chunk, whole.data.size()));
+        part.pipelined = whole.pipelined;
+        part.record = whole.record;
+        parts.push_back(std::move(part));
+    }
+
+    requests.erase(requests.begin() + index);
+    requests.insert(requests.begin() + index, std::make_move_iterator(parts.begin()), std::make_move_iterator(parts.end()));
+    run.done.insert(run.done.begin() + index, parts.size() - 1, false);
+    if(index < run.program.loaderEnd)
+    {
+        run.program.loaderEnd += parts.size() - 1;
+    }
+}
+
+/*
+ * Submits whatever the job may have in flight next, or finishes it
+ */
+void LoadEngine::pump(Run & run)
+{
+    std::vector<LoadRequest> & requests = run.program.requests;
+    for(;;)
+    {
+        // One probe request at a time, until it fails or all of it passes
+        if(run.probing)
+        {
+            if(!run.inFlight.empty())
+            {
+                return;
+            }
+            if(submit(run, PROBE, run.program.loaderProbe[run.probeStep], PROBE_TIMEOUT_MS) == 0)
+            {
+                return;
+            }
+            run.probing = false;
+        }
+
+        // After a failure, let everything in flight land first
+        if(run.status != 0 || run.retryFrom != PROBE)
+        {
+            if(!run.inFlight.empty())
+            {
+                return;
+            }
+            if(run.status != 0)
+            {
+                finish(run);
+                return;
+            }
+            run.next = run.retryFrom;
+            run.retryFrom = PROBE;
+        }
+
+        while(run.next < requests.size() && run.done[run.next])
+        {
+            run.next++;
+        }
+        if(run.next == requests.size())
+        {
+            if(run.inFlight.empty())
+            {
+                finish(run);
+            }
+            return;
+        }
+
+        LoadRequest const & planned = requests[run.next];
+        if(!run.inFlight.empty() && (run.barrier || !planned.pipelined || run.inFlight.size() >= queueDepth))
+        {
+            return;
+        }
+        if(planned.pipelined && planned.data.size() > ramChunk)
+        {
+            split(run, run.next, ramChunk);
+            continue;
+        }
+
+        if(planned.state != run.state)
+        {
+            run.state = planned.state;
+            run.onProgress(planned.state == "eeprom" ? format_error("eeprom 0/%zu", run.program.records) : planned.state);
+        }
+
+        size_t index = run.next++;
+        run.barrier = !planned.pipelined;
+        int status = submit(run, index, planned, TRANSFER_TIMEOUT_MS);
+        if(status < 0)
+        {
+            failed(run, index, status);
+        }
+    }
+}
+
+void LoadEngine::complete(Run & run, size_t index, struct libusb_transfer * transfer)
+{
+    struct libusb_control_setup * setup = libusb_control_transfer_get_setup(transfer);
+    bool ok = transfer->status == LIBUSB_TRANSFER_COMPLETED && transfer->actual_length == setup->wLength;
+
+    if(index == PROBE)
+    {
+        // Other firmware may answer GET_EEPROM_SIZE too, but not with just
+        // 0 or 1, and not with the loader's code in RAM
+        std::vector<LoadRequest> const & probe = run.program.loaderProbe;
+        LoadRequest const & planned = probe[run.probeStep];
+        unsigned char const * answer = libusb_control_transfer_get_data(transfer);
+        bool answered = ok && (planned.request == GET_EEPROM_SIZE ? answer[0] <= 1
+                                                                   : std::equal(planned.data.begin(), planned.data.end(), answer));
+        if(!answered)
+        {
+            run.probing = false;
+        }
+        else if(++run.probeStep == probe.size())
+        {
+            run.probing = false;
+            logverbose(EZUSB_LOG_INFO, "stage 1 loader already running, not loading it again\n");
+            std::fill(run.done.begin(), run.done.begin() + run.program.loaderEnd, true);
+        }
+        return;
+    }
+
+    LoadRequest const & planned = run.program.requests[index];
+    if(!ok)
+    {
+        failed(run, index, transfer->status == LIBUSB_TRANSFER_COMPLETED ? LIBUSB_ERROR_IO : transfer_error(transfer->status));
+        return;
+    }
+
+    if(transfer->buffer[0] & LIBUSB_ENDPOINT_IN)
+    {
+        unsigned char const * answer = libusb_control_transfer_get_data(transfer);
+        auto mismatch = std::mismatch(planned.data.begin(), planned.data.end(), answer);
+        if(mismatch.first != planned.data.end() && run.status == 0)
+        {
+            run.status = 1;
+            if(planned.request == GET_EEPROM_SIZE)
+            {
+                run.error = "don't see a large enough EEPROM";
+            }
+            else
+            {
+                run.error = format_error("EEPROM doesn't match at 0x%04zx",
+                                         planned.value + static_cast<size_t>(mismatch.first - planned.data.begin()));
+            }
+            return;
+        }
+    }
+
+    run.done[index] = true;
+    if(planned.record)
+    {
+        run.recordsDone++;
+        run.onProgress(format_error("eeprom %zu/%zu", run.recordsDone, run.program.records));
+    }
+}
+
+void LIBUSB_CALL LoadEngine::transferDone(struct libusb_transfer * transfer)
+{
+    Pending * pending = static_cast<Pending *>(transfer->user_data);
+    Run & run = *pending->run;
+    size_t index = pending->index;
+    run.inFlight.remove_if([pending](Pending const & other) { return &other == pending; });
+
+    // Nothing is submitted between handing it back and pump()
+    LoadEngine & engine = run.engine;
+    if(!engine.stopping)
+    {
+        engine.complete(run, index, transfer);
+    }
+    ezusb_pool_put(run.pool, transfer);
+    if(!engine.stopping)
+    {
+        engine.pump(run);
+    }
+}
+
+void LoadEngine::finish(Run & run)
+{
+    DoneFn onDone = std::move(run.onDone);
+    int status = run.status;
+    std::string error = std::move(run.error);
+    runs.erase(run.self);
+    onDone(status, error);
+}
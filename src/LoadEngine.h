@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2026 Mbed CE
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#ifndef FXLOAD_LOADENGINE_H
+#define FXLOAD_LOADENGINE_H
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "libusb.h"
+#include "ezusb.h"
+#include "ezusb_image.h"
+
+/*
+ * One control request of a job, as the synchronous load code sends it.
+ * state names the step of the job it belongs to: "stage1" while loading
+ * the stage 1 loader, then "halt", "external", "internal", "reset",
+ * "check" (EEPROM size), "eeprom" or "verify".
+ */
+struct LoadRequest
+{
+    std::string label; // as logged by ezusb.c, e.g. "write on-chip"
+    std::string state;
+    uint8_t requestType = 0;
+    uint8_t request = 0;
+    uint16_t value = 0;
+    uint16_t index = 0;
+    std::vector<unsigned char> data; // what is written, or for reads, what must come back
+    bool pipelined = false; // RAM data, which may be in flight with its neighbours
+    bool record = false; // the data of one EEPROM record
+};
+
+/*
+ * Every request of a job, worked out before it starts by running the
+ * synchronous load code against a transport that records them.
+ */
+struct LoadProgram
+{
+    std::vector<LoadRequest> requests;
+
+    // Requests before this one load the stage 1 loader, and are skipped
+    // if a probe finds it already running
+    size_t loaderEnd = 0;
+
+    // The probe, as ezusb_probe_loader() sends it: GET_EEPROM_SIZE, then
+    // reads of on-chip RAM that must still hold the loader
+    std::vector<LoadRequest> loaderProbe;
+
+    // Number of EEPROM records written, for progress
+    size_t records = 0;
+};
+
+/*
+ * Plans loading an image into RAM, as ezusb_load_ram_image() does with
+ * stage 0.  Returns 0, or a negative value if the image can't be loaded.
+ */
+int plan_ram_load(LoadProgram & program, ezusb_image const * image, ezusb_chip_t type);
+
+/*
+ * Plans writing an image to EEPROM as ezusb_load_eeprom_image() does,
+ * after loading the given stage 1 loader (if not null).
+ */
+int plan_eeprom_load(LoadProgram & program, ezusb_image const * loader, ezusb_image const * image,
+                     ezusb_chip_t type, int config);
+
+/*
+ * Plans checking that EEPROM holds everything plan_eeprom_load() would
+ * write, after loading the stage 1 loader.
+ */
+int plan_eeprom_verify(LoadProgram & program, ezusb_image const * loader, ezusb_image const * image,
+                       ezusb_chip_t type, int config);
+
+/*
+ * Runs any number of jobs on different devices at once, from one thread.
+ * Each job walks through its program with asynchronous transfers: RAM
+ * writes are kept up to queueDepth in flight, everything else (CPUCS
+ * writes, EEPROM writes and reads) goes one at a time, in order.  Nothing
+ * blocks, so transfers complete wherever the caller handles libusb
+ * events, e.g. an EventLoop with libusb attached.
+ *
+ * RAM writes the device rejects as too big are split in halves and
+ * retried, down to EZUSB_MIN_RAM_CHUNK, and later jobs start from the
+ * size that worked.
+ * Each job takes its transfers from an ezusb_pool allocated as it starts,
+ * so sending a request only fills in a buffer the host can DMA from.
+ */
+class LoadEngine
+{
+public:
+    // Gets each state as the job reaches it, and "eeprom N/TOTAL" as
+    // records are written
+    using ProgressFn = std::function<void(std::string const & event)>;
+
+    // Gets 0 and an empty message on success, otherwise a negative libusb
+    // error or 1 if the device answered a read with something unexpected
+    using DoneFn = std::function<void(int status, std::string const & error)>;
+
+private:
+    struct Run;
+    struct Pending;
+
+    unsigned queueDepth;
+    uint16_t ramChunk = EZUSB_DEFAULT_RAM_CHUNK;
+    std::list<Run> runs;
+    bool stopping = false;
+
+    void pump(Run & run);
+    int submit(Run & run, size_t index, LoadRequest const & planned, unsigned int timeout);
+    void complete(Run & run, size_t index, struct libusb_transfer * transfer);
+    void failed(Run & run, size_t index, int status);
+    void split(Run & run, size_t index, size_t chunk);
+    void finish(Run & run);
+    static void LIBUSB_CALL transferDone(struct libusb_transfer * transfer);
+
+public:
+    explicit LoadEngine(unsigned queueDepth);
+    ~LoadEngine();
+
+    LoadEngine(LoadEngine const &) = delete;
+    LoadEngine & operator=(LoadEngine const &) = delete;
+
+    // Starts running a program on an opened device, which must stay open
+    // until onDone() has been called.  Both callbacks are called from
+    // wherever libusb events are handled (or from here, if the job can't
+    // get going at all).
+    void start(libusb_device_handle * device, LoadProgram program, ProgressFn onProgress, DoneFn onDone);
+
+    // Number of jobs still running
+    size_t active() const { return runs.size(); }
+
+    // Cancels the jobs still running, without calling their onDone(), and
+    // waits for their transfers to be given back.  Also done on destruction.
+    void cancel();
+};
+
+#endif //FXLOAD_LOADENGINE_H
@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2026 Mbed CE
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#include "Renumeration.h"
+#include "DeviceCache.h"
+
+#include <chrono>
+#include <thread>
+
+#include "ezusb_log.h"
+
+// How often to look at the device list when hotplug events aren't available
+static const std::chrono::milliseconds POLL_INTERVAL(20);
+
+RenumerationWaiter::RenumerationWaiter(uint16_t vid, uint16_t pid):
+matchIds(true),
+wantedVid(vid),
+wantedPid(pid)
+{
+    start();
+}
+
+RenumerationWaiter::RenumerationWaiter(libusb_device *dev):
+matchIds(false),
+wantedPortPath(get_device_port_path(dev))
+{
+    start();
+}
+
+void RenumerationWaiter::start()
+{
+    if(libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+    {
+        int rc = libusb_hotplug_register_callback(nullptr, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS,
+                                                  matchIds ? wantedVid : LIBUSB_HOTPLUG_MATCH_ANY,
+                                                  matchIds ? wantedPid : LIBUSB_HOTPLUG_MATCH_ANY,
+                                                  LIBUSB_HOTPLUG_MATCH_ANY, onHotplug, this, &hotplugHandle);
+        if(rc == LIBUSB_SUCCESS)
+        {
+            hotplugRegistered = true;
+            return;
+        }
+        logverbose(EZUSB_LOG_INFO, "can't register for hotplug events (%s), polling instead\n", libusb_error_name(rc));
+    }
+
+    // Remember what's there now, so the device showing up again stands out
+    libusb_device **list;
+    ssize_t count = libusb_get_device_list(nullptr, &list);
+    for(ssize_t i = 0; i < count; i++)
+    {
+        devicesBefore.emplace(libusb_get_bus_number(list[i]), libusb_get_device_address(list[i]));
+    }
+    if(count >= 0)
+    {
+        libusb_free_device_list(list, 1);
+    }
+}
+
+RenumerationWaiter::~RenumerationWaiter()
+{
+    if(hotplugRegistered)
+    {
+        libusb_hotplug_deregister_callback(nullptr, hotplugHandle);
+    }
+}
+
+bool RenumerationWaiter::matches(libusb_device *dev) const
+{
+    if(!matchIds)
+    {
+        return get_device_port_path(dev) == wantedPortPath;
+    }
+
+    struct libusb_device_descriptor desc;
+    return libusb_get_device_descriptor(dev, &desc) == 0 && desc.idVendor == wantedVid && desc.idProduct == wantedPid;
+}
+
+void RenumerationWaiter::recordArrival(libusb_device *dev)
+{
+    struct libusb_device_descriptor desc;
+    libusb_get_device_descriptor(dev, &desc);
+
+    arrived = true;
+    arrivalTimeUs = ezusb_clock_us();
+    vid = desc.idVendor;
+    pid = desc.idProduct;
+    portPath = get_device_port_path(dev);
+}
+
+int LIBUSB_CALL RenumerationWaiter::onHotplug(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *userData)
+{
+    auto *waiter = static_cast<RenumerationWaiter *>(userData);
+    if(!waiter->arrived && waiter->matches(dev))
+    {
+        waiter->recordArrival(dev);
+    }
+
+    // keep the callback registered; the destructor removes it
+    return 0;
+}
+
+/*
+ * Looks for a matching device that wasn't there before.  Returns true if
+ * one turned up.
+ */
+bool RenumerationWaiter::pollDeviceList()
+{
+    libusb_device **list;
+    ssize_t count = libusb_get_device_list(nullptr, &list);
+    for(ssize_t i = 0; i < count && !arrived; i++)
+    {
+        if(devicesBefore.count({libusb_get_bus_number(list[i]), libusb_get_device_address(list[i])}) == 0 && matches(list[i]))
+        {
+            recordArrival(list[i]);
+        }
+    }
+    if(count >= 0)
+    {
+        libusb_free_device_list(list, 1);
+    }
+    return arrived;
+}
+
+bool RenumerationWaiter::poll()
+{
+    if(hotplugRegistered && !arrived)
+    {
+        struct timeval noWait = {0, 0};
+        int completed = 0;
+        libusb_handle_events_timeout_completed(nullptr, &noWait, &completed);
+    }
+    return arrived || (!hotplugRegistered && pollDeviceList());
+}
+
+bool RenumerationWaiter::wait(uint64_t deadlineUs)
+{
+    while(!arrived)
+    {
+        uint64_t now = ezusb_clock_us();
+        if(now >= deadlineUs)
+        {
+            break;
+        }
+
+        if(hotplugRegistered)
+        {
+            struct timeval timeout;
+            timeout.tv_sec = static_cast<long>((deadlineUs - now) / 1000000);
+            timeout.tv_usec = static_cast<long>((deadlineUs - now) % 1000000);
+            int completed = 0;
+            libusb_handle_events_timeout_completed(nullptr, &timeout, &completed);
+        }
+        else if(!pollDeviceList())
+        {
+            std::this_thread::sleep_for(POLL_INTERVAL);
+        }
+    }
+    return arrived;
+}
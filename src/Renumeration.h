@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2026 Mbed CE
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#ifndef FXLOAD_RENUMERATION_H
+#define FXLOAD_RENUMERATION_H
+
+#include <cstdint>
+#include <set>
+#include <string>
+#include <utility>
+
+#include "libusb.h"
+
+/*
+ * Waits for a device to come back with its new identity after loaded
+ * firmware disconnects and re-enumerates.  Uses libusb hotplug events
+ * where the platform has them, and otherwise polls the device list.
+ *
+ * Construct one before resetting the device, so no arrival is missed.
+ */
+class RenumerationWaiter
+{
+    // What to wait for: these IDs if matchIds is set, else anything on this port
+    bool matchIds;
+    uint16_t wantedVid = 0, wantedPid = 0;
+    std::string wantedPortPath;
+
+    bool hotplugRegistered = false;
+    libusb_hotplug_callback_handle hotplugHandle = 0;
+
+    // For polling: devices (bus, address) present before the reset
+    std::set<std::pair<int, int>> devicesBefore;
+
+    void start();
+    bool matches(libusb_device *dev) const;
+    void recordArrival(libusb_device *dev);
+    bool pollDeviceList();
+
+    static int LIBUSB_CALL onHotplug(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *userData);
+
+public:
+    // Details of the device that showed up
+    bool arrived = false;
+    uint16_t vid = 0, pid = 0;
+    std::string portPath;
+    uint64_t arrivalTimeUs = 0;
+
+    // Wait for a device with these IDs
+    RenumerationWaiter(uint16_t vid, uint16_t pid);
+
+    // Wait for any new device on the same port as this one
+    explicit RenumerationWaiter(libusb_device *dev);
+
+    ~RenumerationWaiter();
+
+    RenumerationWaiter(RenumerationWaiter const &) = delete;
+    RenumerationWaiter & operator=(RenumerationWaiter const &) = delete;
+
+    // Waits until the device arrives, or until deadlineUs (on the
+    // ezusb_clock_us() clock).  Returns true if it arrived.
+    bool wait(uint64_t deadlineUs);
+
+    // Checks whether the device has arrived, without waiting
+    bool poll();
+};
+
+#endif //FXLOAD_RENUMERATION_H
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2026 Mbed CE
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#ifndef FXLOAD_SIMULATEDDEVICE_H
+#define FXLOAD_SIMULATEDDEVICE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "ezusb.h"
+
+/*
+ * A device that answers loader requests from memory, and keeps a clock of
+ * how long a real one would have taken: a fixed cost per request, the
+ * time to move the data over the bus, and for EEPROM writes, the time to
+ * program them.  Writes longer than maxControl fail, as the host stack
+ * would refuse them.  Used by fxload_bench and fxload_selftest, through
+ * ezusb_set_transport().
+ *
+ * If bulkBytesPerSec is set, its loader is also a fast loader (see
+ * FAST_LOADER_INFO), taking frames through ezusb_set_bulk_transport().
+ * Each bulk transfer costs the same fixed time as a request, and moves
+ * data at bulkBytesPerSec.  After bulkFailAfter transfers, the rest fail.
+ */
+struct SimulatedDevice
+{
+    static constexpr unsigned char BulkEndpoint = 0x02;
+
+    const char *profile;
+    double latencyUs;
+    double bytesPerSec;
+    double eepromBytesPerSec;
+    uint16_t maxControl;
+    double bulkBytesPerSec = 0;
+    uint16_t bulkMaxFrame = 4096;
+    size_t bulkFailAfter = SIZE_MAX;
+
+    double clockUs = 0;
+    size_t requests = 0;        // control requests and bulk transfers
+    size_t bulkTransfers = 0;
+    unsigned framesDone = 0;    // since the last sync
+    bool framesFailed = false;
+    std::vector<unsigned char> ram = std::vector<unsigned char>(0x10000);
+    std::vector<unsigned char> eeprom = std::vector<unsigned char>(0x10000);
+
+    static int transport(void *context, const char *label, unsigned char requestType, unsigned char request,
+                         unsigned short value, unsigned short index, unsigned char *data, uint16_t length)
+    {
+        auto *device = static_cast<SimulatedDevice *>(context);
+        bool isIn = requestType & LIBUSB_ENDPOINT_IN;
+        device->requests++;
+        device->clockUs += device->latencyUs;
+        if(length > device->maxControl)
+        {
+            return LIBUSB_ERROR_INVALID_PARAM;
+        }
+        device->clockUs += length / device->bytesPerSec * 1e6;
+
+        if(request == FAST_LOADER_INFO || request == FAST_LOADER_SYNC)
+        {
+            return device->fastRequest(request, data, length);
+        }
+
+        std::vector<unsigned char> & memory = request == RW_EEPROM ? device->eeprom : device->ram;
+        size_t room = memory.size() - value;
+        size_t len = std::min<size_t>(length, room);
+        if(request == GET_EEPROM_SIZE && isIn)
+        {
+            memset(data, 1, length); // 16 bit addresses
+        }
+        else if(isIn)
+        {
+            memcpy(data, memory.data() + value, len);
+        }
+        else
+        {
+            memcpy(memory.data() + value, data, len);
+            if(request == RW_EEPROM)
+            {
+                device->clockUs += static_cast<double>(len) / device->eepromBytesPerSec * 1e6;
+            }
+        }
+        return length;
+    }
+
+    static int bulk_transport(void *context, unsigned char endpoint, unsigned char *data, int length, int *transferred)
+    {
+        auto *device = static_cast<SimulatedDevice *>(context);
+        device->requests++;
+        device->clockUs += device->latencyUs;
+        if(device->bulkBytesPerSec == 0 || endpoint != BulkEndpoint)
+        {
+            return LIBUSB_ERROR_PIPE;
+        }
+        if(device->bulkTransfers++ >= device->bulkFailAfter)
+        {
+            return LIBUSB_ERROR_IO;
+        }
+        device->clockUs += length / device->bulkBytesPerSec * 1e6;
+
+        // Frames never span transfers
+        int offset = 0;
+        while(offset + 8 <= length)
+        {
+            unsigned char const *frame = data + offset;
+            unsigned addr = frame[2] | (frame[3] << 8);
+            unsigned len = frame[4] | (frame[5] << 8);
+            if(offset + 8 + static_cast<int>(len) > length || len > device->bulkMaxFrame || addr + len > 0x10000
+                || (frame[0] != RW_MEMORY && frame[0] != RW_EEPROM))
+            {
+                device->framesFailed = true;
+                break;
+            }
+            std::vector<unsigned char> & memory = frame[0] == RW_EEPROM ? device->eeprom : device->ram;
+            memcpy(memory.data() + addr, frame + 8, len);
+            if(frame[0] == RW_EEPROM)
+            {
+                device->clockUs += static_cast<double>(len) / device->eepromBytesPerSec * 1e6;
+            }
+            device->framesDone++;
+            offset += 8 + static_cast<int>(len);
+        }
+        if(offset != length)
+        {
+            device->framesFailed = true;
+        }
+        *transferred = length;
+        return 0;
+    }
+
+    // Answers FAST_LOADER_INFO and FAST_LOADER_SYNC
+    int fastRequest(unsigned char request, unsigned char *data, uint16_t length)
+    {
+        // A loader without a bulk endpoint stalls these, as Vend_Ax does
+        if(bulkBytesPerSec == 0)
+        {
+            return LIBUSB_ERROR_PIPE;
+        }
+        if(request == FAST_LOADER_INFO && length >= 8)
+        {
+            const unsigned char info[8] = {'F', 'X', 1, BulkEndpoint, 0, 0,
+                                           static_cast<unsigned char>(bulkMaxFrame & 0xFF),
+                                           static_cast<unsigned char>(bulkMaxFrame >> 8)};
+            memcpy(data, info, sizeof(info));
+            return 8;
+        }
+        if(request == FAST_LOADER_SYNC && length >= 4)
+        {
+            data[0] = framesFailed ? 1 : 0;
+            data[1] = 0;
+            data[2] = framesDone & 0xFF;
+            data[3] = (framesDone >> 8) & 0xFF;
+            framesDone = 0;
+            framesFailed = false;
+            return 4;
+        }
+        return LIBUSB_ERROR_PIPE;
+    }
+};
+
+#endif //FXLOAD_SIMULATEDDEVICE_H
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2026 Mbed CE
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#include "TopologyScheduler.h"
+#include "DeviceCache.h"
+
+// Root hubs are named by their bus number alone, e.g. "1"
+static bool is_root_hub(std::string const & portPath)
+{
+    return portPath.find('-') == std::string::npos;
+}
+
+std::string UsbLocation::branch() const
+{
+    return hubs.size() >= 2 ? hubs[hubs.size() - 2] : port;
+}
+
+UsbLocation get_usb_location(libusb_device *dev)
+{
+    UsbLocation location;
+    location.port = get_device_port_path(dev);
+    for(libusb_device *parent = libusb_get_parent(dev); parent != nullptr; parent = libusb_get_parent(parent))
+    {
+        location.hubs.push_back(get_device_port_path(parent));
+    }
+
+    // Some platforms can't tell parents apart; the port path names them too
+    if(location.hubs.empty())
+    {
+        std::string path = location.port;
+        for(size_t separator; (separator = path.find_last_of(".-")) != std::string::npos;)
+        {
+            path.erase(separator);
+            location.hubs.push_back(path);
+        }
+    }
+    return location;
+}
+
+TopologyScheduler::TopologyScheduler(unsigned maxJobs, unsigned maxPerHub):
+    maxJobs(maxJobs),
+    maxPerHub(maxPerHub)
+{}
+
+bool TopologyScheduler::fits(UsbLocation const & location) const
+{
+    if(running >= maxJobs)
+    {
+        return false;
+    }
+    for(std::string const & hub : location.hubs)
+    {
+        auto count = runningPerHub.find(hub);
+        if(!is_root_hub(hub) && count != runningPerHub.end() && count->second >= maxPerHub)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void TopologyScheduler::take(Request const & request)
+{
+    running++;
+    for(std::string const & hub : request.location.hubs)
+    {
+        runningPerHub[hub]++;
+    }
+    branchLoad[request.location.branch()] += request.cost;
+}
+
+void TopologyScheduler::grantWaiting()
+{
+    // Start callbacks may submit or release jobs, so they only run once
+    // the bookkeeping is done
+    std::vector<std::function<void()>> granted;
+    for(;;)
+    {
+        auto best = waiting.end();
+        uint64_t bestLoad = 0;
+        for(auto candidate = waiting.begin(); candidate != waiting.end(); ++candidate)
+        {
+            if(!fits(candidate->location))
+            {
+                continue;
+            }
+            auto branch = branchLoad.find(candidate->location.branch());
+            uint64_t load = branch == branchLoad.end() ? 0 : branch->second;
+            if(best == waiting.end() || candidate->cost > best->cost
+                || (candidate->cost == best->cost && load < bestLoad))
+            {
+                best = candidate;
+                bestLoad = load;
+            }
+        }
+        if(best == waiting.end())
+        {
+            break;
+        }
+        take(*best);
+        granted.push_back(std::move(best->start));
+        waiting.erase(best);
+    }
+
+    for(std::function<void()> const & start : granted)
+    {
+        start();
+    }
+}
+
+void TopologyScheduler::submit(UsbLocation const & location, uint64_t cost, std::function<void()> start)
+{
+    waiting.push_back(Request{location, cost, std::move(start)});
+    grantWaiting();
+}
+
+void TopologyScheduler::release(UsbLocation const & location, uint64_t cost)
+{
+    running--;
+    for(std::string const & hub : location.hubs)
+    {
+        if(--runningPerHub[hub] == 0)
+        {
+            runningPerHub.erase(hub);
+        }
+    }
+    uint64_t & load = branchLoad[location.branch()];
+    load -= cost;
+    if(load == 0)
+    {
+        branchLoad.erase(location.branch());
+    }
+    grantWaiting();
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2026 Mbed CE
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#ifndef FXLOAD_TOPOLOGYSCHEDULER_H
+#define FXLOAD_TOPOLOGYSCHEDULER_H
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "libusb.h"
+
+/*
+ * Where a device sits in the USB tree: its own port path, and the hubs
+ * between it and its root hub, nearest first, ending with the root hub.
+ */
+struct UsbLocation
+{
+    std::string port;
+    std::vector<std::string> hubs;
+
+    // The root hub port this device's traffic goes through (which may be
+    // the device itself, if it's plugged straight into the host).
+    std::string branch() const;
+};
+
+/*
+ * Works out a device's location.  Must be called while a device list
+ * from libusb_get_device_list() is held, for libusb_get_parent() to work.
+ */
+UsbLocation get_usb_location(libusb_device *dev);
+
+/*
+ * Decides when each of many concurrent load jobs may start.  Devices
+ * behind one hub share its bandwidth (and, for full speed devices on a
+ * USB 2.0 hub, its transaction translator), so at most maxPerHub jobs run
+ * behind any one external hub, and at most maxJobs in all.  When a slot
+ * frees up, the biggest waiting job that fits goes first, which shortens
+ * the total time for a batch; among equal jobs, the one on the least
+ * loaded root port goes first.
+ *
+ * Costs are in any unit, as long as all jobs use the same one.  Not
+ * thread safe: fxloadd uses it from its event loop only.
+ */
+class TopologyScheduler
+{
+    struct Request
+    {
+        UsbLocation location;
+        uint64_t cost;
+        std::function<void()> start;
+    };
+
+    unsigned maxJobs;
+    unsigned maxPerHub;
+
+    std::list<Request> waiting; // in arrival order
+    unsigned running = 0;
+    std::map<std::string, unsigned> runningPerHub;
+    std::map<std::string, uint64_t> branchLoad; // cost of jobs running behind each root port
+
+    bool fits(UsbLocation const & location) const;
+    void take(Request const & request);
+    void grantWaiting();
+
+public:
+    TopologyScheduler(unsigned maxJobs, unsigned maxPerHub);
+
+    // Queues a job of this cost on the device at location.  start() is
+    // called once it may begin, which may be before this returns.
+    void submit(UsbLocation const & location, uint64_t cost, std::function<void()> start);
+
+    // Called when a job started through submit() has finished.
+    void release(UsbLocation const & location, uint64_t cost);
+};
+
+#endif //FXLOAD_TOPOLOGYSCHEDULER_H
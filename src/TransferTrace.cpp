@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2026 Mbed CE
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#include "TransferTrace.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "ezusb_log.h"
+
+/*
+ * Trace files start with "FXTR", a 16 bit version and the chip type.  Then
+ * each request is a fixed size record, followed by the data it read (if
+ * any).  Everything is little endian.
+ */
+static const char TRACE_MAGIC[4] = {'F', 'X', 'T', 'R'};
+static const uint16_t TRACE_VERSION = 1;
+static const size_t TRACE_HEADER_SIZE = 8;
+static const size_t TRACE_RECORD_SIZE = 36;
+static const uint8_t TRACE_PIPELINED = 0x01;
+
+// How far ahead of the last match a replayed request is looked for
+static const size_t REPLAY_LOOKAHEAD = 64;
+
+static void put_le(unsigned char *out, uint64_t value, size_t bytes)
+{
+    for(size_t i = 0; i < bytes; i++)
+    {
+        out[i] = static_cast<unsigned char>(value >> (8 * i));
+    }
+}
+
+static uint64_t get_le(unsigned char const *in, size_t bytes)
+{
+    uint64_t value = 0;
+    for(size_t i = 0; i < bytes; i++)
+    {
+        value |= static_cast<uint64_t>(in[i]) << (8 * i);
+    }
+    return value;
+}
+
+// FNV-1a, enough to tell if two payloads differ
+static uint64_t hash_payload(unsigned char const *data, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for(size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+TraceRecorder::TraceRecorder(std::string const & path, ezusb_chip_t type):
+file(fopen(path.c_str(), "wb"))
+{
+    if(file == nullptr)
+    {
+        logerror("%s: unable to create trace file.\n", path.c_str());
+        return;
+    }
+
+    unsigned char header[TRACE_HEADER_SIZE] = {};
+    memcpy(header, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    put_le(header + 4, TRACE_VERSION, 2);
+    header[6] = static_cast<unsigned char>(type);
+    fwrite(header, 1, sizeof(header), file);
+    ezusb_set_trace(onRequest, this);
+}
+
+TraceRecorder::~TraceRecorder()
+{
+    if(file != nullptr)
+    {
+        ezusb_set_trace(nullptr, nullptr);
+        logverbose(EZUSB_LOG_INFO, "traced %zu requests\n", count);
+        fclose(file);
+    }
+}
+
+void TraceRecorder::onRequest(void *context, const ezusb_trace_event *event)
+{
+    auto *recorder = static_cast<TraceRecorder *>(context);
+    if(recorder->count++ == 0)
+    {
+        recorder->firstUs = event->start_us;
+    }
+
+    // Reads keep what came back, so a replay can answer them the same way
+    bool isIn = event->requestType & LIBUSB_ENDPOINT_IN;
+    size_t payloadLen = isIn ? static_cast<size_t>(std::max(event->status, 0)) : event->length;
+    size_t replyLen = isIn ? payloadLen : 0;
+
+    unsigned char record[TRACE_RECORD_SIZE];
+    record[0] = event->requestType;
+    record[1] = event->request;
+    record[2] = event->pipelined ? TRACE_PIPELINED : 0;
+    record[3] = 0;
+    put_le(record + 4, event->value, 2);
+    put_le(record + 6, event->index, 2);
+    put_le(record + 8, event->length, 2);
+    put_le(record + 10, replyLen, 2);
+    put_le(record + 12, static_cast<uint32_t>(event->status), 4);
+    put_le(record + 16, event->start_us - recorder->firstUs, 8);
+    put_le(record + 24, event->end_us - event->start_us, 4);
+    put_le(record + 28, hash_payload(event->data, payloadLen), 8);
+    fwrite(record, 1, sizeof(record), recorder->file);
+    if(replyLen > 0)
+    {
+        fwrite(event->data, 1, replyLen, recorder->file);
+    }
+
+    // Keep what's recorded if the run crashes
+    fflush(recorder->file);
+}
+
+bool read_trace(std::string const & path, ezusb_chip_t & type, std::vector<TraceEntry> & entries)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if(file == nullptr)
+    {
+        logerror("%s: unable to open for input.\n", path.c_str());
+        return false;
+    }
+
+    unsigned char header[TRACE_HEADER_SIZE];
+    if(fread(header, 1, sizeof(header), file) != sizeof(header)
+        || memcmp(header, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0
+        || get_le(header + 4, 2) != TRACE_VERSION
+        || header[6] < AN21 || header[6] > FX2LP)
+    {
+        logerror("%s: not an fxload trace file\n", path.c_str());
+        fclose(file);
+        return false;
+    }
+    type = static_cast<ezusb_chip_t>(header[6]);
+
+    unsigned char record[TRACE_RECORD_SIZE];
+    size_t got;
+    while((got = fread(record, 1, sizeof(record), file)) == sizeof(record))
+    {
+        TraceEntry entry;
+        entry.requestType = record[0];
+        entry.request = record[1];
+        entry.pipelined = (record[2] & TRACE_PIPELINED) != 0;
+        entry.value = static_cast<uint16_t>(get_le(record + 4, 2));
+        entry.index = static_cast<uint16_t>(get_le(record + 6, 2));
+        entry.length = static_cast<uint16_t>(get_le(record + 8, 2));
+        entry.status = static_cast<int32_t>(get_le(record + 12, 4));
+        entry.startUs = get_le(record + 16, 8);
+        entry.durationUs = static_cast<uint32_t>(get_le(record + 24, 4));
+        entry.payloadHash = get_le(record + 28, 8);
+        entry.reply.resize(get_le(record + 10, 2));
+        if(fread(entry.reply.data(), 1, entry.reply.size(), file) != entry.reply.size())
+        {
+            got = 1;
+            break;
+        }
+        entries.push_back(std::move(entry));
+    }
+    fclose(file);
+
+    // A run that died mid-write leaves a partial last record
+    if(got != 0)
+    {
+        logerror("%s: trace ends part way through request %zu, ignoring it\n", path.c_str(), entries.size() + 1);
+    }
+    logverbose(EZUSB_LOG_INFO, "%s: %zu requests recorded on %s\n", path.c_str(), entries.size(), ezusb_name[type]);
+    return true;
+}
+
+TraceReplay::TraceReplay(std::vector<TraceEntry> entries):
+entries(std::move(entries))
+{
+}
+
+int TraceReplay::transport(void *context, const char *label, unsigned char requestType, unsigned char request,
+                           unsigned short value, unsigned short index, unsigned char *data, uint16_t length)
+{
+    return static_cast<TraceReplay *>(context)->answer(requestType, request, value, index, data, length);
+}
+
+int TraceReplay::answer(uint8_t requestType, uint8_t request, uint16_t value, uint16_t index, unsigned char *data, uint16_t length)
+{
+    bool isIn = requestType & LIBUSB_ENDPOINT_IN;
+
+    size_t end = std::min(entries.size(), next + REPLAY_LOOKAHEAD);
+    size_t found = next;
+    while(found < end && !(entries[found].requestType == requestType && entries[found].request == request
+                           && entries[found].value == value && entries[found].index == index
+                           && entries[found].length == length))
+    {
+        found++;
+    }
+
+    if(found == end)
+    {
+        logverbose(EZUSB_LOG_INFO, "replay: 0x%02x %s 0x%04x len %u isn't in the trace\n",
+                   request, isIn ? "in" : "out", value, length);
+        added++;
+        elapsedUs += latencyUs + length / bytesPerSec * 1e6;
+
+        // Answer reads the way a loader with a 16 bit address EEPROM would
+        if(isIn)
+        {
+            memset(data, 1, length);
+        }
+        return length;
+    }
+
+    if(found > next)
+    {
+        logverbose(EZUSB_LOG_INFO, "replay: %zu recorded requests before request %zu weren't made\n", found - next, found + 1);
+        skipped += found - next;
+    }
+    TraceEntry const & entry = entries[found];
+    next = found + 1;
+    matched++;
+
+    // As long as it took then; recorded pipelined writes overlapped, so
+    // what counts is how soon the next request followed
+    double durationUs = entry.durationUs;
+    if(next < entries.size() && entries[next].startUs >= entry.startUs)
+    {
+        durationUs = static_cast<double>(entries[next].startUs - entry.startUs);
+    }
+    elapsedUs += durationUs;
+
+    if(entry.status < 0)
+    {
+        failuresRepeated++;
+    }
+    if(isIn)
+    {
+        memset(data, 0, length);
+        memcpy(data, entry.reply.data(), std::min<size_t>(entry.reply.size(), length));
+    }
+    else if(hash_payload(data, length) != entry.payloadHash)
+    {
+        logverbose(EZUSB_LOG_INFO, "replay: request %zu wrote different data to 0x%04x\n", found + 1, value);
+        dataDiffers++;
+    }
+    return entry.status;
+}
+
+void TraceReplay::printReport(std::string const & path) const
+{
+    uint64_t recordedUs = 0;
+    for(TraceEntry const & entry : entries)
+    {
+        recordedUs = std::max(recordedUs, entry.startUs + entry.durationUs);
+    }
+
+    double recordedMs = static_cast<double>(recordedUs) / 1000;
+    printf("Replay of %s: %zu requests recorded, taking %.1f ms\n", path.c_str(), entries.size(), recordedMs);
+    printf("  %zu requests matched the trace (%zu with different data, %zu failing as recorded)\n",
+           matched, dataDiffers, failuresRepeated);
+    printf("  %zu recorded requests weren't made, %zu new requests were timed with the model\n",
+           skipped + (entries.size() - next), added);
+    printf("  replayed load took %.1f ms", elapsedUs / 1000);
+    if(recordedUs > 0)
+    {
+        printf(" (%+.1f%%)", (elapsedUs / 1000 - recordedMs) * 100 / recordedMs);
+    }
+    printf("\n");
+}
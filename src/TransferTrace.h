@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2026 Mbed CE
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#ifndef FXLOAD_TRANSFERTRACE_H
+#define FXLOAD_TRANSFERTRACE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "ezusb.h"
+
+/*
+ * One control request from a trace, as it went to the device.
+ */
+struct TraceEntry
+{
+    uint8_t requestType = 0;
+    uint8_t request = 0;
+    bool pipelined = false;
+    uint16_t value = 0;
+    uint16_t index = 0;
+    uint16_t length = 0;
+    int32_t status = 0;           // bytes transferred, or a negative libusb error
+    uint64_t startUs = 0;         // since the trace started
+    uint32_t durationUs = 0;
+    uint64_t payloadHash = 0;     // of the data sent, or received
+    std::vector<uint8_t> reply;   // data received, for reads
+};
+
+/*
+ * Writes every control request fxload makes on this thread to a trace
+ * file, for as long as it exists.  The file is written as requests
+ * complete, so a run that dies part way still leaves a trace of what it
+ * got through.
+ */
+class TraceRecorder
+{
+    FILE *file;
+    uint64_t firstUs = 0;
+    size_t count = 0;
+
+    static void onRequest(void *context, const ezusb_trace_event *event);
+
+public:
+    TraceRecorder(std::string const & path, ezusb_chip_t type);
+    ~TraceRecorder();
+
+    TraceRecorder(TraceRecorder const &) = delete;
+    TraceRecorder & operator=(TraceRecorder const &) = delete;
+
+    // False if the file couldn't be created (which has been logged)
+    bool isOpen() const { return file != nullptr; }
+};
+
+/*
+ * Reads a trace written by TraceRecorder, and the type of chip it was
+ * recorded on.  Returns false (after logging why) if it can't be read.
+ */
+bool read_trace(std::string const & path, ezusb_chip_t & type, std::vector<TraceEntry> & entries);
+
+/*
+ * Stands in for the device a trace was recorded on, as an ezusb
+ * transport.  Each request is looked for a little way ahead in the trace;
+ * if found, it gets the recorded status and reply and takes as long as it
+ * did then, so failures and slow spots happen again.  Requests the trace
+ * doesn't hold, e.g. because the loading code has changed since, succeed
+ * and are timed with the transfer model.  Time is simulated, not waited.
+ */
+class TraceReplay
+{
+    std::vector<TraceEntry> entries;
+    size_t next = 0;
+
+    size_t matched = 0;
+    size_t dataDiffers = 0;
+    size_t failuresRepeated = 0;
+    size_t skipped = 0;
+    size_t added = 0;
+    double elapsedUs = 0;
+
+    int answer(uint8_t requestType, uint8_t request, uint16_t value, uint16_t index, unsigned char *data, uint16_t length);
+
+public:
+    // Model for requests that aren't in the trace
+    double latencyUs = 1000;
+    double bytesPerSec = 500 * 1024;
+
+    explicit TraceReplay(std::vector<TraceEntry> entries);
+
+    static int transport(void *context, const char *label, unsigned char requestType, unsigned char request,
+                         unsigned short value, unsigned short index, unsigned char *data, uint16_t length);
+
+    // Compares the replayed run with the recorded one
+    void printReport(std::string const & path) const;
+};
+
+#endif //FXLOAD_TRANSFERTRACE_H
@@ -25,23 +25,14 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stdarg.h>
 
 #include "libusb.h"
 
 #include "ezusb.h"
+#include "ezusb_image.h"
 
 const char *ezusb_name[] = { "NONE", "AN21", "FX", "FX2", "FX2LP" };
 
-void logerror(const char *format, ...)
-{
-    va_list ap;
-    va_start(ap, format);
-
-    vfprintf(stderr, format, ap);
-    va_end(ap);
-}
-
 /*
  * This file contains functions for downloading firmware into Cypress
  * EZ-USB microcontrollers. These chips use control endpoint 0 and vendor
@@ -61,81 +52,212 @@ void logerror(const char *format, ...)
  * The Cypress FX parts are largely compatible with the Anchorhip ones.
  */
 
-int verbose;
+/*
+ * Compile-time sanity check, usable in C99.  A false condition
+ * declares an array of negative size.
+ */
+#define EZUSB_STATIC_ASSERT(cond, name) \
+    typedef char ezusb_static_assert_##name [(cond) ? 1 : -1]
+
+/* EEPROM image header lengths: type byte, VID, PID, DID, then config */
+#define AN21_EEPROM_HEADER_LEN	7
+#define FX_EEPROM_HEADER_LEN	9
+#define FX2_EEPROM_HEADER_LEN	8
+
+EZUSB_STATIC_ASSERT(AN21_EEPROM_HEADER_LEN == EZUSB_EEPROM_CONFIG_OFFSET, an21_has_no_config_byte);
+EZUSB_STATIC_ASSERT(FX2_EEPROM_HEADER_LEN > EZUSB_EEPROM_CONFIG_OFFSET, fx2_header_holds_config);
+EZUSB_STATIC_ASSERT(FX_EEPROM_HEADER_LEN > EZUSB_EEPROM_RESERVED_OFFSET, fx_header_holds_reserved);
 
 /*
- * return true iff [addr,addr+len) includes external RAM
- * for Anchorchips EZ-USB or Cypress EZ-USB FX
+ * Per-chip memory maps and EEPROM layouts, indexed by ezusb_chip_t.
  */
-static int fx_is_external (unsigned short addr, size_t len)
-{
-    /* with 8KB RAM, 0x0000-0x1b3f can be written
-     * we can't tell if it's a 4KB device here
+static const struct ezusb_chip_traits chip_traits[] = {
+    [NONE] = { NONE },
+
+    /* AnchorChips EZ-USB: same memory map as FX, and no config byte.
+     * With 8KB RAM, 0x0000-0x1b3f can be written; we can't tell if it's
+     * a 4KB device here.  There may be more RAM, but it's unclear if we
+     * can write it: some bulk buffers may be unused, 0x1b3f-0x1f3f, and
+     * firmware can set ISODISAB for 2KB at 0x2000-0x27ff.
      */
-    if (addr <= 0x1b3f)
-	return ((addr + len) > 0x1b40);
+    [AN21] = {
+	AN21, 0x7f92, 0xB2, AN21_EEPROM_HEADER_LEN, 0x00, false,
+	1, { { 0x0000, 0x1b3f } }
+    },
+
+    /* Cypress EZ-USB FX */
+    [FX] = {
+	FX, 0x7f92, 0xB6, FX_EEPROM_HEADER_LEN, 0x07, true,
+	1, { { 0x0000, 0x1b3f } }
+    },
+
+    /* Cypress EZ-USB FX2: 8KB for data/code, and 512 for data */
+    [FX2] = {
+	FX2, 0xe600, 0xC2, FX2_EEPROM_HEADER_LEN, 0x4f, false,
+	2, { { 0x0000, 0x1fff }, { 0xe000, 0xe1ff } }
+    },
+
+    /* Cypress EZ-USB FX2LP: 16KB for data/code, and 512 for data */
+    [FX2LP] = {
+	FX2LP, 0xe600, 0xC2, FX2_EEPROM_HEADER_LEN, 0x4f, false,
+	2, { { 0x0000, 0x3fff }, { 0xe000, 0xe1ff } }
+    },
+};
 
-    /* there may be more RAM; unclear if we can write it.
-     * some bulk buffers may be unused, 0x1b3f-0x1f3f
-     * firmware can set ISODISAB for 2KB at 0x2000-0x27ff
-     */
-    return 1;
+/* every chip type needs an entry */
+EZUSB_STATIC_ASSERT(sizeof chip_traits / sizeof chip_traits[0] == FX2LP + 1, chip_traits_complete);
+
+const struct ezusb_chip_traits *ezusb_get_chip_traits (ezusb_chip_t type)
+{
+    if (type <= NONE || type > FX2LP)
+	return 0;
+    return &chip_traits[type];
 }
 
 /*
- * return true iff [addr,addr+len) includes external RAM
- * for Cypress EZ-USB FX2
+ * Default IDs of unconfigured devices (no EEPROM, or one without IDs).
+ * The FX2 and FX2LP share 04b4:8613, and nothing the loader can read
+ * tells them apart, so that ID maps to the FX2: its 8 KB map is safe on
+ * both, and an FX2LP only needs -t for images using the rest of its RAM.
+ * The FX1 has the FX2LP's memory map and EEPROM layout.  0547:2235 is
+ * left out, as both AN21 and original FX parts have been seen with it.
  */
-static int fx2_is_external (unsigned short addr, size_t len)
+static const struct {
+    uint16_t		vid;
+    uint16_t		pid;
+    ezusb_chip_t	type;
+} known_ids[] = {
+    { 0x0547, 0x2122, AN21 },	/* EZ-USB 2122S */
+    { 0x0547, 0x2125, AN21 },	/* EZ-USB 2121S/2125S */
+    { 0x0547, 0x2126, AN21 },	/* EZ-USB 2126S */
+    { 0x0547, 0x2131, AN21 },	/* EZ-USB 2131Q/2131S/2135S */
+    { 0x0547, 0x2136, AN21 },	/* EZ-USB 2136S */
+    { 0x0547, 0x2225, AN21 },	/* EZ-USB 2225 */
+    { 0x0547, 0x2226, AN21 },	/* EZ-USB 2226 */
+    { 0x0547, 0x2236, AN21 },	/* EZ-USB 2236 */
+    { 0x04b4, 0x6473, FX2LP },	/* EZ-USB FX1 */
+    { 0x04b4, 0x8613, FX2 },	/* EZ-USB FX2, or FX2LP */
+};
+
+ezusb_chip_t ezusb_chip_from_ids (uint16_t vid, uint16_t pid)
 {
-    /* 1st 8KB for data/code, 0x0000-0x1fff */
-    if (addr <= 0x1fff)
-	return ((addr + len) > 0x2000);
+    size_t	i;
 
-    /* and 512 for data, 0xe000-0xe1ff */
-    else if (addr >= 0xe000 && addr <= 0xe1ff)
-	return ((addr + len) > 0xe200);
+    for (i = 0; i < sizeof known_ids / sizeof known_ids[0]; i++) {
+	if (known_ids[i].vid == vid && known_ids[i].pid == pid)
+	    return known_ids[i].type;
+    }
+    return NONE;
+}
 
-    /* otherwise, it's certainly external */
-    else
-	return 1;
+const struct ezusb_mem_region *ezusb_find_region (const struct ezusb_chip_traits *chip, unsigned short addr)
+{
+    unsigned	i;
+
+    for (i = 0; i < chip->internal_count; i++) {
+	const struct ezusb_mem_region	*r = &chip->internal[i];
+
+	if (addr >= r->start && addr <= r->end)
+	    return r;
+    }
+    return 0;
 }
 
-/*
- * return true iff [addr,addr+len) includes external RAM
- * for Cypress EZ-USB FX2LP
- */
-static int fx2lp_is_external (unsigned short addr, size_t len)
+unsigned short ezusb_region_end (const struct ezusb_chip_traits *chip, unsigned short addr)
 {
-    /* 1st 16KB for data/code, 0x0000-0x3fff */
-    if (addr <= 0x3fff)
-	return ((addr + len) > 0x4000);
+    const struct ezusb_mem_region *r = ezusb_find_region (chip, addr);
+    unsigned short	end = 0xffff;
+    unsigned		i;
 
-    /* and 512 for data, 0xe000-0xe1ff */
-    else if (addr >= 0xe000 && addr <= 0xe1ff)
-	return ((addr + len) > 0xe200);
+    if (r)
+	return r->end;
+
+    /* external memory runs up to the next on-chip region */
+    for (i = 0; i < chip->internal_count; i++) {
+	if (chip->internal[i].start > addr && chip->internal[i].start - 1 < end)
+	    end = chip->internal[i].start - 1;
+    }
+    return end;
+}
+
+int ezusb_is_external (const struct ezusb_chip_traits *chip, unsigned short addr, size_t len)
+{
+    const struct ezusb_mem_region *r = ezusb_find_region (chip, addr);
+
+    if (r)
+	return (addr + len) > ((size_t) r->end + 1);
 
     /* otherwise, it's certainly external */
-    else
-	return 1;
+    return 1;
 }
 
 /*****************************************************************************/
 
 
+static EZUSB_THREAD_LOCAL ezusb_transport_fn	transport;
+static EZUSB_THREAD_LOCAL void			*transport_context;
+
+void ezusb_set_transport (ezusb_transport_fn fn, void *context)
+{
+    transport = fn;
+    transport_context = context;
+}
+
+static EZUSB_THREAD_LOCAL ezusb_bulk_transport_fn	bulk_transport;
+static EZUSB_THREAD_LOCAL void			*bulk_transport_context;
+
+void ezusb_set_bulk_transport (ezusb_bulk_transport_fn fn, void *context)
+{
+    bulk_transport = fn;
+    bulk_transport_context = context;
+}
+
+static EZUSB_THREAD_LOCAL ezusb_trace_fn	trace;
+static EZUSB_THREAD_LOCAL void			*trace_context;
+
+void ezusb_set_trace (ezusb_trace_fn fn, void *context)
+{
+    trace = fn;
+    trace_context = context;
+}
+
+static void trace_request (unsigned char requestType, unsigned char request,
+	unsigned short value, unsigned short index, const unsigned char *data,
+	uint16_t length, int status, bool pipelined, uint64_t start_us)
+{
+    struct ezusb_trace_event	event;
+
+    event.requestType = requestType;
+    event.request = request;
+    event.value = value;
+    event.index = index;
+    event.length = length;
+    event.data = data;
+    event.status = status;
+    event.pipelined = pipelined;
+    event.start_us = start_us;
+    event.end_us = ezusb_clock_us ();
+    trace (trace_context, &event);
+}
+
 /*
  * Issue a control request to the specified device.
  * This is O/S specific ...
  */
-static inline int ctrl_msg (
+static inline int ctrl_send (
     libusb_device_handle		*device,
+    const char				*label,
     unsigned char			requestType,
     unsigned char			request,
     unsigned short			value,
     unsigned short			index,
     unsigned char			*data,
-    uint16_t				length
+    uint16_t				length,
+    unsigned				timeout
 ) {
+    if (transport)
+	return transport (transport_context, label, requestType, request,
+		value, index, data, length);
 
     return libusb_control_transfer(device, 
 			   requestType,
@@ -144,21 +266,249 @@ static inline int ctrl_msg (
 			   index,
 			   data,
 			   length,
-			   10000);
+			   timeout);
+}
+
+/* milliseconds; probes use the short one, since a busy device never answers */
+#define CTRL_TIMEOUT_MS		10000
+#define PROBE_TIMEOUT_MS	1000
+
+static int ctrl_msg_timeout (
+    libusb_device_handle		*device,
+    const char				*label,
+    unsigned char			requestType,
+    unsigned char			request,
+    unsigned short			value,
+    unsigned short			index,
+    unsigned char			*data,
+    uint16_t				length,
+    unsigned				timeout
+) {
+    uint64_t	start;
+    int		status;
+
+    if (!trace)
+	return ctrl_send (device, label, requestType, request, value, index, data, length,
+		timeout);
+
+    start = ezusb_clock_us ();
+    status = ctrl_send (device, label, requestType, request, value, index, data, length,
+	    timeout);
+    trace_request (requestType, request, value, index, data, length, status, false, start);
+    return status;
+}
+
+static int ctrl_msg (
+    libusb_device_handle		*device,
+    const char				*label,
+    unsigned char			requestType,
+    unsigned char			request,
+    unsigned short			value,
+    unsigned short			index,
+    unsigned char			*data,
+    uint16_t				length
+) {
+    return ctrl_msg_timeout (device, label, requestType, request, value, index, data, length,
+	    CTRL_TIMEOUT_MS);
 }
 
+/*****************************************************************************/
 
 /*
- * These are the requests (bRequest) that the bootstrap loader is expected
- * to recognize.  The codes are reserved by Cypress, and these values match
- * what EZ-USB hardware, or "Vend_Ax" firmware (2nd stage loader) uses.
- * Cypress' "a3load" is nice because it supports both FX and FX2, although
- * it doesn't have the EEPROM support (subset of "Vend_Ax").
+ * A second stage loader that also takes writes on a bulk endpoint, while
+ * it runs; see ezusb_attach_fast_loader().  Only the loops writing
+ * external RAM and EEPROM batch frames, and they sync before returning,
+ * so no other request is ever sent while frames are outstanding.
  */
-#define RW_INTERNAL	0xA0		/* hardware implements this one */
-#define RW_EEPROM	0xA2
-#define RW_MEMORY	0xA3
-#define GET_EEPROM_SIZE	0xA5
+#define FAST_FRAME_HEADER	8
+#define FAST_BATCH_SIZE		16384
+
+struct fast_loader {
+    libusb_device_handle	*device;
+    unsigned char		endpoint;
+    int				interface;	/* claimed, or -1 through a transport */
+    uint16_t			max_data;	/* per frame */
+    unsigned			frames;		/* since the last sync */
+    size_t			used;
+    unsigned char		batch [FAST_BATCH_SIZE];
+};
+
+static EZUSB_THREAD_LOCAL struct fast_loader	*fast;
+
+static struct fast_loader *fast_for (libusb_device_handle *device)
+{
+    return fast && fast->device == device ? fast : NULL;
+}
+
+/* forgets frames that won't be sent, after a failure */
+static void fast_discard (struct fast_loader *loader)
+{
+    if (loader) {
+	loader->used = 0;
+	loader->frames = 0;
+    }
+}
+
+static int fast_flush (struct fast_loader *loader)
+{
+    int		actual = 0;
+    int		status;
+
+    if (loader->used == 0)
+	return 0;
+    logverbose(EZUSB_LOG_DEBUG, "bulk write of %zu bytes to endpoint 0x%02x\n",
+	loader->used, loader->endpoint);
+    if (bulk_transport)
+	status = bulk_transport (bulk_transport_context, loader->endpoint, loader->batch,
+		(int) loader->used, &actual);
+    else
+	status = libusb_bulk_transfer (loader->device, loader->endpoint, loader->batch,
+		(int) loader->used, &actual, CTRL_TIMEOUT_MS);
+    if (status == 0 && (size_t) actual != loader->used)
+	status = LIBUSB_ERROR_IO;
+    if (status < 0) {
+	logerror("bulk write to 2nd stage loader: %s\n", libusb_error_name (status));
+	fast_discard (loader);
+	return status;
+    }
+    loader->used = 0;
+    return 0;
+}
+
+/*
+ * Sends what's batched, then waits for the loader to say it has written
+ * every frame since the last sync.
+ */
+static int fast_sync (struct fast_loader *loader)
+{
+    unsigned char	reply [4] = { 0 };
+    unsigned		done;
+    int			status;
+
+    status = fast_flush (loader);
+    if (status < 0 || loader->frames == 0)
+	return status;
+
+    status = ctrl_msg (loader->device, "sync 2nd stage loader",
+	LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+	FAST_LOADER_SYNC, 0, 0, reply, sizeof reply);
+    done = reply [2] | (reply [3] << 8);
+    if (status != sizeof reply) {
+	logerror("sync 2nd stage loader: %s\n",
+	    status < 0 ? libusb_error_name (status) : "short reply");
+	status = status < 0 ? status : LIBUSB_ERROR_IO;
+    } else if (reply [0] != 0 || done != (loader->frames & 0xFFFF)) {
+	logerror("2nd stage loader failed writes (status %d, %u of %u frames done)\n",
+	    reply [0], done, loader->frames);
+	status = LIBUSB_ERROR_IO;
+    } else
+	status = 0;
+    loader->frames = 0;
+    return status;
+}
+
+/* whether a frame of len data bytes needs the batch sent first */
+static int fast_batch_full (const struct fast_loader *loader, size_t len)
+{
+    return loader->used + FAST_FRAME_HEADER + len > sizeof loader->batch;
+}
+
+/*
+ * Batches one frame, of the prefix and then the data, sending the batch
+ * first if it's full.
+ */
+static int fast_write (struct fast_loader *loader, unsigned char request, unsigned short addr,
+	const unsigned char *prefix, uint16_t prefix_len,
+	const unsigned char *data, uint16_t len)
+{
+    unsigned char	*frame;
+    uint16_t		total = prefix_len + len;
+    int			status;
+
+    if (fast_batch_full (loader, total)) {
+	status = fast_flush (loader);
+	if (status < 0)
+	    return status;
+    }
+
+    logverbose(EZUSB_LOG_INFO, "frame 0x%02x, addr 0x%04x len %4d (0x%04x)\n",
+	request, addr, total, total);
+    frame = loader->batch + loader->used;
+    frame [0] = request;
+    frame [1] = 0;
+    frame [2] = addr & 0xFF;
+    frame [3] = addr >> 8;
+    frame [4] = total & 0xFF;
+    frame [5] = total >> 8;
+    frame [6] = 0;
+    frame [7] = 0;
+    if (prefix_len)
+	memcpy (frame + FAST_FRAME_HEADER, prefix, prefix_len);
+    memcpy (frame + FAST_FRAME_HEADER + prefix_len, data, len);
+    loader->used += FAST_FRAME_HEADER + total;
+    loader->frames++;
+    return 0;
+}
+
+int ezusb_attach_fast_loader (libusb_device_handle *device)
+{
+    unsigned char	info [8] = { 0 };
+    unsigned		max_data;
+    int			status;
+
+    ezusb_detach_fast_loader ();
+
+    /* a transport only has bulk transfers if it says so */
+    if (!transport != !bulk_transport)
+	return 0;
+
+    /* Vend_Ax and the hardware loader stall requests they don't know */
+    logverbose(EZUSB_LOG_INFO, "ask 2nd stage loader for a bulk endpoint\n");
+    status = ctrl_msg_timeout (device, "ask 2nd stage loader for a bulk endpoint",
+	LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+	FAST_LOADER_INFO, 0, 0, info, sizeof info, PROBE_TIMEOUT_MS);
+    max_data = info [6] | (info [7] << 8);
+    if (status != sizeof info || info [0] != 'F' || info [1] != 'X' || info [2] != 1
+	    || info [3] == 0 || (info [3] & LIBUSB_ENDPOINT_IN) || max_data == 0) {
+	logverbose(EZUSB_LOG_INFO, "2nd stage loader has no bulk endpoint, using vendor requests\n");
+	return 0;
+    }
+
+    if (!bulk_transport) {
+	status = libusb_claim_interface (device, info [4]);
+	if (status < 0) {
+	    logverbose(EZUSB_LOG_INFO, "can't claim interface %d (%s), using vendor requests\n",
+		info [4], libusb_error_name (status));
+	    return 0;
+	}
+    }
+
+    fast = calloc (1, sizeof *fast);
+    if (fast == NULL) {
+	if (!bulk_transport)
+	    libusb_release_interface (device, info [4]);
+	return 0;
+    }
+    fast->device = device;
+    fast->endpoint = info [3];
+    fast->interface = bulk_transport ? -1 : info [4];
+    if (max_data > sizeof fast->batch - FAST_FRAME_HEADER)
+	max_data = sizeof fast->batch - FAST_FRAME_HEADER;
+    fast->max_data = (uint16_t) max_data;
+    logverbose(EZUSB_LOG_INFO, "2nd stage loader takes bulk writes on endpoint 0x%02x, up to %u bytes each\n",
+	fast->endpoint, fast->max_data);
+    return 1;
+}
+
+void ezusb_detach_fast_loader (void)
+{
+    if (!fast)
+	return;
+    if (fast->interface >= 0)
+	libusb_release_interface (fast->device, fast->interface);
+    free (fast);
+    fast = NULL;
+}
 
 
 /*
@@ -174,9 +524,8 @@ static int ezusb_read (
 ) {
     int					status;
 
-    if (verbose)
-	logerror("%s, addr 0x%04x len %4d (0x%04x)\n", label, addr, len, len);
-    status = ctrl_msg (device,
+    logverbose(EZUSB_LOG_INFO, "%s, addr 0x%04x len %4d (0x%04x)\n", label, addr, len, len);
+    status = ctrl_msg (device, label,
 	LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE, opcode,
 	addr, 0,
 	data, len);
@@ -189,6 +538,25 @@ static int ezusb_read (
     return status;
 }
 
+/*
+ * Issues the specified vendor-specific write request, without reporting
+ * failures; the caller may have a fallback.
+ */
+static int ezusb_try_write (
+    libusb_device_handle		*device,
+    char				*label,
+    unsigned char			opcode,
+    unsigned short			addr,
+    const unsigned char			*data,
+    uint16_t				len
+) {
+    logverbose(EZUSB_LOG_INFO, "%s, addr 0x%04x len %4d (0x%04x)\n", label, addr, len, len);
+    return ctrl_msg (device, label,
+	LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE, opcode,
+	addr, 0,
+	(unsigned char *) data, len);
+}
+
 /*
  * Issues the specified vendor-specific write request.
  */
@@ -202,12 +570,7 @@ static int ezusb_write (
 ) {
     int					status;
 
-    if (verbose)
-	logerror("%s, addr 0x%04x len %4d (0x%04x)\n", label, addr, len, len);
-    status = ctrl_msg (device,
-	LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE, opcode,
-	addr, 0,
-	(unsigned char *) data, len);
+    status = ezusb_try_write (device, label, opcode, addr, data, len);
     if (status != len) {
 	if (status < 0)
 	    logerror("%s: %s\n", label, strerror(errno));
@@ -229,9 +592,12 @@ static int ezusb_cpucs (
     int			status;
     unsigned char	data = doRun ? 0 : 1;
 
-    if (verbose)
-	logerror("%s\n", data ? "stop CPU" : "reset CPU");
-    status = ctrl_msg (device,
+    /* a fast loader stops with the CPU, and may be overwritten next */
+    if (data && fast_for (device))
+	ezusb_detach_fast_loader ();
+
+    logverbose(EZUSB_LOG_INFO, "%s\n", data ? "stop CPU" : "reset CPU");
+    status = ctrl_msg (device, data ? "stop CPU" : "reset CPU",
 	LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 	RW_INTERNAL,
 	addr, 0,
@@ -260,180 +626,235 @@ static inline int ezusb_get_eeprom_type (libusb_device_handle *device, unsigned
 /*****************************************************************************/
 
 /*
- * Parse an Intel HEX image file and invoke the poke() function on the
- * various segments to implement policies such as writing to RAM (with
- * a one or two stage loader setup, depending on the firmware) or to
- * EEPROM (two stages required).
- *
- * image	- the hex image file
- * context	- for use by poke()
- * is_external	- if non-null, used to check which segments go into
- *		  external memory (writable only by software loader)
- * poke		- called with each memory segment; errors indicated
- *		  by returning negative values.
- *
- * Caller is responsible for halting CPU as needed, such as when
- * overwriting a second stage loader.
- */
-int parse_ihex (
-    FILE	*image,
-    void	*context,
-    int		(*is_external)(unsigned short addr, size_t len),
-    int 	(*poke) (void *context, unsigned short addr, int external,
-		      const unsigned char *data, uint16_t len)
-)
-{
-    uint8_t	    data [1023];
-    unsigned short	data_addr = 0;
-    uint16_t		data_len = 0;
-    int			rc;
-    int			first_line = 1;
-    int			external = 0;
-
-    /* Read the input file as an IHEX file, and report the memory segments
-     * as we go.  Each line holds a max of 16 bytes, but downloading is
-     * faster (and EEPROM space smaller) if we merge those lines into larger
-     * chunks.  Most hex files keep memory segments together, which makes
-     * such merging all but free.  (But it may still be worth sorting the
-     * hex files to make up for undesirable behavior from tools.)
-     *
-     * Note that EEPROM segments max out at 1023 bytes; the download protocol
-     * allows segments of up to 64 KBytes (more than a loader could handle).
-     */
-    for (;;) {
-	char 		buf [512], *cp;
-	char		tmp;
-    unsigned long type;
-	uint16_t		len;
-	unsigned	idx, off;
-
-	cp = fgets(buf, sizeof buf, image);
-	if (cp == 0) {
-	    logerror("EOF without EOF record!\n");
-	    break;
-	}
+ * For writing to RAM using a first (hardware) or second (software)
+ * stage loader and 0xA0 or 0xA3 vendor requests
+ */
+typedef enum {
+    _undef = 0,
+    internal_only,		/* hardware first-stage loader */
+    skip_internal,		/* first phase, second-stage loader */
+    skip_external		/* second phase, second-stage loader */
+} ram_mode;
 
-	/* EXTENSION: "# comment-till-end-of-line", for copyrights etc */
-	if (buf[0] == '#')
-	    continue;
+struct ram_poke_context {
+    libusb_device_handle	*device;
+    ram_mode	mode;
+    size_t	total, count;
+    unsigned	pending;	/* pipelined writes not yet completed */
+    int		async_status;	/* first pipelined write failure */
+    struct ezusb_pool *pool;	/* transfers for pipelined writes */
+    uint64_t	submitted [EZUSB_MAX_QUEUE_DEPTH];	/* per pool transfer, when traced */
+};
 
-	if (buf[0] != ':') {
-	    logerror("not an ihex record: %s", buf);
-	    return -2;
-	}
+# define RETRY_LIMIT 5
 
-	/* ignore any newline */
-	cp = strchr (buf, '\n');
-	if (cp)
-	    *cp = 0;
-
-	if (verbose >= 3)
-	    logerror("** LINE: %s\n", buf);
-
-	/* Read the length field (up to 16 bytes) */
-	tmp = buf[3];
-	buf[3] = 0;
-	len = (uint16_t)strtoul(buf+1, 0, 16);
-	buf[3] = tmp;
-
-	/* Read the target offset (address up to 64KB) */
-	tmp = buf[7];
-	buf[7] = 0;
-	off = strtoul(buf+3, 0, 16);
-	buf[7] = tmp;
-
-	/* Initialize data_addr */
-	if (first_line) {
-	    data_addr = off;
-	    first_line = 0;
-	}
+EZUSB_THREAD_LOCAL uint16_t ezusb_ram_chunk = EZUSB_DEFAULT_RAM_CHUNK;
+EZUSB_THREAD_LOCAL unsigned ezusb_ram_queue_depth = 1;
 
-	/* Read the record type */
-	tmp = buf[9];
-	buf[9] = 0;
-	type = strtoul(buf+7, 0, 16);
-	buf[9] = tmp;
+int ezusb_write_too_big (int status)
+{
+    return status == LIBUSB_ERROR_INVALID_PARAM || status == LIBUSB_ERROR_PIPE
+	|| status == LIBUSB_ERROR_OVERFLOW;
+}
 
-	/* If this is an EOF record, then make it so. */
-	if (type == 1) {
-	    if (verbose >= 2)
-		logerror("EOF on hexfile\n");
-	    break;
-	}
+struct ezusb_pool {
+    libusb_device_handle	*device;
+    unsigned char		*memory;	/* every buffer, back to back */
+    size_t			memory_len;
+    size_t			buffer_len;
+    int				dma;
+    unsigned			count;
+    unsigned			available;
+    struct libusb_transfer	**free_list;
+};
 
-	if (type != 0) {
-	    logerror("unsupported record type: %lu\n", type);
-	    return -3;
-	}
+struct ezusb_pool *ezusb_pool_new (libusb_device_handle *device, unsigned count, size_t data_len)
+{
+    struct ezusb_pool	*pool;
+    unsigned		i;
+
+    pool = calloc (1, sizeof *pool);
+    if (pool == NULL)
+	return NULL;
+    pool->device = device;
+    pool->buffer_len = LIBUSB_CONTROL_SETUP_SIZE + data_len;
+    pool->memory_len = pool->buffer_len * count;
+    pool->count = count;
+
+    /* libusb 1.0.21 and later; only usbfs gives out device memory */
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+    pool->memory = libusb_dev_mem_alloc (device, pool->memory_len);
+    pool->dma = pool->memory != NULL;
+#endif
+    if (pool->memory == NULL)
+	pool->memory = malloc (pool->memory_len);
+    pool->free_list = calloc (count, sizeof *pool->free_list);
+    if (pool->memory == NULL || pool->free_list == NULL) {
+	ezusb_pool_free (pool);
+	return NULL;
+    }
+
+    for (i = 0; i < count; i++) {
+	struct libusb_transfer	*xfer = libusb_alloc_transfer (0);
 
-	if ((len * 2) + 11 > strlen(buf)) {
-	    logerror("record too short?\n");
-	    return -4;
+	if (xfer == NULL) {
+	    ezusb_pool_free (pool);
+	    return NULL;
 	}
+	xfer->buffer = pool->memory + i * pool->buffer_len;
+	pool->free_list [pool->available++] = xfer;
+    }
+    logverbose(EZUSB_LOG_DEBUG, "%u transfer buffers of %zu bytes, %s\n",
+	count, pool->buffer_len, pool->dma ? "device memory" : "heap");
+    return pool;
+}
 
-	// FIXME check for _physically_ contiguous not just virtually
-	// e.g. on FX2 0x1f00-0x2100 includes both on-chip and external
-	// memory so it's not really contiguous
+void ezusb_pool_free (struct ezusb_pool *pool)
+{
+    unsigned	i;
+
+    if (pool == NULL)
+	return;
+    if (pool->available != pool->count && pool->free_list != NULL && pool->memory != NULL)
+	logerror("bug: freeing transfer pool with %u transfers in flight\n",
+	    pool->count - pool->available);
+    for (i = 0; pool->free_list != NULL && i < pool->available; i++)
+	libusb_free_transfer (pool->free_list [i]);
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+    if (pool->dma)
+	libusb_dev_mem_free (pool->device, pool->memory, pool->memory_len);
+    else
+#endif
+	free (pool->memory);
+    free (pool->free_list);
+    free (pool);
+}
 
-	/* flush the saved data if it's not contiguous,
-	 * or when we've buffered as much as we can.
-	 */
-	if (data_len != 0
-		    && (off != (data_addr + data_len)
-			// || !merge
-			|| (data_len + len) > sizeof data)) {
-	    if (is_external)
-		external = is_external (data_addr, data_len);
-	    rc = poke (context, data_addr, external, data, data_len);
-	    if (rc < 0)
-		return -1;
-	    data_addr = off;
-	    data_len = 0;
-	}
+struct libusb_transfer *ezusb_pool_get (struct ezusb_pool *pool)
+{
+    if (pool->available == 0)
+	return NULL;
+    return pool->free_list [--pool->available];
+}
 
-	/* append to saved data, flush later */
-	for (idx = 0, cp = buf+9 ;  idx < len ;  idx += 1, cp += 2) {
-	    tmp = cp[2];
-	    cp[2] = '\0';
-	    data [data_len + idx] = (uint8_t)strtoul(cp, 0, 16);
-	    cp[2] = tmp;
-	}
-	data_len += len;
-    }
+void ezusb_pool_put (struct ezusb_pool *pool, struct libusb_transfer *xfer)
+{
+    pool->free_list [pool->available++] = xfer;
+}
 
+int ezusb_pool_is_dma (const struct ezusb_pool *pool)
+{
+    return pool->dma;
+}
 
-    /* flush any data remaining */
-    if (data_len != 0) {
-	if (is_external)
-	    external = is_external (data_addr, data_len);
-	rc = poke (context, data_addr, external, data, data_len);
-	if (rc < 0)
-	    return -1;
+/*
+ * Which of the pool's transfers this is, from where its buffer lies.
+ */
+static unsigned pool_index (const struct ezusb_pool *pool, const struct libusb_transfer *xfer)
+{
+    return (unsigned) ((size_t) (xfer->buffer - pool->memory) / pool->buffer_len);
+}
+
+/*
+ * Reports a pipelined write to the trace; its setup packet and data are
+ * in the transfer's buffer.
+ */
+static void trace_transfer (const struct libusb_transfer *xfer, int status, uint64_t start_us)
+{
+    const struct libusb_control_setup *setup = libusb_control_transfer_get_setup ((struct libusb_transfer *) xfer);
+
+    trace_request (setup->bmRequestType, setup->bRequest,
+	libusb_le16_to_cpu (setup->wValue), libusb_le16_to_cpu (setup->wIndex),
+	xfer->buffer + LIBUSB_CONTROL_SETUP_SIZE, libusb_le16_to_cpu (setup->wLength),
+	status, true, start_us);
+}
+
+/*
+ * Completion callback for pipelined RAM writes.
+ */
+static void LIBUSB_CALL ram_write_done (struct libusb_transfer *xfer)
+{
+    struct ram_poke_context	*ctx = xfer->user_data;
+    int				status = xfer->actual_length;
+
+    if (xfer->status != LIBUSB_TRANSFER_COMPLETED
+	    || xfer->actual_length != xfer->length - LIBUSB_CONTROL_SETUP_SIZE) {
+	logverbose(EZUSB_LOG_DEBUG, "pipelined write to 0x%04x failed, status %d\n",
+	    libusb_le16_to_cpu (libusb_control_transfer_get_setup (xfer)->wValue),
+	    xfer->status);
+	status = xfer->status == LIBUSB_TRANSFER_NO_DEVICE
+		? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_IO;
+	if (ctx->async_status == 0)
+	    ctx->async_status = status;
     }
-    return 0;
+    if (trace)
+	trace_transfer (xfer, status, ctx->submitted [pool_index (ctx->pool, xfer)]);
+    ctx->pending--;
+    ezusb_pool_put (ctx->pool, xfer);
 }
 
+/*
+ * Waits until no more than max_pending pipelined writes are in flight.
+ * Returns the first failure seen, or 0.
+ */
+static int ram_wait (struct ram_poke_context *ctx, unsigned max_pending)
+{
+    while (ctx->pending > max_pending) {
+	int	rc = libusb_handle_events (NULL);
 
-/*****************************************************************************/
+	if (rc < 0 && rc != LIBUSB_ERROR_INTERRUPTED) {
+	    logerror("waiting for writes: %s\n", libusb_error_name (rc));
+	    return rc;
+	}
+    }
+    return ctx->async_status;
+}
 
 /*
- * For writing to RAM using a first (hardware) or second (software)
- * stage loader and 0xA0 or 0xA3 vendor requests
+ * Queues one RAM write without waiting for it, once fewer than
+ * ezusb_ram_queue_depth are in flight.  Each transfer carries its own
+ * copy of the data after the setup packet, in a buffer from the pool.
  */
-typedef enum {
-    _undef = 0,
-    internal_only,		/* hardware first-stage loader */
-    skip_internal,		/* first phase, second-stage loader */
-    skip_external		/* second phase, second-stage loader */
-} ram_mode;
+static int ram_submit (
+    struct ram_poke_context	*ctx,
+    unsigned char		opcode,
+    unsigned short		addr,
+    const unsigned char		*data,
+    uint16_t			len
+) {
+    struct libusb_transfer	*xfer;
+    int				rc;
 
-struct ram_poke_context {
-    libusb_device_handle	*device;
-    ram_mode	mode;
-    size_t	total, count;
-};
+    rc = ram_wait (ctx, ezusb_ram_queue_depth - 1);
+    if (rc < 0)
+	return rc;
 
-# define RETRY_LIMIT 5
+    /* one is free: there are as many as the queue is deep */
+    xfer = ezusb_pool_get (ctx->pool);
+    if (xfer == NULL)
+	return LIBUSB_ERROR_NO_MEM;
+
+    logverbose(EZUSB_LOG_INFO, "queue %s, addr 0x%04x len %4d (0x%04x)\n",
+	opcode == RW_MEMORY ? "write external" : "write on-chip", addr, len, len);
+    libusb_fill_control_setup (xfer->buffer,
+	LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE, opcode,
+	addr, 0, len);
+    memcpy (xfer->buffer + LIBUSB_CONTROL_SETUP_SIZE, data, len);
+    libusb_fill_control_transfer (xfer, ctx->device, xfer->buffer, ram_write_done, ctx,
+	    CTRL_TIMEOUT_MS);
+
+    if (trace)
+	ctx->submitted [pool_index (ctx->pool, xfer)] = ezusb_clock_us ();
+    rc = libusb_submit_transfer (xfer);
+    if (rc < 0) {
+	if (trace)
+	    trace_transfer (xfer, rc, ctx->submitted [pool_index (ctx->pool, xfer)]);
+	ezusb_pool_put (ctx->pool, xfer);
+	return rc;
+    }
+    ctx->pending++;
+    return 0;
+}
 
 static int ram_poke (
     void		*context,
@@ -443,6 +864,7 @@ static int ram_poke (
     uint16_t		len
 ) {
     struct ram_poke_context	*ctx = context;
+    struct fast_loader	*loader = external ? fast_for (ctx->device) : NULL;
     int			rc;
     unsigned		retry = 0;
 
@@ -456,19 +878,15 @@ static int ram_poke (
 	break;
     case skip_internal:		/* CPU must be running */
 	if (!external) {
-	    if (verbose >= 2) {
-		logerror("SKIP on-chip RAM, %d bytes at 0x%04x\n",
-		    len, addr);
-	    }
+	    logverbose(EZUSB_LOG_DEBUG, "SKIP on-chip RAM, %d bytes at 0x%04x\n",
+		len, addr);
 	    return 0;
 	}
 	break;
     case skip_external:		/* CPU should be stopped */
 	if (external) {
-	    if (verbose >= 2) {
-		logerror("SKIP external RAM, %d bytes at 0x%04x\n",
-		    len, addr);
-	    }
+	    logverbose(EZUSB_LOG_DEBUG, "SKIP external RAM, %d bytes at 0x%04x\n",
+		len, addr);
 	    return 0;
 	}
 	break;
@@ -477,26 +895,124 @@ static int ram_poke (
 	return -EDOM;
     }
 
-    ctx->total += len;
-    ctx->count++;
+    while (len > 0) {
+	char		*label = external ? "write external" : "write on-chip";
+	unsigned char	opcode = external ? RW_MEMORY : RW_INTERNAL;
+	uint16_t	limit = loader ? loader->max_data : ezusb_ram_chunk;
+	uint16_t	chunk = len < limit ? len : limit;
 
-    /* Retry this till we get a real error. Control messages are not
-     * NAKed (just dropped) so time out means is a real problem.
-     */
-    while ((rc = ezusb_write (ctx->device,
-		    external ? "write external" : "write on-chip",
-		    external ? RW_MEMORY : RW_INTERNAL,
-		    addr, data, (uint16_t)len)) < 0
-		&& retry < RETRY_LIMIT) {
-	  retry += 1;
+	/* batched for a fast loader: ram_walk() syncs, and handles failures */
+	if (loader) {
+	    rc = fast_write (loader, opcode, addr, NULL, 0, data, chunk);
+	    if (rc < 0)
+		return rc;
+
+	/* pipelined: failures are handled by ram_walk() */
+	} else if (ezusb_ram_queue_depth > 1 && !transport) {
+	    rc = ram_submit (ctx, opcode, addr, data, chunk);
+	    if (rc < 0)
+		return rc;
+
+	/* Writes larger than fxload always used may be more than the loader
+	 * or the host's USB stack takes in one request.  Those get halved
+	 * until one goes through, and the size that worked is kept.  Other
+	 * failures are retried below, at the same size.
+	 */
+	} else if (chunk > EZUSB_MIN_RAM_CHUNK
+		&& ezusb_write_too_big (rc = ezusb_try_write (ctx->device, label,
+			opcode, addr, data, chunk))) {
+	    ezusb_ram_chunk = (uint16_t)((chunk + 1) / 2);
+	    if (ezusb_ram_chunk < EZUSB_MIN_RAM_CHUNK)
+		ezusb_ram_chunk = EZUSB_MIN_RAM_CHUNK;
+	    logverbose(EZUSB_LOG_INFO, "%d byte write rejected (%s), using %d byte chunks\n",
+		chunk, libusb_error_name (rc), ezusb_ram_chunk);
+	    continue;
+
+	/* Retry this till we get a real error. Control messages are not
+	 * NAKed (just dropped) so time out means is a real problem.
+	 */
+	} else if (chunk <= EZUSB_MIN_RAM_CHUNK || rc != chunk) {
+	    if (rc == LIBUSB_ERROR_NO_DEVICE) {
+		logerror("%s: device disconnected\n", label);
+		return rc;
+	    }
+	    while ((rc = ezusb_write (ctx->device, label, opcode,
+			    addr, data, chunk)) < 0
+			&& retry < RETRY_LIMIT) {
+		  retry += 1;
+	    }
+	    if (rc < 0)
+		return rc;
+	}
+
+	ctx->total += chunk;
+	ctx->count++;
+	addr += chunk;
+	data += chunk;
+	len -= chunk;
+    }
+    return 0;
+}
+
+/*
+ * Writes the parts of an image the context's mode selects.  Pipelined
+ * writes are all completed before this returns; if any of them failed,
+ * the pass is repeated one write at a time (RAM writes can safely be
+ * repeated), and pipelining stays off for the rest of the run.  Likewise
+ * frames batched for a fast loader are synced, and if that fails, the
+ * pass is repeated with vendor requests.
+ */
+static int ram_walk (struct ram_poke_context *ctx, const struct ezusb_image *image,
+	const struct ezusb_chip_traits *chip)
+{
+    struct fast_loader	*loader = fast_for (ctx->device);
+    size_t	total = ctx->total, count = ctx->count;
+    int		status, drained;
+
+    ctx->pending = 0;
+    ctx->async_status = 0;
+    ctx->pool = NULL;
+    if (ezusb_ram_queue_depth > 1 && !transport) {
+	ctx->pool = ezusb_pool_new (ctx->device, ezusb_ram_queue_depth, ezusb_ram_chunk);
+	if (ctx->pool == NULL) {
+	    logverbose(EZUSB_LOG_INFO, "no memory for pipelined writes, writing one at a time\n");
+	    ezusb_ram_queue_depth = 1;
+	}
+    }
+    status = ezusb_image_for_each_chunk (image, chip, EZUSB_MAX_RAM_CHUNK, ctx, ram_poke);
+    drained = ram_wait (ctx, 0);
+    if (status == 0)
+	status = drained;
+    if (loader && status == 0)
+	status = fast_sync (loader);
+    else
+	fast_discard (loader);
+
+    /* if libusb gave up on events, transfers may still own their buffers */
+    if (ctx->pending == 0)
+	ezusb_pool_free (ctx->pool);
+    ctx->pool = NULL;
+
+    if (status < 0 && loader && status != LIBUSB_ERROR_NO_DEVICE) {
+	logverbose(EZUSB_LOG_INFO, "bulk writes failed (%d), retrying with vendor requests\n", status);
+	ezusb_detach_fast_loader ();
+	ctx->total = total;
+	ctx->count = count;
+	return ram_walk (ctx, image, chip);
+    }
+
+    if (status < 0 && ezusb_ram_queue_depth > 1 && status != LIBUSB_ERROR_NO_DEVICE) {
+	logverbose(EZUSB_LOG_INFO, "pipelined writes failed (%d), retrying one at a time\n", status);
+	ezusb_ram_queue_depth = 1;
+	ctx->total = total;
+	ctx->count = count;
+	status = ezusb_image_for_each_chunk (image, chip, EZUSB_MAX_RAM_CHUNK, ctx, ram_poke);
     }
-    return (rc < 0) ? rc : 0;
+    return status;
 }
 
 /*
- * Load an Intel HEX file into target RAM. The fd is the open "usbfs"
- * device, and the path is the name of the source file. Open the file,
- * parse the bytes, and write them in one or two phases.
+ * Load a firmware image into target RAM, in one or two phases.
  *
  * If stage == 0, this uses the first stage loader, built into EZ-USB
  * hardware but limited to writing on-chip memory or CPUCS.  Everything
@@ -505,35 +1021,19 @@ static int ram_poke (
  *
  * Otherwise, things are written in two stages.  First the external
  * memory is written, expecting a second stage loader to have already
- * been loaded.  Then file is re-parsed and on-chip memory is written.
+ * been loaded.  Then the image is walked again and on-chip memory is written.
  */
-int ezusb_load_ram (libusb_device_handle *device, const char *path, ezusb_chip_t type, int stage)
+int ezusb_load_ram_image (libusb_device_handle *device, const struct ezusb_image *image, ezusb_chip_t type, int stage)
 {
-    FILE			*image;
-    unsigned short		cpucs_addr;
-    int				(*is_external)(unsigned short off, size_t len);
+    const struct ezusb_chip_traits *chip;
     struct ram_poke_context	ctx;
     int				status;
 
-    image = fopen (path, "r");
-    if (image == 0) {
-	logerror("%s: unable to open for input.\n", path);
-	return -2;
-    } else if (verbose)
-	logerror("open RAM hexfile image %s\n", path);
-
     /* EZ-USB original/FX and FX2 devices differ, apart from the 8051 core */
-    if(type == FX2LP)
-    {
-        cpucs_addr = 0xe600;
-	    is_external = fx2lp_is_external;
-    }
-    else if (type == FX2) {
-	    cpucs_addr = 0xe600;
-	    is_external = fx2_is_external;
-    } else {
-	    cpucs_addr = 0x7f92;
-	    is_external = fx_is_external;
+    chip = ezusb_get_chip_traits (type);
+    if (chip == 0) {
+	logerror("?? Unrecognized microcontroller type %s ??\n", ezusb_name[type]);
+	return -1;
     }
 
     /* use only first stage loader? */
@@ -541,7 +1041,7 @@ int ezusb_load_ram (libusb_device_handle *device, const char *path, ezusb_chip_t
 	ctx.mode = internal_only;
 
 	/* don't let CPU run while we overwrite its code/data */
-	if (!ezusb_cpucs (device, cpucs_addr, 0))
+	if (!ezusb_cpucs (device, chip->cpucs_addr, 0))
 	    return -1;
 
     /* 2nd stage, first part? loader was already downloaded */
@@ -549,16 +1049,16 @@ int ezusb_load_ram (libusb_device_handle *device, const char *path, ezusb_chip_t
 	ctx.mode = skip_internal;
 
 	/* let CPU run; overwrite the 2nd stage loader later */
-	if (verbose)
-	    logerror("2nd stage:  write external memory\n");
+	logverbose(EZUSB_LOG_INFO, "2nd stage:  write external memory\n");
     }
     
     /* scan the image, first (maybe only) time */
     ctx.device = device;
     ctx.total = ctx.count = 0;
-    status = parse_ihex (image, &ctx, is_external, ram_poke);
+    status = ram_walk (&ctx, image, chip);
+    ezusb_log_flush();
     if (status < 0) {
-	logerror("unable to download %s\n", path);
+	logerror("unable to download image\n");
 	return status;
     }
 
@@ -567,31 +1067,176 @@ int ezusb_load_ram (libusb_device_handle *device, const char *path, ezusb_chip_t
 	ctx.mode = skip_external;
 
 	/* don't let CPU run while we overwrite the 1st stage loader */
-	if (!ezusb_cpucs (device, cpucs_addr, 0))
+	if (!ezusb_cpucs (device, chip->cpucs_addr, 0))
 	    return -1;
 
 	/* at least write the interrupt vectors (at 0x0000) for reset! */
-	rewind (image);
-	if (verbose)
-	    logerror("2nd stage:  write on-chip memory\n");
-	status = parse_ihex (image, &ctx, is_external, ram_poke);
+	logverbose(EZUSB_LOG_INFO, "2nd stage:  write on-chip memory\n");
+	status = ram_walk (&ctx, image, chip);
+	ezusb_log_flush();
 	if (status < 0) {
-	    logerror("unable to completely download %s\n", path);
+	    logerror("unable to completely download image\n");
 	    return status;
 	}
     }
 
-    if (verbose)
-	logerror("... WROTE: %zu bytes, %zu segments, avg %zu\n",
+    if (ctx.count)
+	logverbose(EZUSB_LOG_INFO, "... WROTE: %zu bytes, %zu segments, avg %zu\n",
 	    ctx.total, ctx.count, ctx.total / ctx.count);
 	
     /* now reset the CPU so it runs what we just downloaded */
-    if (!ezusb_cpucs (device, cpucs_addr, 1))
+    if (!ezusb_cpucs (device, chip->cpucs_addr, 1))
 	return -1;
 
+    ezusb_log_flush();
+    return 0;
+}
+
+/*
+ * Load an Intel HEX file into target RAM.  The path is the name of the
+ * source file; it is parsed once, then written as above.
+ */
+int ezusb_load_ram (libusb_device_handle *device, const char *path, ezusb_chip_t type, int stage)
+{
+    struct ezusb_image	image;
+    int			status;
+
+    ezusb_image_init (&image);
+    status = ezusb_image_load_file (&image, path);
+    if (status == 0)
+	status = ezusb_load_ram_image (device, &image, type, stage);
+    if (status < 0)
+	logerror("unable to download %s\n", path);
+    ezusb_image_free (&image);
+    return status;
+}
+
+/*
+ * For checking that device RAM still holds an image
+ */
+struct ram_check_context {
+    libusb_device_handle	*device;
+    int			match;
+};
+
+static int ram_check_poke (
+    void		*context,
+    unsigned short	addr,
+    int			external,
+    const unsigned char	*data,
+    uint16_t		len
+) {
+    struct ram_check_context	*ctx = context;
+    unsigned char		*buf;
+    int				rc;
+
+    if (!ctx->match)
+	return 0;
+
+    buf = malloc (len);
+    if (buf == NULL)
+	return -ENOMEM;
+    rc = ezusb_read (ctx->device, external ? "read back external" : "read back on-chip",
+	    external ? RW_MEMORY : RW_INTERNAL, addr, buf, len);
+    if (rc == len && memcmp (buf, data, len) != 0) {
+	logverbose(EZUSB_LOG_INFO, "RAM at 0x%04x doesn't hold the expected image\n", addr);
+	ctx->match = 0;
+    }
+    free (buf);
+    if (rc != len)
+	return rc < 0 ? rc : -EIO;
     return 0;
 }
 
+int ezusb_sample_ram (libusb_device_handle *device, const struct ezusb_image *image,
+	ezusb_chip_t type)
+{
+    const struct ezusb_chip_traits *chip = ezusb_get_chip_traits (type);
+    struct ram_check_context	ctx;
+    struct ezusb_image		sample;
+    int				status;
+
+    if (chip == 0)
+	return -EINVAL;
+
+    ezusb_image_init (&sample);
+    status = ezusb_image_sample (&sample, image, EZUSB_SAMPLE_WINDOWS, EZUSB_SAMPLE_BYTES);
+
+    /* so the firmware can't change it between the readback and a load */
+    if (status == 0 && !ezusb_cpucs (device, chip->cpucs_addr, 0))
+	status = -EIO;
+
+    ctx.device = device;
+    ctx.match = 1;
+    if (status == 0)
+	status = ezusb_image_for_each_chunk (&sample, chip, ezusb_ram_chunk, &ctx, ram_check_poke);
+    ezusb_image_free (&sample);
+    ezusb_log_flush();
+    return status < 0 ? status : ctx.match;
+}
+
+double ezusb_measure_ram_write (libusb_device_handle *device, ezusb_chip_t type,
+	uint16_t chunk, unsigned depth, size_t bytes)
+{
+    const struct ezusb_chip_traits *chip = ezusb_get_chip_traits (type);
+    uint16_t			saved_chunk = ezusb_ram_chunk;
+    unsigned			saved_depth = ezusb_ram_queue_depth;
+    struct ram_poke_context	ctx;
+    struct ezusb_image		image;
+    unsigned char		*pattern;
+    uint32_t			size;
+    size_t			written = 0;
+    uint64_t			start, elapsed;
+    int				accepted, status = 0;
+
+    if (chip == 0 || depth == 0 || depth > EZUSB_MAX_QUEUE_DEPTH)
+	return -EINVAL;
+
+    /* the largest on-chip region, which the hardware loader can write */
+    size = chip->internal[0].end - chip->internal[0].start + 1;
+    pattern = calloc (size, 1);
+    ezusb_image_init (&image);
+    if (pattern == NULL || ezusb_image_append (&image, chip->internal[0].start, pattern, size) < 0) {
+	free (pattern);
+	ezusb_image_free (&image);
+	return -ENOMEM;
+    }
+    free (pattern);
+
+    if (!ezusb_cpucs (device, chip->cpucs_addr, 0)) {
+	ezusb_image_free (&image);
+	return -EIO;
+    }
+
+    ezusb_ram_chunk = chunk;
+    ezusb_ram_queue_depth = depth;
+    ctx.device = device;
+    ctx.mode = internal_only;
+    ctx.total = ctx.count = 0;
+
+    start = ezusb_clock_us ();
+    while (written < bytes) {
+	status = ram_walk (&ctx, &image, chip);
+	if (status < 0)
+	    break;
+	written += size;
+    }
+    elapsed = ezusb_clock_us () - start;
+    ezusb_log_flush();
+
+    /* a setting the device backed off from doesn't count */
+    accepted = ezusb_ram_chunk == chunk && ezusb_ram_queue_depth == depth;
+    ezusb_ram_chunk = saved_chunk;
+    ezusb_ram_queue_depth = saved_depth;
+    ezusb_image_free (&image);
+
+    if (status < 0)
+	return status;
+    if (!accepted)
+	return 0;
+    return (double) written * 1e6 / (double) (elapsed ? elapsed : 1);
+}
+
 /*****************************************************************************/
 
 /*
@@ -601,8 +1246,38 @@ struct eeprom_poke_context {
     libusb_device_handle      *device;
     unsigned short	ee_addr;	/* next free address */
     int			last;
+    size_t		done;		/* records written (or skipped) */
+    size_t		skip;		/* records already in the EEPROM */
+    size_t		written;	/* records to report, once they've landed */
+    size_t		reported;
+    ezusb_progress_fn	progress;
+    void		*progress_context;
 };
 
+static void eeprom_report (struct eeprom_poke_context *ctx)
+{
+    if (ctx->progress && ctx->written > ctx->reported)
+	ctx->progress (ctx->progress_context, ctx->written);
+    ctx->reported = ctx->written;
+}
+
+/*
+ * Waits for records batched for a fast loader to land, then reports them.
+ */
+static int eeprom_sync (struct eeprom_poke_context *ctx)
+{
+    struct fast_loader	*loader = fast_for (ctx->device);
+    int			rc;
+
+    if (loader) {
+	rc = fast_sync (loader);
+	if (rc < 0)
+	    return rc;
+    }
+    eeprom_report (ctx);
+    return 0;
+}
+
 static int eeprom_poke (
     void		*context,
     unsigned short	addr,
@@ -611,6 +1286,7 @@ static int eeprom_poke (
     uint16_t		len
 ) {
     struct eeprom_poke_context	*ctx = context;
+    struct fast_loader	*loader = fast_for (ctx->device);
     int			rc;
     unsigned char	header [4];
 
@@ -626,6 +1302,15 @@ static int eeprom_poke (
 	return -EDOM;
     }
 
+    /* written by an earlier, interrupted run */
+    if (ctx->done < ctx->skip) {
+	logverbose(EZUSB_LOG_DEBUG, "SKIP EEPROM record %zu, %d bytes at 0x%04x\n",
+	    ctx->done, len, addr);
+	ctx->ee_addr += 4 + len;
+	ctx->done++;
+	return 0;
+    }
+
     /* NOTE:  No retries here.  They don't seem to be needed;
      * could be added if that changes.
      */
@@ -637,64 +1322,374 @@ static int eeprom_poke (
     header [3] = addr & 0xFF;
     if (ctx->last)
 	header [0] |= 0x80;
-    if ((rc = ezusb_write (ctx->device, "write EEPROM segment header",
-		    RW_EEPROM,
-		    ctx->ee_addr, header, 4)) < 0)
-	return rc;
 
-    /* write code/data */
-    if ((rc = ezusb_write (ctx->device, "write EEPROM segment",
-		    RW_EEPROM,
-		    ctx->ee_addr + 4, data, len)) < 0)
-	return rc;
+    /* a fast loader gets the header and data as one frame; a full batch
+     * is synced first, so records are only reported once they've landed
+     */
+    if (loader && 4 + len <= loader->max_data) {
+	if (fast_batch_full (loader, 4 + len) && (rc = eeprom_sync (ctx)) < 0)
+	    return rc;
+	if ((rc = fast_write (loader, RW_EEPROM, ctx->ee_addr, header, 4, data, len)) < 0)
+	    return rc;
+    } else {
+	/* anything batched lands first, to keep the report in order */
+	if (loader && (rc = eeprom_sync (ctx)) < 0)
+	    return rc;
+	if ((rc = ezusb_write (ctx->device, "write EEPROM segment header",
+			RW_EEPROM,
+			ctx->ee_addr, header, 4)) < 0)
+	    return rc;
+
+	/* write code/data */
+	if ((rc = ezusb_write (ctx->device, "write EEPROM segment",
+			RW_EEPROM,
+			ctx->ee_addr + 4, data, len)) < 0)
+	    return rc;
+    }
 
     /* next shouldn't overwrite it */
     ctx->ee_addr += 4 + len;
 
+    ctx->done++;
+    if (!ctx->last)
+	ctx->written = ctx->done;
+    if (!loader)
+	eeprom_report (ctx);
+    return 0;
+}
+
+/*
+ * For reading back one EEPROM record, to check an interrupted
+ * run really did write it
+ */
+struct eeprom_verify_context {
+    libusb_device_handle	*device;
+    unsigned short	ee_addr;
+    size_t		index;		/* of the next record */
+    size_t		target;		/* record to check, or ALL_RECORDS */
+    int			status;		/* 1 matches, 0 doesn't, < 0 error */
+};
+
+#define ALL_RECORDS	((size_t) -1)
+
+static int eeprom_verify_poke (
+    void		*context,
+    unsigned short	addr,
+    int			external,
+    const unsigned char	*data,
+    uint16_t		len
+) {
+    struct eeprom_verify_context	*ctx = context;
+    unsigned char		record [4 + EZUSB_MAX_EEPROM_CHUNK];
+    unsigned short		ee_addr = ctx->ee_addr;
+    int				rc;
+
+    ctx->ee_addr += 4 + len;
+    if (ctx->target == ALL_RECORDS) {
+	/* once one record differs, the rest needn't be read */
+	if (ctx->status != 1)
+	    return 0;
+    } else if (ctx->index++ != ctx->target)
+	return 0;
+
+    if (external) {
+	ctx->status = 0;
+	return 0;
+    }
+
+    rc = ezusb_read (ctx->device, "read back EEPROM record", RW_EEPROM,
+	    ee_addr, record, (uint16_t)(4 + len));
+    if (rc != 4 + len) {
+	ctx->status = rc < 0 ? rc : -EIO;
+	return ctx->status;
+    }
+    ctx->status = record [0] == (len >> 8) && record [1] == (len & 0xFF)
+	&& record [2] == (addr >> 8) && record [3] == (addr & 0xFF)
+	&& memcmp (record + 4, data, len) == 0;
+    if (!ctx->status)
+	logverbose(EZUSB_LOG_INFO, "EEPROM record at 0x%04x (for 0x%04x) doesn't match\n",
+	    ee_addr, addr);
+    return 0;
+}
+
+/*
+ * Returns 1 if record number "target" of the image reads back from the
+ * EEPROM as it would have been written, 0 if not, or a negative error.
+ */
+static int eeprom_record_matches (libusb_device_handle *dev, const struct ezusb_image *image,
+	const struct ezusb_chip_traits *chip, size_t target)
+{
+    struct eeprom_verify_context	ctx;
+    int					status;
+
+    ctx.device = dev;
+    ctx.ee_addr = chip->eeprom_header_len;
+    ctx.index = 0;
+    ctx.target = target;
+    ctx.status = 0;
+    status = ezusb_image_for_each_chunk (image, chip, EZUSB_MAX_EEPROM_CHUNK, &ctx, eeprom_verify_poke);
+    return status < 0 ? status : ctx.status;
+}
+
+EZUSB_THREAD_LOCAL size_t ezusb_eeprom_size = EZUSB_MAX_EEPROM_SIZE;
+
+static int plan_poke (
+    void		*context,
+    unsigned short	addr,
+    int			external,
+    const unsigned char	*data,
+    uint16_t		len
+) {
+    struct ezusb_eeprom_plan	*plan = context;
+
+    if (external) {
+	logerror("EEPROM can't init %d bytes external memory at 0x%04x\n",
+	    len, addr);
+	return -EINVAL;
+    }
+    plan->records++;
+    plan->data_bytes += len;
+    plan->total_bytes += 4 + len;
+    return 0;
+}
+
+int ezusb_plan_eeprom (const struct ezusb_image *image, ezusb_chip_t type,
+	struct ezusb_eeprom_plan *plan)
+{
+    const struct ezusb_chip_traits *chip = ezusb_get_chip_traits (type);
+    int				status;
+
+    if (chip == 0) {
+	logerror("?? Unrecognized microcontroller type %s ??\n", ezusb_name[type]);
+	return -1;
+    }
+
+    plan->records = 0;
+    plan->data_bytes = 0;
+    plan->total_bytes = chip->eeprom_header_len;
+    status = ezusb_image_for_each_chunk (image, chip, EZUSB_MAX_EEPROM_CHUNK, plan, plan_poke);
+    if (status < 0)
+	return status;
+
+    /* and the record that resets the CPU */
+    plan->total_bytes += 4 + 1;
+
+    logverbose(EZUSB_LOG_INFO, "EEPROM layout: %zu records, %zu data bytes, %zu of %zu bytes used\n",
+	plan->records, plan->data_bytes, plan->total_bytes, ezusb_eeprom_size);
+    if (plan->total_bytes > ezusb_eeprom_size) {
+	logerror("image needs %zu bytes of EEPROM, but the EEPROM holds only %zu\n",
+	    plan->total_bytes, ezusb_eeprom_size);
+	return -ENOSPC;
+    }
+    return 0;
+}
+
+/* the I2C bus takes nine clocks per byte (eight and an ack) */
+#define I2C_CLOCKS_PER_BYTE	9
+/* setting the read address: device, address high and low, device again */
+#define I2C_READ_SETUP_BYTES	4
+#define I2C_CONFIG_400KHZ	0x01
+
+unsigned long ezusb_eeprom_boot_us (const struct ezusb_eeprom_plan *plan,
+	ezusb_chip_t type, int config)
+{
+    const struct ezusb_chip_traits *chip = ezusb_get_chip_traits (type);
+    unsigned long	khz = 100;
+
+    if (chip && (config & chip->eeprom_config_mask & I2C_CONFIG_400KHZ))
+	khz = 400;
+
+    /* The ROM copies each byte out long before the next one arrives.
+     * Worked out in 64 bits, then narrowed explicitly, since size_t is
+     * wider than unsigned long on 64-bit Windows.
+     */
+    return (unsigned long) ((uint64_t) (plan->total_bytes + I2C_READ_SETUP_BYTES)
+	* I2C_CLOCKS_PER_BYTE * 1000 / khz);
+}
+
+int ezusb_probe_loader (libusb_device_handle *device, const struct ezusb_image *loader,
+	ezusb_chip_t type)
+{
+    const struct ezusb_chip_traits *chip = ezusb_get_chip_traits (type);
+    struct ram_check_context	ctx;
+    unsigned char		value;
+    int				status;
+
+    if (chip == 0)
+	return 0;
+
+    /* the hardware loader stalls requests it doesn't know, but other
+     * firmware might not answer at all, or answer 0xA5 some other way
+     */
+    logverbose(EZUSB_LOG_INFO, "probe for 2nd stage loader\n");
+    status = ctrl_msg_timeout (device, "probe for 2nd stage loader",
+	LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+	GET_EEPROM_SIZE, 0, 0, &value, 1, PROBE_TIMEOUT_MS);
+    if (status != 1 || value > 1)
+	return 0;
+
+    /* and it must be this loader: its code is still in on-chip RAM.  The
+     * CPU keeps running, since halting it would stop the loader.
+     */
+    ctx.device = device;
+    ctx.match = 1;
+    status = ezusb_image_for_each_chunk (loader, chip, ezusb_ram_chunk, &ctx, ram_check_poke);
+    ezusb_log_flush();
+    return status == 0 && ctx.match;
+}
+
+int ezusb_read_eeprom (libusb_device_handle *dev, unsigned short addr,
+	unsigned char *data, size_t len)
+{
+    int			rc;
+    uint16_t		n;
+
+    if (addr + len > EZUSB_MAX_EEPROM_SIZE)
+	return -EINVAL;
+
+    while (len > 0) {
+	n = len < EZUSB_MAX_EEPROM_CHUNK ? (uint16_t) len : EZUSB_MAX_EEPROM_CHUNK;
+	rc = ezusb_read (dev, "read EEPROM", RW_EEPROM, addr, data, n);
+	if (rc != n)
+	    return rc < 0 ? rc : -EIO;
+	addr += n;
+	data += n;
+	len -= n;
+    }
+    ezusb_log_flush();
     return 0;
 }
 
 /*
- * Load an Intel HEX file into target (large) EEPROM, set up to boot from
+ * Compares one byte of the EEPROM with what should be there
+ */
+static int eeprom_byte_matches (libusb_device_handle *dev, unsigned short addr,
+	unsigned char expected, const char *what)
+{
+    unsigned char	value;
+    int			rc;
+
+    rc = ezusb_read_eeprom (dev, addr, &value, 1);
+    if (rc < 0)
+	return rc;
+    if (value != expected) {
+	logverbose(EZUSB_LOG_INFO, "EEPROM %s is 0x%02x, expected 0x%02x\n",
+	    what, value, expected);
+	return 0;
+    }
+    return 1;
+}
+
+int ezusb_verify_eeprom_image (libusb_device_handle *dev, const struct ezusb_image *image,
+	ezusb_chip_t type, int config)
+{
+    const struct ezusb_chip_traits *chip;
+    struct eeprom_verify_context	ctx;
+    struct ezusb_eeprom_plan	plan;
+    unsigned char		reset [4 + 1];
+    int				status;
+
+    chip = ezusb_get_chip_traits (type);
+    if (chip == 0) {
+	logerror("?? Unrecognized microcontroller type %s ??\n", ezusb_name[type]);
+	return -1;
+    }
+
+    /* an image that can't have been written can't match */
+    status = ezusb_plan_eeprom (image, type, &plan);
+    if (status < 0)
+	return status;
+
+    /* the type byte first: without it, the EEPROM isn't booted from */
+    status = eeprom_byte_matches (dev, 0, chip->eeprom_first_byte, "type byte");
+    if (status != 1)
+	return status;
+    if (chip->eeprom_config_mask) {
+	status = eeprom_byte_matches (dev, EZUSB_EEPROM_CONFIG_OFFSET,
+		(unsigned char)(config & chip->eeprom_config_mask), "config byte");
+	if (status != 1)
+	    return status;
+    }
+
+    ctx.device = dev;
+    ctx.ee_addr = chip->eeprom_header_len;
+    ctx.index = 0;
+    ctx.target = ALL_RECORDS;
+    ctx.status = 1;
+    status = ezusb_image_for_each_chunk (image, chip, EZUSB_MAX_EEPROM_CHUNK, &ctx, eeprom_verify_poke);
+    if (status < 0)
+	return status;
+    if (ctx.status != 1)
+	return ctx.status;
+
+    /* and the record that resets the CPU, ending the boot */
+    status = ezusb_read_eeprom (dev, ctx.ee_addr, reset, sizeof reset);
+    if (status < 0)
+	return status;
+    if (reset [0] != 0x80 || reset [1] != 1
+	    || reset [2] != (chip->cpucs_addr >> 8) || reset [3] != (chip->cpucs_addr & 0xFF)
+	    || reset [4] != 0) {
+	logverbose(EZUSB_LOG_INFO, "EEPROM reset record at 0x%04x doesn't match\n", ctx.ee_addr);
+	return 0;
+    }
+    return 1;
+}
+
+/*
+ * Load a firmware image into target (large) EEPROM, set up to boot from
  * that EEPROM using the specified microcontroller-specific config byte.
  * (Defaults:  FX2 0x08, FX 0x00, AN21xx n/a)
  *
  * Caller must have pre-loaded a second stage loader that knows how
  * to handle the EEPROM write requests.
  */
-int ezusb_load_eeprom (libusb_device_handle *dev, const char *path, ezusb_chip_t type, int config)
+int ezusb_load_eeprom_image (libusb_device_handle *dev, const struct ezusb_image *image, ezusb_chip_t type, int config)
 {
-    FILE			*image;
-    unsigned short		cpucs_addr;
-    int				(*is_external)(unsigned short off, size_t len);
+    return ezusb_resume_eeprom_image (dev, image, type, config, 0, NULL, NULL);
+}
+
+/*
+ * As above, but skipping the first "done" records if they read back
+ * correctly.  The EEPROM is still marked unbootable first, and only
+ * made bootable again once everything has been written.
+ */
+int ezusb_resume_eeprom_image (libusb_device_handle *dev, const struct ezusb_image *image,
+	ezusb_chip_t type, int config, size_t done,
+	ezusb_progress_fn progress, void *progress_context)
+{
+    const struct ezusb_chip_traits *chip;
     struct eeprom_poke_context	ctx;
+    struct ezusb_eeprom_plan	plan;
+    size_t			i;
     int				status;
-    unsigned char		value, first_byte;
+    unsigned char		value;
+
+    /* EZ-USB family devices differ, apart from the 8051 core */
+    chip = ezusb_get_chip_traits (type);
+    if (chip == 0) {
+	logerror("?? Unrecognized microcontroller type %s ??\n", ezusb_name[type]);
+	return -1;
+    }
+
+    /* refuse images that won't fit before changing anything */
+    status = ezusb_plan_eeprom (image, type, &plan);
+    if (status < 0)
+	return status;
 
     if (ezusb_get_eeprom_type (dev, &value) != 1 || value != 1) {
 	logerror("WARNING: don't see a large enough EEPROM\n");
 	return -1;
     }
 
-    image = fopen (path, "r");
-    if (image == 0) {
-	logerror("%s: unable to open for input.\n", path);
-	return -2;
-    } else if (verbose)
-	logerror("open EEPROM hexfile image %s\n", path);
+    logverbose(EZUSB_LOG_INFO, "2nd stage:  write boot EEPROM\n");
 
-    if (verbose)
-	logerror("2nd stage:  write boot EEPROM\n");
+    ctx.ee_addr = chip->eeprom_header_len;
+    config &= chip->eeprom_config_mask;
 
-    /* EZ-USB family devices differ, apart from the 8051 core */
+    /* the config bits mean different things on each family */
     switch (type) {
     case FX2LP:
     case FX2:
-	first_byte = 0xC2;
-	cpucs_addr = 0xe600;
-	is_external = type == FX2 ? fx2_is_external : fx2lp_is_external;
-	ctx.ee_addr = 8;
-	config &= 0x4f;
 	logerror(
 	    "FX2:  config = 0x%02x, %sconnected, I2C = %d KHz\n",
 	    config,
@@ -707,11 +1702,6 @@ int ezusb_load_eeprom (libusb_device_handle *dev, const char *path, ezusb_chip_t
         break;
 
     case FX:
-	first_byte = 0xB6;
-	cpucs_addr = 0x7f92;
-	is_external = fx_is_external;
-	ctx.ee_addr = 9;
-	config &= 0x07;
 	logerror(
 	    "FX:  config = 0x%02x, %d MHz%s, I2C = %d KHz\n",
 	    config,
@@ -721,18 +1711,9 @@ int ezusb_load_eeprom (libusb_device_handle *dev, const char *path, ezusb_chip_t
 	    );
         break;
 
-    case AN21:
-	first_byte = 0xB2;
-	cpucs_addr = 0x7f92;
-	is_external = fx_is_external;
-	ctx.ee_addr = 7;
-	config = 0;
-	logerror("AN21xx:  no EEPROM config byte\n");
-        break;
-
     default:
-	logerror("?? Unrecognized microcontroller type %s ??\n", ezusb_name[type]);
-	return -1;
+	logerror("%s:  no EEPROM config byte\n", ezusb_name[type]);
+        break;
     }
 
     /* make sure the EEPROM won't be used for booting,
@@ -744,45 +1725,78 @@ int ezusb_load_eeprom (libusb_device_handle *dev, const char *path, ezusb_chip_t
     if (status < 0)
 	return status;
 
+    /* Records are journaled only after they're written, but anything
+     * may have touched the EEPROM since; read back every record to be
+     * skipped, and resume from the first that doesn't match.
+     */
+    if (done > plan.records)
+	done = 0;
+    for (i = 0; i < done; i++) {
+	status = eeprom_record_matches (dev, image, chip, i);
+	if (status == 1)
+	    continue;
+	if (status < 0)
+	    logverbose(EZUSB_LOG_INFO, "can't read back EEPROM, rewriting all of it\n");
+	else
+	    logverbose(EZUSB_LOG_INFO, "EEPROM record %zu doesn't read back as written\n", i);
+	done = status < 0 ? 0 : i;
+	break;
+    }
+    if (done > 0)
+	logverbose(EZUSB_LOG_INFO, "resuming after %zu of %zu EEPROM records\n", done, plan.records);
+
     /* scan the image, write to EEPROM */
     ctx.device = dev;
     ctx.last = 0;
-    status = parse_ihex (image, &ctx, is_external, eeprom_poke);
+    ctx.done = 0;
+    ctx.skip = done;
+    ctx.written = ctx.reported = done;
+    ctx.progress = progress;
+    ctx.progress_context = progress_context;
+    status = ezusb_image_for_each_chunk (image, chip, EZUSB_MAX_EEPROM_CHUNK, &ctx, eeprom_poke);
+    ezusb_log_flush();
     if (status < 0) {
-	logerror("unable to write EEPROM %s\n", path);
+	fast_discard (fast_for (dev));
+	logerror("unable to write EEPROM\n");
 	return status;
     }
 
-    /* append a reset command */
+    /* append a reset command, and have everything land before the
+     * EEPROM is made bootable
+     */
     value = 0;
     ctx.last = 1;
-    status = eeprom_poke (&ctx, cpucs_addr, 0, &value, sizeof value);
+    status = eeprom_poke (&ctx, chip->cpucs_addr, 0, &value, sizeof value);
+    if (status == 0)
+	status = eeprom_sync (&ctx);
     if (status < 0) {
-	logerror("unable to append reset to EEPROM %s\n", path);
+	fast_discard (fast_for (dev));
+	logerror("unable to append reset to EEPROM\n");
 	return status;
     }
 
     /* write the config byte for FX, FX2 */
-    if (type != AN21) {
+    if (chip->eeprom_config_mask) {
 	value = config;
 	status = ezusb_write (dev, "write config byte",
-		RW_EEPROM, 7, &value, sizeof value);
+		RW_EEPROM, EZUSB_EEPROM_CONFIG_OFFSET, &value, sizeof value);
 	if (status < 0)
 	    return status;
     }
     
     /* EZ-USB FX has a reserved byte */
-    if (type == FX) {
+    if (chip->eeprom_has_reserved) {
 	value = 0;
 	status = ezusb_write (dev, "write reserved byte",
-		RW_EEPROM, 8, &value, sizeof value);
+		RW_EEPROM, EZUSB_EEPROM_RESERVED_OFFSET, &value, sizeof value);
 	if (status < 0)
 	    return status;
     }
 
     /* make the EEPROM say to boot from this EEPROM */
+    value = chip->eeprom_first_byte;
     status = ezusb_write (dev, "write EEPROM type byte",
-	    RW_EEPROM, 0, &first_byte, sizeof first_byte);
+	    RW_EEPROM, 0, &value, sizeof value);
     if (status < 0)
 	return status;
 
@@ -790,9 +1804,28 @@ int ezusb_load_eeprom (libusb_device_handle *dev, const char *path, ezusb_chip_t
      * written if the EEPROM type is modified (to B4 or C0).
      */
 
+    ezusb_log_flush();
     return 0;
 }
 
+/*
+ * Load an Intel HEX file into target EEPROM, as above.
+ */
+int ezusb_load_eeprom (libusb_device_handle *dev, const char *path, ezusb_chip_t type, int config)
+{
+    struct ezusb_image	image;
+    int			status;
+
+    ezusb_image_init (&image);
+    status = ezusb_image_load_file (&image, path);
+    if (status == 0)
+	status = ezusb_load_eeprom_image (dev, &image, type, config);
+    if (status < 0)
+	logerror("unable to write EEPROM %s\n", path);
+    ezusb_image_free (&image);
+    return status;
+}
+
 /*
  * $Log: ezusb.c,v $
  * Revision 1.2  2007/03/20 14:25:59  cfavi
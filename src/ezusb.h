@@ -23,32 +23,257 @@
 #include <libusb.h>
 #include <stdbool.h>
 
+#include "ezusb_log.h"
+
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
-// If supported, define an attribute to mark functions as doing printf formatting
-#ifdef __MINGW32__
-// On mingw we need to specify that we're using gnu printf provided by ucrt
-#define PRINTF_FORMAT_ATTRIBUTE  __attribute__ ((format (gnu_printf, 1, 2)))
-#elif defined(_MSC_VER)
-// No corresponding attribute for MSVC
-#define PRINTF_FORMAT_ATTRIBUTE
-#else
-#define PRINTF_FORMAT_ATTRIBUTE  __attribute__ ((format (printf, 1, 2)))
-#endif
-
-// Utility function to print to stderr
-void logerror(const char *format, ...) PRINTF_FORMAT_ATTRIBUTE;
-
-
 /*
  * Enum to manage various EZ-USB chip types.
  */
 typedef enum { NONE, AN21, FX, FX2, FX2LP } ezusb_chip_t;
 extern const char *ezusb_name[];
 
+/*
+ * A range of on-chip memory, [start, end] inclusive, which the hardware
+ * first stage loader can write with RW_INTERNAL requests.
+ */
+struct ezusb_mem_region {
+	unsigned short	start;
+	unsigned short	end;
+};
+
+#define EZUSB_MAX_INTERNAL_REGIONS	2
+
+/*
+ * Everything that differs between EZ-USB family members, as far as
+ * loading firmware goes.  There is one constant table entry per chip type,
+ * so supporting another variant means adding an entry, not another branch.
+ */
+struct ezusb_chip_traits {
+	ezusb_chip_t	type;
+	unsigned short	cpucs_addr;		/* CPUCS register, to halt/reset the CPU */
+	unsigned char	eeprom_first_byte;	/* EEPROM type byte for a "load firmware" image */
+	unsigned short	eeprom_header_len;	/* offset of the first EEPROM segment */
+	unsigned char	eeprom_config_mask;	/* valid config byte bits, 0 if there is no config byte */
+	bool		eeprom_has_reserved;	/* a reserved zero byte follows the config byte */
+	unsigned	internal_count;		/* entries used in internal[] */
+	struct ezusb_mem_region internal [EZUSB_MAX_INTERNAL_REGIONS];
+};
+
+/*
+ * Offsets of the config and reserved bytes in an EEPROM image,
+ * for the chips which have them.
+ */
+#define EZUSB_EEPROM_CONFIG_OFFSET	7
+#define EZUSB_EEPROM_RESERVED_OFFSET	8
+
+/*
+ * Returns the traits for a chip type, or null for NONE/unknown values.
+ */
+extern const struct ezusb_chip_traits *ezusb_get_chip_traits (ezusb_chip_t type);
+
+/*
+ * Guesses the chip type from the default VID/PID that unconfigured
+ * EZ-USB devices enumerate with.  Returns NONE for unknown IDs.
+ */
+extern ezusb_chip_t ezusb_chip_from_ids (uint16_t vid, uint16_t pid);
+
+/*
+ * Returns true iff [addr,addr+len) includes memory outside the chip's
+ * on-chip RAM, i.e. memory only a second stage loader can write.
+ */
+extern int ezusb_is_external (const struct ezusb_chip_traits *chip, unsigned short addr, size_t len);
+
+/*
+ * Returns the on-chip RAM region holding addr, or null if it's external.
+ */
+extern const struct ezusb_mem_region *ezusb_find_region (const struct ezusb_chip_traits *chip, unsigned short addr);
+
+/*
+ * Returns the last address of the stretch of memory holding addr: the end
+ * of its on-chip region, or the end of the external memory before the
+ * next on-chip region.  A transfer must not cross this boundary.
+ */
+extern unsigned short ezusb_region_end (const struct ezusb_chip_traits *chip, unsigned short addr);
+
+struct ezusb_image;
+
+/*
+ * These are the requests (bRequest) that the bootstrap loader is expected
+ * to recognize.  The codes are reserved by Cypress, and these values match
+ * what EZ-USB hardware, or "Vend_Ax" firmware (2nd stage loader) uses.
+ * Cypress' "a3load" is nice because it supports both FX and FX2, although
+ * it doesn't have the EEPROM support (subset of "Vend_Ax").
+ */
+#define RW_INTERNAL	0xA0		/* hardware implements this one */
+#define RW_EEPROM	0xA2
+#define RW_MEMORY	0xA3
+#define GET_EEPROM_SIZE	0xA5
+
+/*
+ * Optional requests of a second stage loader that can also take RW_MEMORY
+ * and RW_EEPROM writes as frames on a bulk OUT endpoint, so many writes
+ * share a few large transfers instead of a control round trip each:
+ *
+ *  FAST_LOADER_INFO (IN, 8 bytes): 'F', 'X', version (1), the OUT
+ *	endpoint address, the interface holding it, a reserved byte, and
+ *	the most data bytes one frame may carry (little endian).
+ *  frames: request (RW_MEMORY or RW_EEPROM), 0, address (le16),
+ *	length (le16), 0, 0, then length data bytes.  A frame never spans
+ *	two bulk transfers.
+ *  FAST_LOADER_SYNC (IN, 4 bytes): status (0 if every frame since the
+ *	last sync was written), a reserved byte, and the count of those
+ *	frames done (le16).
+ *
+ * Loaders that stall FAST_LOADER_INFO, such as Vend_Ax, get vendor
+ * requests as before.
+ */
+#define FAST_LOADER_INFO	0xB0
+#define FAST_LOADER_SYNC	0xB1
+
+/*
+ * Replaces the device for every control request fxload sends, e.g. to
+ * plan a load without hardware.  The function gets the request with a
+ * short description of it, and returns what libusb_control_transfer()
+ * would: the bytes transferred, or a negative error.  Pipelining is off
+ * while a transport is set.  Pass null to talk to devices again.  Only
+ * requests sent from the calling thread are affected.
+ */
+typedef int (*ezusb_transport_fn) (void *context, const char *label,
+	unsigned char requestType, unsigned char request,
+	unsigned short value, unsigned short index,
+	unsigned char *data, uint16_t length);
+extern void ezusb_set_transport (ezusb_transport_fn fn, void *context);
+
+/*
+ * Likewise for the bulk transfers sent to a fast loader: returns what
+ * libusb_bulk_transfer() would, with the bytes sent in *transferred.  A
+ * fast loader is only used through a transport if both are set.
+ */
+typedef int (*ezusb_bulk_transport_fn) (void *context, unsigned char endpoint,
+	unsigned char *data, int length, int *transferred);
+extern void ezusb_set_bulk_transport (ezusb_bulk_transport_fn fn, void *context);
+
+/*
+ * Reports every control request fxload makes after it completes, e.g. to
+ * record a trace of a run for later analysis.  This includes pipelined RAM
+ * writes, which are reported from their completion (or failed submission),
+ * and requests answered by a transport, but not bulk transfers to a fast
+ * loader.  data holds the bytes sent, or for reads the status bytes
+ * received.  Only requests made by the calling thread are reported.  Pass
+ * null to stop.
+ */
+struct ezusb_trace_event {
+	unsigned char		requestType;
+	unsigned char		request;
+	unsigned short		value;
+	unsigned short		index;
+	uint16_t		length;
+	const unsigned char	*data;
+	int			status;		/* bytes transferred, or a negative error */
+	bool			pipelined;
+	uint64_t		start_us;	/* ezusb_clock_us() when sent */
+	uint64_t		end_us;		/* and when done */
+};
+typedef void (*ezusb_trace_fn) (void *context, const struct ezusb_trace_event *event);
+extern void ezusb_set_trace (ezusb_trace_fn fn, void *context);
+
+/*
+ * Largest chunk written per request, for each write target.  EEPROM
+ * segments max out at 1023 bytes, since that's all the length field of
+ * a boot EEPROM record can hold.  RAM writes (0xA0 and 0xA3 requests)
+ * may be up to 64 KBytes under the protocol, but a given loader or host
+ * USB stack may accept less: usbfs and WinUSB cap control transfers at
+ * 4 KBytes, so RAM loads start there unless told otherwise, and back off.
+ */
+#define EZUSB_MAX_EEPROM_CHUNK	1023
+#define EZUSB_MAX_RAM_CHUNK	0xFFFF
+#define EZUSB_DEFAULT_RAM_CHUNK	4096
+#define EZUSB_MIN_RAM_CHUNK	EZUSB_MAX_EEPROM_CHUNK	/* always worked */
+
+/*
+ * Largest RAM write to attempt, initially EZUSB_DEFAULT_RAM_CHUNK.
+ * Whenever the device rejects a write longer than EZUSB_MIN_RAM_CHUNK as
+ * too big (see ezusb_write_too_big()), the write is retried in halves and
+ * this is lowered to match, so later writes (and later loads in the same
+ * run) start from a size that worked.
+ * May be set beforehand to skip the probing.  Like the other settings
+ * here, each thread has its own copy, starting from the default.
+ */
+extern EZUSB_THREAD_LOCAL uint16_t ezusb_ram_chunk;
+
+/*
+ * Whether a write failed because the request was bigger than the loader
+ * or the host's USB stack takes, so a smaller one may go through.  Other
+ * failures, such as timeouts, don't say anything about the size.
+ */
+extern int ezusb_write_too_big (int status);
+
+/*
+ * Number of RAM writes kept in flight at once.  With 1 (the default) each
+ * write waits for the one before it; more lets the host controller start
+ * the next request without a round trip through fxload.  If a pipelined
+ * write fails, the load falls back to 1 and continues.
+ */
+#define EZUSB_MAX_QUEUE_DEPTH	16
+extern EZUSB_THREAD_LOCAL unsigned ezusb_ram_queue_depth;
+
+/*
+ * A fixed set of control transfers with buffers, allocated once and
+ * reused, so queueing a request doesn't allocate.  Where libusb and the
+ * platform support it, the buffers come from libusb_dev_mem_alloc(), so
+ * usbfs does DMA straight from them instead of copying each request into
+ * the kernel first.  Each buffer holds a setup packet and data_len bytes.
+ * A pool belongs to one device, and must not be freed while any of its
+ * transfers are in flight.
+ */
+struct ezusb_pool;
+extern struct ezusb_pool *ezusb_pool_new (libusb_device_handle *device, unsigned count, size_t data_len);
+extern void ezusb_pool_free (struct ezusb_pool *pool);
+
+/*
+ * Takes a transfer from the pool, or returns null if all are in use.
+ * Its buffer is set; the rest is up to libusb_fill_control_transfer().
+ */
+extern struct libusb_transfer *ezusb_pool_get (struct ezusb_pool *pool);
+extern void ezusb_pool_put (struct ezusb_pool *pool, struct libusb_transfer *xfer);
+
+/*
+ * Whether the pool's buffers are device memory the host can DMA from.
+ */
+extern int ezusb_pool_is_dma (const struct ezusb_pool *pool);
+
+/*
+ * Checks that device RAM still holds an image, by stopping the CPU and
+ * reading back EZUSB_SAMPLE_WINDOWS windows of EZUSB_SAMPLE_BYTES each,
+ * spread over the image (see ezusb_image_sample()), so it costs a few
+ * requests however big the image is.  It can miss RAM that differs from
+ * the image only outside those windows, such as a slightly different
+ * build loaded by another tool, or variables the firmware keeps within
+ * its own image.  External memory can only be read through a second
+ * stage loader.  Returns 1 if every window matches, 0 if not, or a
+ * negative error.  The CPU is left stopped.
+ */
+#define EZUSB_SAMPLE_WINDOWS	4
+#define EZUSB_SAMPLE_BYTES	128
+
+extern int ezusb_sample_ram (libusb_device_handle *device, const struct ezusb_image *image,
+	ezusb_chip_t type);
+
+/*
+ * Measures on-chip RAM write throughput for one chunk size and queue
+ * depth, by writing the chip's first on-chip RAM region through the
+ * hardware loader until at least the given number of bytes have gone
+ * out.  Returns bytes per second, zero if the device didn't accept that
+ * setting, or a negative error.  The CPU is left stopped, with junk in
+ * its RAM, so a load should follow.
+ */
+extern double ezusb_measure_ram_write (libusb_device_handle *device, ezusb_chip_t type,
+	uint16_t chunk, unsigned depth, size_t bytes);
+
 /*
  * This function loads the firmware from the given file into RAM.
  * The file is assumed to be in Intel HEX format.  If fx2 is set, uses
@@ -60,6 +285,11 @@ extern const char *ezusb_name[];
  */
 extern int ezusb_load_ram (libusb_device_handle *device, const char *path, ezusb_chip_t type, int stage);
 
+/*
+ * As ezusb_load_ram(), but takes an image already parsed into memory.
+ */
+extern int ezusb_load_ram_image (libusb_device_handle *device, const struct ezusb_image *image, ezusb_chip_t type, int stage);
+
 
 /*
  * This function stores the firmware from the given file into EEPROM.
@@ -79,9 +309,113 @@ extern int ezusb_load_eeprom (
 	int config		/* config byte for fx/fx2; else zero */
 	);
 
+/*
+ * As ezusb_load_eeprom(), but takes an image already parsed into memory.
+ */
+extern int ezusb_load_eeprom_image (libusb_device_handle *dev, const struct ezusb_image *image, ezusb_chip_t type, int config);
+
+/*
+ * Called as EEPROM records are written, with the number written so far,
+ * so a caller can journal progress and resume an interrupted job.
+ */
+typedef void (*ezusb_progress_fn) (void *context, size_t done);
+
+/*
+ * As ezusb_load_eeprom_image(), but resuming a job that was interrupted
+ * after "done" records were written (as reported by progress).  Those
+ * records are all read back, and writing resumes from the first that
+ * doesn't match.  The EEPROM stays marked unbootable until the end, as
+ * always.
+ */
+extern int ezusb_resume_eeprom_image (libusb_device_handle *dev, const struct ezusb_image *image,
+	ezusb_chip_t type, int config, size_t done,
+	ezusb_progress_fn progress, void *progress_context);
+
+/*
+ * Size of the boot EEPROM in bytes.  The loader can only tell fxload the
+ * EEPROM's address width, so this defaults to the 64 KBytes that 16-bit
+ * addresses reach; set it to the part actually fitted to catch images
+ * that would wrap around.
+ */
+#define EZUSB_MAX_EEPROM_SIZE	0x10000
+extern EZUSB_THREAD_LOCAL size_t ezusb_eeprom_size;
+
+/*
+ * How an image is laid out in a boot EEPROM: one record (a 4 byte header
+ * plus up to 1023 bytes of data) per chunk, after the chip's header and
+ * before a final record that resets the CPU.
+ */
+struct ezusb_eeprom_plan {
+	size_t	records;	/* data records, not counting the reset */
+	size_t	data_bytes;
+	size_t	total_bytes;	/* everything written, headers included */
+};
+
+/*
+ * Works out an image's EEPROM layout without touching any device, so a
+ * job that can't succeed is refused before anything is written.  Returns
+ * 0, or a negative value (after logging why) if the image holds data the
+ * EEPROM can't load or doesn't fit in ezusb_eeprom_size bytes.
+ * ezusb_load_eeprom_image() does this check itself as well.
+ */
+extern int ezusb_plan_eeprom (const struct ezusb_image *image, ezusb_chip_t type,
+	struct ezusb_eeprom_plan *plan);
+
+/*
+ * Estimates how long the boot ROM takes to read an image laid out as
+ * planned from the EEPROM at power-up, in microseconds.  It reads every
+ * byte, headers included, in one sequential I2C read; the bus runs at
+ * 400 KHz if the config byte selects it, and 100 KHz otherwise (or if the
+ * chip has no config byte).
+ */
+extern unsigned long ezusb_eeprom_boot_us (const struct ezusb_eeprom_plan *plan,
+	ezusb_chip_t type, int config);
 
-/* Verbosity level from 0 (least verbose) to 3 (most verbose) */
-extern int verbose;
+/*
+ * Checks if the second stage loader in the given image (such as Vend_Ax)
+ * is already running, from an earlier run, so downloading it again can be
+ * skipped.  Only reads: the GET_EEPROM_SIZE request must be answered with
+ * 0 or 1 within a second, and on-chip RAM must still hold the loader's
+ * code.  Returns true if both hold.
+ */
+extern int ezusb_probe_loader (libusb_device_handle *device,
+	const struct ezusb_image *loader, ezusb_chip_t type);
+
+/*
+ * Asks the second stage loader running on the device if it takes bulk
+ * frames (see FAST_LOADER_INFO), and if so claims its interface, so this
+ * thread's external RAM and EEPROM writes to the device go that way.
+ * Frames are batched into transfers of up to 16 KBytes, and each load
+ * syncs before it returns; EEPROM loads also sync after every batch, so
+ * progress is only reported for records known to have landed.  If a RAM
+ * load's bulk writes fail, it detaches and writes again with vendor
+ * requests.  Stopping the CPU detaches too, since the loader stops with
+ * it.  Returns 1 if attached, 0 if vendor requests will be used.
+ */
+extern int ezusb_attach_fast_loader (libusb_device_handle *device);
+
+/*
+ * Stops using the fast loader, if one is attached, and releases its
+ * interface.  Nothing is left batched between loads, so nothing is sent.
+ * Call it before closing the device.
+ */
+extern void ezusb_detach_fast_loader (void);
+
+/*
+ * Reads len bytes of the boot EEPROM, starting at addr, through a second
+ * stage loader.  Returns 0, or a negative error.
+ */
+extern int ezusb_read_eeprom (libusb_device_handle *dev, unsigned short addr,
+	unsigned char *data, size_t len);
+
+/*
+ * Reads back everything ezusb_load_eeprom_image() would write for this
+ * image and config byte, through a second stage loader.  Returns 1 if
+ * the EEPROM holds exactly that, 0 if not (where it differs is logged
+ * with -v), or a negative error.
+ */
+extern int ezusb_verify_eeprom_image (libusb_device_handle *dev, const struct ezusb_image *image,
+	ezusb_chip_t type, int config);
 
 
 #define USB_DIR_OUT                     0               /* to device */
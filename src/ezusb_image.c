@@ -0,0 +1,943 @@
+/*
+ * Copyright (c) 2026 Mbed CE
+ * Copyright (c) 2001 Stephen Williams (steve@icarus.com)
+ * Copyright (c) 2001-2002 David Brownell (dbrownell@users.sourceforge.net)
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ezusb_image.h"
+
+/*
+ * This file holds firmware images in memory.  Reading the file once into
+ * a segment list (instead of streaming it straight to the device) means
+ * two stage loads don't re-parse it, and gives a place to reshape the
+ * image into as few, as large, transfers as possible before any USB
+ * traffic happens.
+ */
+
+void ezusb_image_init (struct ezusb_image *image)
+{
+    image->segs = 0;
+    image->count = image->alloc = 0;
+}
+
+void ezusb_image_free (struct ezusb_image *image)
+{
+    size_t	i;
+
+    for (i = 0; i < image->count; i++)
+	free (image->segs[i].data);
+    free (image->segs);
+    ezusb_image_init (image);
+}
+
+/*
+ * Makes room for at least len more bytes at the end of a segment.
+ */
+static int segment_reserve (struct ezusb_segment *seg, uint32_t len)
+{
+    uint32_t		cap;
+    unsigned char	*data;
+
+    if (seg->len + len <= seg->cap)
+	return 0;
+
+    cap = seg->cap ? seg->cap : 256;
+    while (cap < seg->len + len)
+	cap *= 2;
+    data = realloc (seg->data, cap);
+    if (data == 0)
+	return -1;
+    seg->data = data;
+    seg->cap = cap;
+    return 0;
+}
+
+int ezusb_image_append (struct ezusb_image *image, uint32_t addr,
+	const unsigned char *data, uint32_t len)
+{
+    struct ezusb_segment	*seg;
+
+    if (len == 0)
+	return 0;
+
+    seg = image->count ? &image->segs[image->count - 1] : 0;
+    if (seg == 0 || addr != seg->addr + seg->len) {
+	if (image->count == image->alloc) {
+	    size_t			alloc = image->alloc ? image->alloc * 2 : 16;
+	    struct ezusb_segment	*segs;
+
+	    segs = realloc (image->segs, alloc * sizeof *segs);
+	    if (segs == 0)
+		return -1;
+	    image->segs = segs;
+	    image->alloc = alloc;
+	}
+	seg = &image->segs[image->count++];
+	seg->addr = addr;
+	seg->len = seg->cap = 0;
+	seg->data = 0;
+    }
+
+    if (segment_reserve (seg, len) < 0)
+	return -1;
+    memcpy (seg->data + seg->len, data, len);
+    seg->len += len;
+    return 0;
+}
+
+size_t ezusb_image_size (const struct ezusb_image *image)
+{
+    size_t	i, total = 0;
+
+    for (i = 0; i < image->count; i++)
+	total += image->segs[i].len;
+    return total;
+}
+
+uint64_t ezusb_image_hash (const struct ezusb_image *image)
+{
+    uint64_t	hash = 0xcbf29ce484222325ULL;	/* FNV-1a */
+    size_t	i;
+    uint32_t	j;
+
+    for (i = 0; i < image->count; i++) {
+	const struct ezusb_segment	*seg = &image->segs[i];
+	unsigned char			where [8];
+
+	for (j = 0; j < 4; j++) {
+	    where [j] = (unsigned char)(seg->addr >> (8 * j));
+	    where [4 + j] = (unsigned char)(seg->len >> (8 * j));
+	}
+	for (j = 0; j < sizeof where; j++)
+	    hash = (hash ^ where [j]) * 0x100000001b3ULL;
+	for (j = 0; j < seg->len; j++)
+	    hash = (hash ^ seg->data [j]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+int ezusb_image_sample (struct ezusb_image *sample, const struct ezusb_image *image,
+	unsigned windows, uint32_t window_len)
+{
+    size_t	total = ezusb_image_size (image), stride, base = 0, i = 0;
+    uint64_t	jitter;
+    unsigned	k;
+
+    /* small enough to take all of it */
+    if (windows == 0 || total <= (size_t) windows * window_len) {
+	for (i = 0; i < image->count; i++)
+	    if (ezusb_image_append (sample, image->segs[i].addr,
+			image->segs[i].data, image->segs[i].len) < 0)
+		return -ENOMEM;
+	return 0;
+    }
+
+    /* One window in each of "windows" equal stretches of the image's
+     * bytes, all at the same offset into their stretch.  The offset comes
+     * from the image's hash, so different builds sample different bytes
+     * rather than always the vector table.
+     */
+    stride = total / windows;
+    jitter = ezusb_image_hash (image) % (stride - window_len + 1);
+    for (k = 0; k < windows; k++) {
+	const struct ezusb_segment	*seg;
+	size_t				pos = k * stride + (size_t) jitter;
+	uint32_t			off, len;
+
+	while (base + image->segs[i].len <= pos)
+	    base += image->segs[i++].len;
+	seg = &image->segs[i];
+	off = (uint32_t) (pos - base);
+	len = seg->len - off < window_len ? seg->len - off : window_len;
+	if (ezusb_image_append (sample, seg->addr + off, seg->data + off, len) < 0)
+	    return -ENOMEM;
+    }
+    return 0;
+}
+
+int ezusb_image_diff (struct ezusb_image *delta, const struct ezusb_image *image,
+	const struct ezusb_image *old, uint32_t merge_gap)
+{
+    size_t	i, j = 0;
+
+    for (i = 0; i < image->count; i++) {
+	const struct ezusb_segment	*seg = &image->segs[i];
+	uint32_t			off, run_start = 0, run_end = 0;
+	int				in_run = 0;
+
+	for (off = 0; off < seg->len; off++) {
+	    uint32_t	addr = seg->addr + off;
+	    int		same = 0;
+
+	    /* both images are sorted, so old only needs walking forward */
+	    while (j < old->count && old->segs[j].addr + old->segs[j].len <= addr)
+		j++;
+	    if (j < old->count && old->segs[j].addr <= addr)
+		same = old->segs[j].data[addr - old->segs[j].addr] == seg->data[off];
+	    if (same)
+		continue;
+
+	    /* a change near the last one extends its run */
+	    if (in_run && off - run_end < merge_gap) {
+		run_end = off + 1;
+		continue;
+	    }
+	    if (in_run && ezusb_image_append (delta, seg->addr + run_start,
+			seg->data + run_start, run_end - run_start) < 0)
+		return -ENOMEM;
+	    run_start = off;
+	    run_end = off + 1;
+	    in_run = 1;
+	}
+	if (in_run && ezusb_image_append (delta, seg->addr + run_start,
+		    seg->data + run_start, run_end - run_start) < 0)
+	    return -ENOMEM;
+    }
+    return 0;
+}
+
+/*****************************************************************************/
+
+/*
+ * Value of each character as a hex digit, or -1.
+ */
+static const signed char hex_digit [256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+/*
+ * Decode two hex digits; returns -1 if they aren't both hex digits.
+ */
+static int hex_byte (const char *cp)
+{
+    int		hi = hex_digit [(unsigned char) cp[0]];
+    int		lo = hex_digit [(unsigned char) cp[1]];
+
+    if (hi < 0 || lo < 0)
+	return -1;
+    return (hi << 4) | lo;
+}
+
+/*
+ * Decode a run of hex digit pairs.  Returns false if any character
+ * isn't a hex digit.  The loop has no early exit, so compilers can
+ * vectorize it.
+ */
+static int hex_decode (const char *cp, unsigned char *out, unsigned count)
+{
+    unsigned	i;
+    int		bad = 0;
+
+    for (i = 0; i < count; i++) {
+	int	hi = hex_digit [(unsigned char) cp[2 * i]];
+	int	lo = hex_digit [(unsigned char) cp[2 * i + 1]];
+
+	bad |= hi | lo;
+	out[i] = (unsigned char) ((hi << 4) | (lo & 0x0f));
+    }
+    return bad >= 0;
+}
+
+/*
+ * Sum of a record's bytes, modulo 256.  Kept as a plain reduction
+ * over the decoded bytes so the compiler turns it into vector adds.
+ */
+static unsigned char checksum_bytes (const unsigned char *bytes, unsigned count)
+{
+    unsigned	i, sum = 0;
+
+    for (i = 0; i < count; i++)
+	sum += bytes[i];
+    return (unsigned char) sum;
+}
+
+/*
+ * Parse an Intel HEX image file into memory segments.  Every record is
+ * decoded in one pass and its length, checksum and type are checked
+ * before any of its data is used.
+ */
+int ezusb_image_load_ihex (struct ezusb_image *image, FILE *file)
+{
+    uint32_t	upper = 0;	/* from extended address records */
+    unsigned	line = 0;
+
+    /* Read the input file as an IHEX file, and collect the memory segments
+     * as we go.  Each line holds a max of 16 bytes, but downloading is
+     * faster (and EEPROM space smaller) if we merge those lines into larger
+     * chunks.  Most hex files keep memory segments together, which makes
+     * such merging all but free.  Tools that emit records in section order
+     * rather than address order are handled by ezusb_image_normalize().
+     */
+    for (;;) {
+	char 		buf [600], *cp;
+	size_t		chars;
+	unsigned	type, len, off;
+	unsigned char	bytes [5 + 255];	/* len, addr, type, data, sum */
+	unsigned char	*data = bytes + 4;
+
+	cp = fgets(buf, sizeof buf, file);
+	/* a file cut off between records would otherwise look whole */
+	if (cp == 0) {
+	    logerror("EOF without EOF record!\n");
+	    return -5;
+	}
+	line++;
+
+	/* EXTENSION: "# comment-till-end-of-line", for copyrights etc */
+	if (buf[0] == '#')
+	    continue;
+
+	if (buf[0] != ':') {
+	    logerror("line %u: not an ihex record: %s", line, buf);
+	    return -2;
+	}
+
+	/* ignore any newline or trailing whitespace */
+	chars = strcspn (buf, "\r\n");
+	while (chars > 0 && (buf[chars - 1] == ' ' || buf[chars - 1] == '\t'))
+	    chars--;
+	buf[chars] = 0;
+
+	logverbose(EZUSB_LOG_TRACE, "** LINE: %s\n", buf);
+
+	/* length, address, type, data and checksum are all hex pairs,
+	 * and no more of them than the longest record holds
+	 */
+	if (chars < 11 || (chars - 1) % 2 != 0 || (chars - 1) / 2 > sizeof bytes
+		|| !hex_decode (buf + 1, bytes, (unsigned) (chars - 1) / 2)) {
+	    logerror("line %u: malformed record: %s\n", line, buf);
+	    return -4;
+	}
+	len = bytes[0];
+	off = (unsigned) bytes[1] << 8 | bytes[2];
+	type = bytes[3];
+
+	if ((chars - 1) / 2 != len + 5u) {
+	    logerror("line %u: record length %u doesn't match its %u data bytes\n",
+		line, len, (unsigned) ((chars - 1) / 2) - 5);
+	    return -4;
+	}
+
+	if (checksum_bytes (bytes, len + 5) != 0) {
+	    logerror("line %u: bad checksum 0x%02x, expected 0x%02x\n", line,
+		bytes[len + 4],
+		(unsigned char) (bytes[len + 4] - checksum_bytes (bytes, len + 5)));
+	    return -6;
+	}
+
+	/* If this is an EOF record, then make it so. */
+	if (type == 1) {
+	    logverbose(EZUSB_LOG_DEBUG, "EOF on hexfile\n");
+	    break;
+	}
+
+	switch (type) {
+	case 0:
+	    /* contiguous records are merged into one segment */
+	    if (ezusb_image_append (image, upper + off, data, len) < 0) {
+		logerror("out of memory\n");
+		return -1;
+	    }
+	    break;
+
+	case 2:		/* extended segment address: bits 4-19 */
+	case 4:		/* extended linear address: bits 16-31 */
+	    if (len != 2) {
+		logerror("line %u: bad extended address record\n", line);
+		return -4;
+	    }
+	    upper = ((uint32_t) data[0] << 8 | data[1]) << (type == 2 ? 4 : 16);
+	    break;
+
+	case 3:		/* start segment address */
+	case 5:		/* start linear address */
+	    /* the EZ-USB always starts at its reset vector */
+	    break;
+
+	default:
+	    logerror("line %u: unsupported record type: %u\n", line, type);
+	    return -3;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Parse a Motorola S-record file into memory segments.
+ */
+int ezusb_image_load_srec (struct ezusb_image *image, FILE *file)
+{
+    for (;;) {
+	char		buf [600], *cp;
+	unsigned char	bytes [256];
+	unsigned	count, idx, addr_len;
+	uint32_t	addr;
+	int		value;
+
+	cp = fgets(buf, sizeof buf, file);
+	if (cp == 0) {
+	    logerror("EOF without termination record!\n");
+	    return -5;
+	}
+
+	buf[strcspn (buf, "\r\n")] = 0;
+	if (buf[0] == 0)
+	    continue;
+
+	logverbose(EZUSB_LOG_TRACE, "** LINE: %s\n", buf);
+
+	if (buf[0] != 'S' || buf[1] < '0' || buf[1] > '9'
+		|| (value = hex_byte (buf + 2)) < 0) {
+	    logerror("not an S-record: %s\n", buf);
+	    return -2;
+	}
+
+	/* count covers the address, data, and checksum bytes */
+	count = (unsigned) value;
+	if (count < 3 || strlen (buf) != count * 2 + 4) {
+	    logerror("record length doesn't match: %s\n", buf);
+	    return -4;
+	}
+	if (!hex_decode (buf + 4, bytes, count)) {
+	    logerror("bad hex digit in record: %s\n", buf);
+	    return -4;
+	}
+	if (((count + checksum_bytes (bytes, count)) & 0xff) != 0xff) {
+	    logerror("bad checksum in record: %s\n", buf);
+	    return -6;
+	}
+
+	switch (buf[1]) {
+	case '1': case '9':
+	    addr_len = 2;
+	    break;
+	case '2': case '8':
+	    addr_len = 3;
+	    break;
+	case '3': case '7':
+	    addr_len = 4;
+	    break;
+	default:
+	    /* S0 header, S5/S6 record counts: nothing to load */
+	    continue;
+	}
+
+	/* S7-S9 carry the start address and end the file */
+	if (buf[1] >= '7') {
+	    logverbose(EZUSB_LOG_DEBUG, "EOF on S-record file\n");
+	    break;
+	}
+
+	if (count < addr_len + 1) {
+	    logerror("record too short?\n");
+	    return -4;
+	}
+	for (addr = 0, idx = 0; idx < addr_len; idx++)
+	    addr = (addr << 8) | bytes [idx];
+	if (ezusb_image_append (image, addr, bytes + addr_len, count - addr_len - 1) < 0) {
+	    logerror("out of memory\n");
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Reads a little- or big-endian field out of an ELF header.
+ */
+static uint32_t elf_field (const unsigned char *p, unsigned size, int big_endian)
+{
+    uint32_t	value = 0;
+    unsigned	i;
+
+    /* offsets and addresses wider than 32 bits are truncated */
+    for (i = 0; i < size && i < 4; i++) {
+	if (big_endian)
+	    value |= (uint32_t) p[size - 1 - i] << (8 * i);
+	else
+	    value |= (uint32_t) p[i] << (8 * i);
+    }
+    return value;
+}
+
+/*
+ * Copy size bytes at offset in an ELF file into the image at addr.
+ */
+static int elf_load_range (struct ezusb_image *image, FILE *file,
+	uint32_t offset, uint32_t addr, uint32_t size)
+{
+    unsigned char	buf [4096];
+
+    logverbose(EZUSB_LOG_DEBUG, "ELF segment: %u bytes at 0x%04x\n",
+	(unsigned) size, (unsigned) addr);
+    if (fseek (file, (long) offset, SEEK_SET) != 0) {
+	logerror("truncated ELF segment\n");
+	return -4;
+    }
+    while (size) {
+	size_t	n = size < sizeof buf ? size : sizeof buf;
+
+	if (fread (buf, 1, n, file) != n) {
+	    logerror("truncated ELF segment\n");
+	    return -4;
+	}
+	if (ezusb_image_append (image, addr, buf, (uint32_t) n) < 0) {
+	    logerror("out of memory\n");
+	    return -1;
+	}
+	addr += (uint32_t) n;
+	size -= (uint32_t) n;
+    }
+    return 0;
+}
+
+/*
+ * Load the PT_LOAD program headers of an ELF file, at their physical
+ * (load) addresses.  32 and 64 bit, either byte order.  Object files
+ * without program headers (e.g. from objcopy) fall back to their
+ * allocated PROGBITS sections.
+ */
+int ezusb_image_load_elf (struct ezusb_image *image, FILE *file)
+{
+    unsigned char	ehdr [64], hdr [64];
+    int			is64, big, use_sections;
+    unsigned		word, hdr_len;
+    uint32_t		table, entsize, num, i;
+    size_t		got;
+    int			status;
+
+    /* the 32 bit header is 52 bytes long, the 64 bit one 64 */
+    got = fread (ehdr, 1, sizeof ehdr, file);
+    if (got < 52 || memcmp (ehdr, "\177ELF", 4) != 0
+	    || (ehdr[4] == 2 && got < 64)) {
+	logerror("not an ELF file\n");
+	return -2;
+    }
+    is64 = ehdr[4] == 2;
+    big = ehdr[5] == 2;
+    word = is64 ? 8 : 4;
+
+    num = elf_field (ehdr + (is64 ? 56 : 44), 2, big);
+    use_sections = num == 0;
+    if (!use_sections) {
+	table = elf_field (ehdr + (is64 ? 32 : 28), word, big);
+	entsize = elf_field (ehdr + (is64 ? 54 : 42), 2, big);
+	hdr_len = is64 ? 56 : 32;
+    } else {
+	table = elf_field (ehdr + (is64 ? 40 : 32), word, big);
+	entsize = elf_field (ehdr + (is64 ? 58 : 46), 2, big);
+	num = elf_field (ehdr + (is64 ? 60 : 48), 2, big);
+	hdr_len = is64 ? 64 : 40;
+    }
+    if (num == 0 || entsize < hdr_len) {
+	logerror("ELF file has nothing to load\n");
+	return -2;
+    }
+
+    for (i = 0; i < num; i++) {
+	uint32_t	offset, addr, size;
+
+	if (fseek (file, (long) (table + i * entsize), SEEK_SET) != 0
+		|| fread (hdr, 1, hdr_len, file) != hdr_len) {
+	    logerror("truncated ELF header table\n");
+	    return -4;
+	}
+
+	if (!use_sections) {
+	    /* PT_LOAD segments with file contents */
+	    if (elf_field (hdr, 4, big) != 1)
+		continue;
+	    offset = elf_field (hdr + (is64 ? 8 : 4), word, big);
+	    addr = elf_field (hdr + (is64 ? 24 : 12), word, big);
+	    size = elf_field (hdr + (is64 ? 32 : 16), word, big);
+	} else {
+	    /* SHT_PROGBITS sections with SHF_ALLOC */
+	    if (elf_field (hdr + 4, 4, big) != 1
+		    || !(elf_field (hdr + 8, word, big) & 0x2))
+		continue;
+	    addr = elf_field (hdr + (is64 ? 16 : 12), word, big);
+	    offset = elf_field (hdr + (is64 ? 24 : 16), word, big);
+	    size = elf_field (hdr + (is64 ? 32 : 20), word, big);
+	}
+	if (size == 0)
+	    continue;
+
+	status = elf_load_range (image, file, offset, addr, size);
+	if (status < 0)
+	    return status;
+    }
+
+    return 0;
+}
+
+/*
+ * Load a raw binary file, starting at the given address.
+ */
+int ezusb_image_load_bin (struct ezusb_image *image, FILE *file, uint32_t base)
+{
+    unsigned char	buf [4096];
+    size_t		n;
+
+    while ((n = fread (buf, 1, sizeof buf, file)) > 0) {
+	if (ezusb_image_append (image, base, buf, (uint32_t) n) < 0) {
+	    logerror("out of memory\n");
+	    return -1;
+	}
+	base += (uint32_t) n;
+    }
+    return ferror (file) ? -2 : 0;
+}
+
+const char *ezusb_image_format_name[] = { "auto", "ihex", "srec", "elf", "bin" };
+
+/*
+ * Work out the format of a file from its first bytes, or failing that
+ * its name.  The stream is left where it was.
+ */
+static ezusb_image_format detect_format (FILE *file, const char *path)
+{
+    unsigned char	magic [4];
+    size_t		n;
+    const char		*ext;
+
+    n = fread (magic, 1, sizeof magic, file);
+    rewind (file);
+
+    if (n == 4 && memcmp (magic, "\177ELF", 4) == 0)
+	return EZUSB_IMAGE_ELF;
+    if (n >= 1 && (magic[0] == ':' || magic[0] == '#'))
+	return EZUSB_IMAGE_IHEX;
+    if (n >= 2 && magic[0] == 'S' && magic[1] >= '0' && magic[1] <= '9')
+	return EZUSB_IMAGE_SREC;
+
+    /* raw binary has no signature; only trust the file name */
+    ext = strrchr (path, '.');
+    if (ext && (strcmp (ext, ".bin") == 0 || strcmp (ext, ".BIN") == 0))
+	return EZUSB_IMAGE_BIN;
+    return EZUSB_IMAGE_AUTO;
+}
+
+int ezusb_image_load_file_as (struct ezusb_image *image, const char *path,
+	ezusb_image_format format, uint32_t base)
+{
+    FILE	*file;
+    int		status;
+
+    /* binary mode: ELF and raw images need it, and the text
+     * parsers cope with CRLF line endings themselves
+     */
+    file = fopen (path, "rb");
+    if (file == 0) {
+	logerror("%s: unable to open for input.\n", path);
+	return -2;
+    }
+
+    if (format == EZUSB_IMAGE_AUTO) {
+	format = detect_format (file, path);
+	if (format == EZUSB_IMAGE_AUTO) {
+	    logerror("%s: unrecognized file format (for raw binary, name it .bin or pass the format)\n", path);
+	    fclose (file);
+	    return -2;
+	}
+    }
+    logverbose(EZUSB_LOG_INFO, "open %s image %s\n", ezusb_image_format_name[format], path);
+
+    switch (format) {
+    case EZUSB_IMAGE_SREC:
+	status = ezusb_image_load_srec (image, file);
+	break;
+    case EZUSB_IMAGE_ELF:
+	status = ezusb_image_load_elf (image, file);
+	break;
+    case EZUSB_IMAGE_BIN:
+	status = ezusb_image_load_bin (image, file, base);
+	break;
+    default:
+	status = ezusb_image_load_ihex (image, file);
+	break;
+    }
+    fclose (file);
+
+    if (status == 0)
+	status = ezusb_image_normalize (image);
+    if (status < 0)
+	logerror("unable to parse %s\n", path);
+    return status;
+}
+
+int ezusb_image_load_file (struct ezusb_image *image, const char *path)
+{
+    return ezusb_image_load_file_as (image, path, EZUSB_IMAGE_AUTO, 0);
+}
+
+static void write_ihex_record (FILE *file, unsigned char type, uint16_t addr,
+	const unsigned char *data, unsigned char len)
+{
+    unsigned char	sum = (unsigned char)(len + (addr >> 8) + addr + type);
+    unsigned char	i;
+
+    fprintf (file, ":%02X%04X%02X", len, addr, type);
+    for (i = 0; i < len; i++) {
+	fprintf (file, "%02X", data [i]);
+	sum += data [i];
+    }
+    fprintf (file, "%02X\n", (unsigned char)(0x100 - sum));
+}
+
+int ezusb_image_save_ihex (const struct ezusb_image *image, FILE *file)
+{
+    uint32_t	upper = 0;
+    size_t	i;
+
+    for (i = 0; i < image->count; i++) {
+	const struct ezusb_segment	*seg = &image->segs[i];
+	uint32_t			off = 0;
+
+	while (off < seg->len) {
+	    uint32_t	addr = seg->addr + off;
+	    uint32_t	len = seg->len - off;
+
+	    /* a record can't cross a 64 KB boundary */
+	    if (len > 32)
+		len = 32;
+	    if (len > 0x10000 - (addr & 0xFFFF))
+		len = 0x10000 - (addr & 0xFFFF);
+
+	    if ((addr >> 16) != upper) {
+		unsigned char	ela [2];
+
+		upper = addr >> 16;
+		ela [0] = (unsigned char)(upper >> 8);
+		ela [1] = (unsigned char) upper;
+		write_ihex_record (file, 0x04, 0, ela, 2);
+	    }
+	    write_ihex_record (file, 0x00, (uint16_t) addr, seg->data + off, (unsigned char) len);
+	    off += len;
+	}
+    }
+    write_ihex_record (file, 0x01, 0, NULL, 0);
+    return ferror (file) ? -EIO : 0;
+}
+
+/*****************************************************************************/
+
+static int compare_segments (const void *a, const void *b)
+{
+    const struct ezusb_segment	*sa = a, *sb = b;
+
+    if (sa->addr != sb->addr)
+	return sa->addr < sb->addr ? -1 : 1;
+
+    /* keep the sort deterministic: longer first, then by data pointer */
+    if (sa->len != sb->len)
+	return sa->len > sb->len ? -1 : 1;
+    return (sa->data < sb->data) ? -1 : (sa->data > sb->data);
+}
+
+int ezusb_image_normalize (struct ezusb_image *image)
+{
+    size_t	in, out, merged = 0;
+    int		status = 0;
+
+    if (image->count < 2)
+	return 0;
+
+    qsort (image->segs, image->count, sizeof image->segs[0], compare_segments);
+
+    for (in = 1, out = 0; in < image->count; in++) {
+	struct ezusb_segment	*prev = &image->segs[out];
+	struct ezusb_segment	*cur = &image->segs[in];
+	uint32_t		prev_end = prev->addr + prev->len;
+	uint32_t		overlap, extra, i;
+
+	if (cur->addr > prev_end) {
+	    image->segs[++out] = *cur;
+	    continue;
+	}
+
+	/* touching or overlapping: the shared bytes must match */
+	overlap = prev_end - cur->addr;
+	if (overlap > cur->len)
+	    overlap = cur->len;
+	for (i = 0; i < overlap; i++) {
+	    if (prev->data[cur->addr - prev->addr + i] != cur->data[i])
+		break;
+	}
+	if (i < overlap) {
+	    logerror("conflicting data at 0x%04x: 0x%02x vs 0x%02x\n",
+		(unsigned) (cur->addr + i), prev->data[cur->addr - prev->addr + i],
+		cur->data[i]);
+	    status = -5;
+	    break;
+	}
+
+	extra = cur->len - overlap;
+	if (segment_reserve (prev, extra) < 0) {
+	    logerror("out of memory\n");
+	    status = -1;
+	    break;
+	}
+	memcpy (prev->data + prev->len, cur->data + overlap, extra);
+	prev->len += extra;
+	free (cur->data);
+	merged++;
+    }
+
+    /* on errors, keep the unmerged rest so the image can still be freed */
+    while (in < image->count)
+	image->segs[++out] = image->segs[in++];
+    image->count = out + 1;
+
+    if (merged)
+	logverbose(EZUSB_LOG_DEBUG, "merged %zu out-of-order or overlapping segments\n", merged);
+    return status;
+}
+
+int ezusb_image_merge (struct ezusb_image *image, const struct ezusb_image *src)
+{
+    size_t	i;
+
+    for (i = 0; i < src->count; i++) {
+	if (ezusb_image_append (image, src->segs[i].addr, src->segs[i].data, src->segs[i].len) < 0) {
+	    logerror("out of memory\n");
+	    return -1;
+	}
+    }
+    return ezusb_image_normalize (image);
+}
+
+size_t ezusb_image_fill_gaps (struct ezusb_image *image,
+	const struct ezusb_chip_traits *chip, uint32_t max_gap, unsigned char fill)
+{
+    size_t	in, out, filled = 0;
+
+    if (image->count == 0 || max_gap == 0)
+	return 0;
+
+    for (in = 1, out = 0; in < image->count; in++) {
+	struct ezusb_segment		*prev = &image->segs[out];
+	struct ezusb_segment		*cur = &image->segs[in];
+	uint32_t			prev_end = prev->addr + prev->len;
+	const struct ezusb_mem_region	*r = 0;
+
+	/* the gap, and the segments on both sides, must be in one region */
+	if (cur->addr > prev_end && cur->addr - prev_end < max_gap
+		&& cur->addr <= 0xffff)
+	    r = ezusb_find_region (chip, (unsigned short)(prev_end - 1));
+
+	if (r != 0 && cur->addr + cur->len - 1 <= r->end
+		&& segment_reserve (prev, cur->addr - prev_end + cur->len) == 0) {
+	    uint32_t	gap = cur->addr - prev_end;
+
+	    logverbose(EZUSB_LOG_DEBUG, "fill %u byte gap at 0x%04x\n",
+		(unsigned) gap, (unsigned) prev_end);
+	    memset (prev->data + prev->len, fill, gap);
+	    memcpy (prev->data + prev->len + gap, cur->data, cur->len);
+	    prev->len += gap + cur->len;
+	    free (cur->data);
+	    filled++;
+	    continue;
+	}
+
+	image->segs[++out] = *cur;
+    }
+    image->count = out + 1;
+    return filled;
+}
+
+int ezusb_image_for_each_chunk (const struct ezusb_image *image,
+	const struct ezusb_chip_traits *chip, uint16_t max_chunk,
+	void *context, ezusb_poke_fn poke)
+{
+    size_t	i;
+    int		rc;
+
+    for (i = 0; i < image->count; i++) {
+	const struct ezusb_segment	*seg = &image->segs[i];
+	uint32_t			off = 0;
+
+	/* not addr + len, which can wrap around 32 bits */
+	if (seg->addr > 0x10000 || seg->len > 0x10000 - seg->addr) {
+	    logerror("%u bytes at 0x%x are outside the 64KB address space\n",
+		(unsigned) seg->len, (unsigned) seg->addr);
+	    return -EDOM;
+	}
+
+	while (off < seg->len) {
+	    unsigned short	addr = (unsigned short)(seg->addr + off);
+	    uint32_t		len = seg->len - off;
+	    int			external = 0;
+
+	    if (len > max_chunk)
+		len = max_chunk;
+
+	    /* never mix on-chip and external memory in one transfer */
+	    if (chip) {
+		uint32_t	end = ezusb_region_end (chip, addr);
+
+		if (addr + len - 1 > end)
+		    len = end - addr + 1;
+		external = ezusb_is_external (chip, addr, len);
+	    }
+
+	    rc = poke (context, addr, external, seg->data + off, (uint16_t) len);
+	    if (rc < 0)
+		return rc;
+	    off += len;
+	}
+    }
+    return 0;
+}
+
+static int count_poke (void *context, unsigned short addr, int external,
+	const unsigned char *data, uint16_t len)
+{
+    (*(size_t *) context)++;
+    return 0;
+}
+
+size_t ezusb_image_count_chunks (const struct ezusb_image *image,
+	const struct ezusb_chip_traits *chip, uint16_t max_chunk)
+{
+    size_t	count = 0;
+
+    ezusb_image_for_each_chunk (image, chip, max_chunk, &count, count_poke);
+    return count;
+}
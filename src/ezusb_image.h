@@ -0,0 +1,202 @@
+#ifndef __ezusb_image_H
+#define __ezusb_image_H
+/*
+ * Copyright (c) 2026 Mbed CE
+ * Copyright (c) 2001-2002 David Brownell (dbrownell@users.sourceforge.net)
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ezusb.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*
+ * A firmware image, held in memory as a list of segments.  Files are
+ * parsed into one of these once, then it can be checked, reshaped to
+ * need fewer transfers, and written to a device as often as needed.
+ */
+struct ezusb_segment {
+	uint32_t	addr;
+	uint32_t	len;
+	uint32_t	cap;	/* bytes allocated for data */
+	unsigned char	*data;
+};
+
+struct ezusb_image {
+	struct ezusb_segment	*segs;
+	size_t			count;
+	size_t			alloc;
+};
+
+/*
+ * Callback used to walk an image in transfer-sized chunks; errors are
+ * indicated by returning negative values.
+ */
+typedef int (*ezusb_poke_fn) (void *context, unsigned short addr, int external,
+		const unsigned char *data, uint16_t len);
+
+extern void ezusb_image_init (struct ezusb_image *image);
+extern void ezusb_image_free (struct ezusb_image *image);
+
+/*
+ * Adds data to the image.  Data continuing exactly where the last segment
+ * ends is merged into it, anything else starts a new segment.
+ * Returns 0, or a negative value if out of memory.
+ */
+extern int ezusb_image_append (struct ezusb_image *image, uint32_t addr,
+		const unsigned char *data, uint32_t len);
+
+/*
+ * File formats that can be loaded.  AUTO looks at the file's first bytes
+ * (and, for raw binary, which has no signature, its ".bin" extension).
+ */
+typedef enum {
+	EZUSB_IMAGE_AUTO,
+	EZUSB_IMAGE_IHEX,	/* Intel HEX, including extended address records */
+	EZUSB_IMAGE_SREC,	/* Motorola S-records */
+	EZUSB_IMAGE_ELF,	/* ELF, PT_LOAD segments at their load address */
+	EZUSB_IMAGE_BIN		/* raw binary, at a given base address */
+} ezusb_image_format;
+extern const char *ezusb_image_format_name[];
+
+/*
+ * Parsers for each format, reading the stream one record at a time and
+ * adding to the image.  Return 0 on success, negative on parse errors
+ * (which are logged).
+ */
+extern int ezusb_image_load_ihex (struct ezusb_image *image, FILE *file);
+extern int ezusb_image_load_srec (struct ezusb_image *image, FILE *file);
+extern int ezusb_image_load_elf (struct ezusb_image *image, FILE *file);
+extern int ezusb_image_load_bin (struct ezusb_image *image, FILE *file, uint32_t base);
+
+/*
+ * Opens and parses a firmware file, then normalizes the image.  base is
+ * only used for raw binary files.  Returns 0 on success.
+ */
+extern int ezusb_image_load_file_as (struct ezusb_image *image, const char *path,
+		ezusb_image_format format, uint32_t base);
+
+/*
+ * As above, detecting the file's format.
+ */
+extern int ezusb_image_load_file (struct ezusb_image *image, const char *path);
+
+/*
+ * Writes the image out as Intel HEX.  Returns 0, or negative on errors.
+ */
+extern int ezusb_image_save_ihex (const struct ezusb_image *image, FILE *file);
+
+/*
+ * Sorts the segments by address and merges any that touch or overlap,
+ * so the image holds the fewest possible segments whatever order the
+ * file listed its records in.  Overlapping bytes must agree.  Returns
+ * 0, or a negative value (after logging it) on conflicting data.
+ */
+extern int ezusb_image_normalize (struct ezusb_image *image);
+
+/*
+ * Adds a copy of everything in src to image, then normalizes image, so
+ * several firmware files can be combined into one image and loaded at
+ * once.  Bytes that both hold must agree.  Returns 0, or a negative value
+ * (after logging it) on conflicting data or if out of memory.
+ */
+extern int ezusb_image_merge (struct ezusb_image *image, const struct ezusb_image *src);
+
+/*
+ * Total data bytes in the image.
+ */
+extern size_t ezusb_image_size (const struct ezusb_image *image);
+
+/*
+ * Hash of the image's addresses and contents, identifying one particular
+ * firmware build (e.g. to tell if an interrupted job is being rerun).
+ */
+extern uint64_t ezusb_image_hash (const struct ezusb_image *image);
+
+/*
+ * Adds to sample a few short windows of image: one of window_len bytes
+ * (or up to the end of its segment) in each of "windows" equal stretches
+ * of its bytes, or all of it if that isn't more.  Which bytes are taken
+ * depends only on the image.  Returns 0, or a negative value if out of
+ * memory.
+ */
+extern int ezusb_image_sample (struct ezusb_image *sample, const struct ezusb_image *image,
+	unsigned windows, uint32_t window_len);
+
+/*
+ * Adds to delta the parts of image that old doesn't hold, or holds with
+ * different contents, so only those need writing to a device that already
+ * has old loaded.  Changes fewer than merge_gap bytes apart are joined
+ * into one segment, taking the bytes between from image.  Both images
+ * must be normalized.  Returns 0, or a negative value if out of memory.
+ */
+extern int ezusb_image_diff (struct ezusb_image *delta, const struct ezusb_image *image,
+	const struct ezusb_image *old, uint32_t merge_gap);
+
+/*
+ * Merges neighbouring segments separated by a gap of fewer than max_gap
+ * bytes, filling the gap with the given byte.  Only gaps inside one of
+ * the chip's on-chip RAM regions are filled: outside them, the hole may
+ * be a register or memory that isn't there.  Segments must already be
+ * in address order to be merged.  Returns the number of gaps filled.
+ */
+extern size_t ezusb_image_fill_gaps (struct ezusb_image *image,
+		const struct ezusb_chip_traits *chip, uint32_t max_gap, unsigned char fill);
+
+/*
+ * Walks the image in transfer-sized chunks: no chunk is longer than
+ * max_chunk, and (when chip is non-null) none mixes on-chip and external
+ * memory.  poke() is called for each chunk.  Returns 0, or the first
+ * negative value returned by poke(), or a negative value if the image
+ * holds data that doesn't fit the 64KB address space.
+ */
+extern int ezusb_image_for_each_chunk (const struct ezusb_image *image,
+		const struct ezusb_chip_traits *chip, uint16_t max_chunk,
+		void *context, ezusb_poke_fn poke);
+
+/*
+ * Number of chunks ezusb_image_for_each_chunk() would produce.
+ */
+extern size_t ezusb_image_count_chunks (const struct ezusb_image *image,
+		const struct ezusb_chip_traits *chip, uint16_t max_chunk);
+
+#ifdef __cplusplus
+};
+
+/*
+ * Owns an ezusb_image for C++ code, freeing it when it goes out of scope.
+ */
+struct ScopedImage
+{
+    ezusb_image image;
+
+    ScopedImage() { ezusb_image_init(&image); }
+    ~ScopedImage() { ezusb_image_free(&image); }
+
+    ScopedImage(ScopedImage const &) = delete;
+    ScopedImage & operator=(ScopedImage const &) = delete;
+};
+#endif
+
+#endif
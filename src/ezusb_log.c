@@ -0,0 +1,333 @@
+/*
+ * Copyright (c) 2026 Mbed CE
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN 1
+#include <windows.h>
+#else
+#include <time.h>
+#include <pthread.h>
+#endif
+
+#include "ezusb_log.h"
+
+/*
+ * Diagnostics are formatted into a buffer of records and only written
+ * to the sink when the buffer fills up or a load phase ends.  With -v
+ * every control transfer logs a line, and doing a synchronous stdio
+ * write for each one used to be a large share of the load time.
+ *
+ * Each record is a header followed by the formatted text (no NUL).
+ * Tags are interned in a small table so a record only stores an index.
+ *
+ * The buffer is shared by all threads, under a lock; each thread keeps
+ * its own tag, and looks it up in the table again whenever the table has
+ * been recycled since it last did.
+ */
+
+int verbose;
+
+#define LOG_BUFFER_SIZE	(64 * 1024)
+#define LOG_MAX_TAGS	64
+#define LOG_TAG_LEN	32
+#define LOG_NO_TAG	0xFF
+
+struct log_record_header {
+    uint64_t	timestamp;	/* ezusb_clock_us() when logged */
+    uint16_t	len;		/* bytes of text following the header */
+    uint8_t	level;
+    uint8_t	tag;		/* index into tags, or LOG_NO_TAG */
+};
+
+static unsigned char	log_buffer [LOG_BUFFER_SIZE];
+static size_t		log_used;
+
+static char		tags [LOG_MAX_TAGS][LOG_TAG_LEN];
+static unsigned		tag_count;
+static unsigned		tag_generation;	/* bumped when the table is recycled */
+
+static EZUSB_THREAD_LOCAL char		thread_tag [LOG_TAG_LEN];
+static EZUSB_THREAD_LOCAL uint8_t	thread_tag_index = LOG_NO_TAG;
+static EZUSB_THREAD_LOCAL unsigned	thread_tag_generation;
+
+static ezusb_log_sink	sink_type = EZUSB_LOG_SINK_TEXT;
+static FILE		*sink_stream;
+static int		exit_hook_installed;
+
+static const char *level_names[] = { "error", "info", "debug", "trace" };
+
+#if defined(_WIN32)
+static SRWLOCK		log_lock = SRWLOCK_INIT;
+#define LOCK()		AcquireSRWLockExclusive(&log_lock)
+#define UNLOCK()	ReleaseSRWLockExclusive(&log_lock)
+#else
+static pthread_mutex_t	log_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK()		pthread_mutex_lock(&log_lock)
+#define UNLOCK()	pthread_mutex_unlock(&log_lock)
+#endif
+
+uint64_t ezusb_clock_us(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER	freq, now;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000
+	+ (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+    struct timespec	ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#endif
+}
+
+static FILE *log_stream(void)
+{
+    return sink_stream ? sink_stream : stderr;
+}
+
+/*
+ * Write one message as a JSON object on its own line.
+ */
+static void write_json(FILE *out, const struct log_record_header *hdr, const char *text)
+{
+    uint16_t	i, len = hdr->len;
+
+    /* the trailing newline is implied by the record */
+    if (len > 0 && text[len - 1] == '\n')
+	len--;
+
+    fprintf(out, "{\"ts_us\":%llu,\"level\":\"%s\"",
+	(unsigned long long) hdr->timestamp, level_names[hdr->level]);
+    if (hdr->tag != LOG_NO_TAG)
+	fprintf(out, ",\"tag\":\"%s\"", tags[hdr->tag]);
+    fputs(",\"msg\":\"", out);
+    for (i = 0; i < len; i++) {
+	unsigned char c = (unsigned char) text[i];
+
+	if (c == '"' || c == '\\') {
+	    putc('\\', out);
+	    putc(c, out);
+	} else if (c == '\n')
+	    fputs("\\n", out);
+	else if (c < 0x20)
+	    fprintf(out, "\\u%04x", c);
+	else
+	    putc(c, out);
+    }
+    fputs("\"}\n", out);
+}
+
+static void write_record(const struct log_record_header *hdr, const char *text)
+{
+    FILE	*out = log_stream();
+
+    if (sink_type == EZUSB_LOG_SINK_JSON) {
+	write_json(out, hdr, text);
+	return;
+    }
+
+    if (hdr->tag != LOG_NO_TAG)
+	fprintf(out, "[%s] ", tags[hdr->tag]);
+    fwrite(text, 1, hdr->len, out);
+}
+
+/*
+ * Write out the buffer.  Called with the lock held.
+ */
+static void flush_locked(void)
+{
+    size_t	pos = 0;
+
+    while (pos < log_used) {
+	struct log_record_header	hdr;
+
+	memcpy(&hdr, log_buffer + pos, sizeof hdr);
+	pos += sizeof hdr;
+	write_record(&hdr, (const char *) log_buffer + pos);
+	pos += hdr.len;
+    }
+    log_used = 0;
+
+    /* tags may be recycled once nothing refers to them */
+    if (tag_count == LOG_MAX_TAGS) {
+	tag_count = 0;
+	tag_generation++;
+    }
+
+    fflush(log_stream());
+}
+
+void ezusb_log_flush(void)
+{
+    LOCK();
+    flush_locked();
+    UNLOCK();
+}
+
+/*
+ * Returns this thread's tag's index in the table, adding it if needed.
+ * Called with the lock held.
+ */
+static uint8_t intern_tag(void)
+{
+    unsigned	i;
+
+    if (thread_tag [0] == 0)
+	return LOG_NO_TAG;
+    if (thread_tag_generation == tag_generation && thread_tag_index != LOG_NO_TAG)
+	return thread_tag_index;
+
+    for (i = 0; i < tag_count; i++)
+	if (strcmp(tags[i], thread_tag) == 0)
+	    break;
+    if (i == tag_count) {
+	/* table full: records in the buffer still point at old tags */
+	if (tag_count == LOG_MAX_TAGS)
+	    flush_locked();
+	i = tag_count++;
+	strcpy(tags[i], thread_tag);
+    }
+
+    thread_tag_index = (uint8_t) i;
+    thread_tag_generation = tag_generation;
+    return thread_tag_index;
+}
+
+/*
+ * Format a message into the buffer, flushing first if it won't fit.
+ * Messages too large for the buffer are written out directly.
+ */
+static void log_append(ezusb_log_level level, const char *format, va_list ap)
+{
+    struct log_record_header	hdr;
+    size_t			space;
+    int				len;
+    va_list			ap2;
+
+    hdr.timestamp = ezusb_clock_us();
+    hdr.level = (uint8_t) level;
+
+    LOCK();
+    if (!exit_hook_installed) {
+	atexit(ezusb_log_flush);
+	exit_hook_installed = 1;
+    }
+    hdr.tag = intern_tag();
+
+    for (;;) {
+	if (log_used + sizeof hdr < LOG_BUFFER_SIZE) {
+	    space = LOG_BUFFER_SIZE - log_used - sizeof hdr;
+	    va_copy(ap2, ap);
+	    len = vsnprintf((char *) log_buffer + log_used + sizeof hdr, space, format, ap2);
+	    va_end(ap2);
+	    if (len < 0) {
+		UNLOCK();
+		return;
+	    }
+
+	    /* vsnprintf needs room for the NUL, which we don't store */
+	    if ((size_t) len < space && len <= UINT16_MAX) {
+		hdr.len = (uint16_t) len;
+		memcpy(log_buffer + log_used, &hdr, sizeof hdr);
+		log_used += sizeof hdr + len;
+		UNLOCK();
+		return;
+	    }
+	}
+
+	if (log_used == 0)
+	    break;
+	flush_locked();
+    }
+
+    /* doesn't fit even in an empty buffer */
+    {
+	char	*text;
+
+	va_copy(ap2, ap);
+	len = vsnprintf(NULL, 0, format, ap2);
+	va_end(ap2);
+	text = len < 0 ? NULL : malloc((size_t) len + 1);
+	if (text != NULL) {
+	    vsnprintf(text, (size_t) len + 1, format, ap);
+	    hdr.len = len > UINT16_MAX ? UINT16_MAX : (uint16_t) len;
+	    write_record(&hdr, text);
+	    free(text);
+	}
+    }
+    UNLOCK();
+}
+
+void ezusb_log(ezusb_log_level level, const char *format, ...)
+{
+    va_list	ap;
+
+    va_start(ap, format);
+    log_append(level, format, ap);
+    va_end(ap);
+}
+
+void logerror(const char *format, ...)
+{
+    va_list	ap;
+
+    va_start(ap, format);
+    log_append(EZUSB_LOG_ERROR, format, ap);
+    va_end(ap);
+
+    /* errors are never held back */
+    ezusb_log_flush();
+
+    /* when the log goes to a file, the user still sees errors; on
+     * stderr they're already there, in whichever format was chosen
+     */
+    if (log_stream() != stderr) {
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+    }
+}
+
+void ezusb_log_set_sink(ezusb_log_sink sink, FILE *stream)
+{
+    LOCK();
+    flush_locked();
+    sink_type = sink;
+    sink_stream = stream;
+    UNLOCK();
+}
+
+void ezusb_log_set_tag(const char *tag)
+{
+    if (tag == NULL)
+	thread_tag [0] = 0;
+    else {
+	strncpy(thread_tag, tag, LOG_TAG_LEN - 1);
+	thread_tag [LOG_TAG_LEN - 1] = 0;
+    }
+    thread_tag_index = LOG_NO_TAG;
+}
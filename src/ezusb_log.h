@@ -0,0 +1,122 @@
+#ifndef __ezusb_log_H
+#define __ezusb_log_H
+/*
+ * Copyright (c) 2026 Mbed CE
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// If supported, define an attribute to mark functions as doing printf formatting
+#ifdef __MINGW32__
+// On mingw we need to specify that we're using gnu printf provided by ucrt
+#define PRINTF_FORMAT_ATTRIBUTE_AT(fmt, args)  __attribute__ ((format (gnu_printf, fmt, args)))
+#elif defined(_MSC_VER)
+// No corresponding attribute for MSVC
+#define PRINTF_FORMAT_ATTRIBUTE_AT(fmt, args)
+#else
+#define PRINTF_FORMAT_ATTRIBUTE_AT(fmt, args)  __attribute__ ((format (printf, fmt, args)))
+#endif
+#define PRINTF_FORMAT_ATTRIBUTE PRINTF_FORMAT_ATTRIBUTE_AT(1, 2)
+
+/*
+ * Marks state that each thread keeps its own copy of, so that several
+ * threads can each drive a different device.
+ */
+#ifdef _MSC_VER
+#define EZUSB_THREAD_LOCAL __declspec(thread)
+#else
+#define EZUSB_THREAD_LOCAL __thread
+#endif
+
+/*
+ * Log levels.  Levels above EZUSB_LOG_ERROR line up with the number of
+ * times -v was given, so "verbose >= level" decides if a message is kept.
+ */
+typedef enum {
+    EZUSB_LOG_ERROR = 0,
+    EZUSB_LOG_INFO = 1,
+    EZUSB_LOG_DEBUG = 2,
+    EZUSB_LOG_TRACE = 3
+} ezusb_log_level;
+
+/*
+ * Output formats for the log.  Text matches what fxload always printed;
+ * JSON writes one object per line with timestamp, level and device tag.
+ */
+typedef enum {
+    EZUSB_LOG_SINK_TEXT,
+    EZUSB_LOG_SINK_JSON
+} ezusb_log_sink;
+
+/* Verbosity level from 0 (least verbose) to 3 (most verbose) */
+extern int verbose;
+
+/*
+ * Print an error.  Any buffered diagnostics are written out first so
+ * the output stays in order, then the error itself is written right away.
+ */
+void logerror(const char *format, ...) PRINTF_FORMAT_ATTRIBUTE;
+
+/*
+ * Format a diagnostic message into the log buffer.  Nothing is written
+ * to the sink until the buffer fills up or ezusb_log_flush() is called,
+ * so this is cheap enough to use for every USB transfer.
+ */
+void ezusb_log(ezusb_log_level level, const char *format, ...) PRINTF_FORMAT_ATTRIBUTE_AT(2, 3);
+
+/*
+ * Log a diagnostic only if the verbosity level asks for it.  The check
+ * happens before the arguments are evaluated or anything is formatted.
+ */
+#define logverbose(level, ...) \
+    do { if (verbose >= (level)) ezusb_log((level), __VA_ARGS__); } while (0)
+
+/*
+ * Write out everything buffered so far.  Called at the end of each load
+ * phase, and before exit.
+ */
+void ezusb_log_flush(void);
+
+/*
+ * Select the output format and stream.  A null stream means stderr.
+ */
+void ezusb_log_set_sink(ezusb_log_sink sink, FILE *stream);
+
+/*
+ * Set the context tag (usually the device's bus-port path) attached to
+ * every following message, so output from parallel runs can be told apart.
+ * Each thread has its own tag.  Pass null to clear it.
+ */
+void ezusb_log_set_tag(const char *tag);
+
+/*
+ * Monotonic clock in microseconds, used for log timestamps and timing.
+ */
+uint64_t ezusb_clock_us(void);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
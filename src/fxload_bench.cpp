@@ -0,0 +1,612 @@
+/*
+ * Copyright (c) 2026 Mbed CE
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/*
+ * fxload_bench: throughput benchmarks for the firmware parsers, the
+ * image reshaping passes, and whole loads against a simulated device.
+ *
+ * Prints one JSON object per case, in a fixed order, so the output can be
+ * checked in as a baseline and diffed.  With --baseline FILE, compares
+ * against that file and exits with status 1 if any modelled case got
+ * worse.  Timed cases depend on the machine and its load, so they are
+ * only reported, unless --tolerance says how much worse they may get.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ezusb.h"
+#include "ezusb_image.h"
+#include "SimulatedDevice.h"
+
+/*
+ * One result.  Timed cases are measured on this machine; modelled ones
+ * come from the simulated device's clock, so they only change when fxload
+ * sends different requests.
+ */
+struct BenchResult
+{
+    std::string name;
+    std::string unit;
+    bool modelled;
+    bool higherIsBetter;
+    double value;
+};
+
+static std::vector<BenchResult> results;
+
+static void report(std::string const & name, std::string const & unit, bool modelled, bool higherIsBetter, double value)
+{
+    // As precise as the JSON holds it, so a run compares equal to its own output
+    value = std::round(value * 1000) / 1000;
+    results.push_back({name, unit, modelled, higherIsBetter, value});
+    fprintf(stderr, "%-40s %12.3f %s\n", name.c_str(), value, unit.c_str());
+}
+
+/*
+ * Runs fn until at least minTimeUs have passed, and returns the average
+ * time per run in microseconds.
+ */
+static double time_runs(std::function<void()> const & fn, uint64_t minTimeUs)
+{
+    uint64_t start = ezusb_clock_us();
+    uint64_t elapsed;
+    unsigned runs = 0;
+    do
+    {
+        fn();
+        runs++;
+        elapsed = ezusb_clock_us() - start;
+    }
+    while(elapsed < minTimeUs);
+    return static_cast<double>(elapsed) / runs;
+}
+
+// Deterministic filler, so every run parses the same bytes
+static unsigned char pattern_byte(uint32_t addr)
+{
+    return static_cast<unsigned char>((addr * 2654435761u) >> 24);
+}
+
+static void put_hex(std::string & out, unsigned value, int digits)
+{
+    static const char DIGITS[] = "0123456789ABCDEF";
+    for(int i = digits - 1; i >= 0; i--)
+    {
+        out += DIGITS[(value >> (4 * i)) & 0xF];
+    }
+}
+
+/*
+ * Writers for synthetic firmware files of about fileSize bytes, holding
+ * one contiguous run of data starting at address 0.
+ */
+static void write_ihex(FILE *file, size_t fileSize)
+{
+    std::string line;
+    size_t written = 0;
+    for(uint32_t addr = 0; written < fileSize; addr += 32)
+    {
+        line.clear();
+        if((addr & 0xFFFF) == 0)
+        {
+            // extended linear address record for the next 64 KB
+            unsigned upper = addr >> 16;
+            line += ":02000004";
+            put_hex(line, upper, 4);
+            put_hex(line, (0x100 - ((0x02 + 0x04 + (upper >> 8) + (upper & 0xFF)) & 0xFF)) & 0xFF, 2);
+            line += '\n';
+        }
+        unsigned sum = 32 + ((addr >> 8) & 0xFF) + (addr & 0xFF);
+        line += ":20";
+        put_hex(line, addr & 0xFFFF, 4);
+        line += "00";
+        for(uint32_t i = 0; i < 32; i++)
+        {
+            unsigned char byte = pattern_byte(addr + i);
+            put_hex(line, byte, 2);
+            sum += byte;
+        }
+        put_hex(line, (0x100 - (sum & 0xFF)) & 0xFF, 2);
+        line += '\n';
+        fwrite(line.data(), 1, line.size(), file);
+        written += line.size();
+    }
+    fputs(":00000001FF\n", file);
+}
+
+static void write_srec(FILE *file, size_t fileSize)
+{
+    std::string line;
+    size_t written = 0;
+    for(uint32_t addr = 0; written < fileSize; addr += 32)
+    {
+        // S3: four address bytes, then the data and a checksum
+        unsigned count = 4 + 32 + 1;
+        unsigned sum = count + (addr >> 24) + ((addr >> 16) & 0xFF) + ((addr >> 8) & 0xFF) + (addr & 0xFF);
+        line = "S3";
+        put_hex(line, count, 2);
+        put_hex(line, addr, 8);
+        for(uint32_t i = 0; i < 32; i++)
+        {
+            unsigned char byte = pattern_byte(addr + i);
+            put_hex(line, byte, 2);
+            sum += byte;
+        }
+        put_hex(line, ~sum & 0xFF, 2);
+        line += '\n';
+        fwrite(line.data(), 1, line.size(), file);
+        written += line.size();
+    }
+    fputs("S70500000000FA\n", file);
+}
+
+static void write_data(FILE *file, size_t len)
+{
+    std::vector<unsigned char> data(len);
+    for(size_t i = 0; i < len; i++)
+    {
+        data[i] = pattern_byte(static_cast<uint32_t>(i));
+    }
+    fwrite(data.data(), 1, len, file);
+}
+
+static void write_bin(FILE *file, size_t fileSize)
+{
+    write_data(file, fileSize);
+}
+
+// A little endian ELF32 file with one PT_LOAD segment
+static void write_elf(FILE *file, size_t fileSize)
+{
+    const uint32_t headerLen = 52, phdrLen = 32;
+    uint32_t dataLen = static_cast<uint32_t>(fileSize > headerLen + phdrLen ? fileSize - headerLen - phdrLen : 1);
+    unsigned char header[52 + 32] = {0x7f, 'E', 'L', 'F', 1, 1, 1};
+    auto put32 = [&](size_t offset, uint32_t value)
+    {
+        for(int i = 0; i < 4; i++)
+        {
+            header[offset + i] = static_cast<unsigned char>(value >> (8 * i));
+        }
+    };
+    header[16] = 2;                         // e_type: executable
+    put32(28, headerLen);                   // e_phoff
+    header[40] = static_cast<unsigned char>(headerLen); // e_ehsize
+    header[42] = static_cast<unsigned char>(phdrLen);   // e_phentsize
+    header[44] = 1;                         // e_phnum
+    put32(headerLen + 0, 1);                // p_type: PT_LOAD
+    put32(headerLen + 4, headerLen + phdrLen); // p_offset
+    put32(headerLen + 16, dataLen);         // p_filesz
+    put32(headerLen + 20, dataLen);         // p_memsz
+    fwrite(header, 1, sizeof(header), file);
+    write_data(file, dataLen);
+}
+
+static std::string temp_path(std::string const & name)
+{
+    return (std::filesystem::temp_directory_path() / ("fxload_bench_" + name)).string();
+}
+
+static bool write_file(std::string const & path, std::function<void(FILE *)> const & writer)
+{
+    FILE *file = fopen(path.c_str(), "wb");
+    if(file == nullptr)
+    {
+        fprintf(stderr, "%s: unable to create\n", path.c_str());
+        return false;
+    }
+    writer(file);
+    return fclose(file) == 0;
+}
+
+static std::string size_name(size_t size)
+{
+    if(size >= 1024 * 1024)
+    {
+        return std::to_string(size / (1024 * 1024)) + "MB";
+    }
+    return std::to_string(size / 1024) + "KB";
+}
+
+/*
+ * Parsing: each format at a range of file sizes, in MB of file per second
+ */
+static bool bench_parsers(bool quick, uint64_t minTimeUs)
+{
+    struct Format
+    {
+        const char *name;
+        ezusb_image_format format;
+        void (*writer)(FILE *, size_t);
+    };
+    const Format formats[] = {
+        {"ihex", EZUSB_IMAGE_IHEX, write_ihex},
+        {"srec", EZUSB_IMAGE_SREC, write_srec},
+        {"elf", EZUSB_IMAGE_ELF, write_elf},
+        {"bin", EZUSB_IMAGE_BIN, write_bin},
+    };
+    std::vector<size_t> sizes = {1024, 64 * 1024, 1024 * 1024};
+    if(!quick)
+    {
+        sizes.push_back(64 * 1024 * 1024);
+    }
+
+    for(Format const & format : formats)
+    {
+        for(size_t size : sizes)
+        {
+            std::string path = temp_path(std::string("parse.") + format.name);
+            if(!write_file(path, [&](FILE *file) { format.writer(file, size); }))
+            {
+                return false;
+            }
+            double fileBytes = static_cast<double>(std::filesystem::file_size(path));
+
+            bool ok = true;
+            double us = time_runs([&]()
+            {
+                ScopedImage firmware;
+                ok = ok && ezusb_image_load_file_as(&firmware.image, path.c_str(), format.format, 0) == 0;
+            }, minTimeUs);
+            std::filesystem::remove(path);
+            if(!ok)
+            {
+                fprintf(stderr, "parsing the %s %s file failed\n", size_name(size).c_str(), format.name);
+                return false;
+            }
+            report(std::string("parse/") + format.name + "/" + size_name(size), "MB/s", false, true, fileBytes / us);
+        }
+    }
+    return true;
+}
+
+/*
+ * Reshaping: merging records given out of order, filling gaps, and
+ * laying out an EEPROM image, in MB of image per second.  The first two
+ * change the image, so each run builds it again from the records first,
+ * as parsing would.
+ */
+static bool bench_image_passes(uint64_t minTimeUs)
+{
+    // 16 byte records with 4 byte holes, filling FX2LP's 16 KB of RAM,
+    // listed in a scrambled order
+    ScopedImage scrambled;
+    const uint32_t recordLen = 16, stride = 20, span = 0x4000;
+    uint32_t records = span / stride;
+    for(uint32_t i = 0; i < records; i++)
+    {
+        uint32_t addr = ((i * 7919) % records) * stride;
+        unsigned char data[recordLen];
+        for(uint32_t j = 0; j < recordLen; j++)
+        {
+            data[j] = pattern_byte(addr + j);
+        }
+        ezusb_image_append(&scrambled.image, addr, data, recordLen);
+    }
+    double imageMB = static_cast<double>(ezusb_image_size(&scrambled.image));
+
+    auto copy = [](ezusb_image *to, ezusb_image const *from)
+    {
+        for(size_t i = 0; i < from->count; i++)
+        {
+            ezusb_image_append(to, from->segs[i].addr, from->segs[i].data, from->segs[i].len);
+        }
+    };
+
+    bool ok = true;
+    double us = time_runs([&]()
+    {
+        ScopedImage image;
+        copy(&image.image, &scrambled.image);
+        ok = ok && ezusb_image_normalize(&image.image) == 0;
+    }, minTimeUs);
+    if(!ok)
+    {
+        fprintf(stderr, "normalizing failed\n");
+        return false;
+    }
+    report("image/normalize", "MB/s", false, true, imageMB / us);
+
+    ScopedImage sorted;
+    copy(&sorted.image, &scrambled.image);
+    ezusb_image_normalize(&sorted.image);
+    const ezusb_chip_traits *chip = ezusb_get_chip_traits(FX2LP);
+    us = time_runs([&]()
+    {
+        ScopedImage image;
+        copy(&image.image, &sorted.image);
+        ezusb_image_fill_gaps(&image.image, chip, stride - recordLen + 1, 0xFF);
+    }, minTimeUs);
+    report("image/fill_gaps", "MB/s", false, true, imageMB / us);
+
+    ezusb_eeprom_plan plan;
+    us = time_runs([&]()
+    {
+        ok = ok && ezusb_plan_eeprom(&sorted.image, FX2LP, &plan) == 0;
+    }, minTimeUs);
+    if(!ok)
+    {
+        fprintf(stderr, "planning the EEPROM layout failed\n");
+        return false;
+    }
+    report("image/eeprom_plan", "MB/s", false, true, imageMB / us);
+    return true;
+}
+
+/*
+ * Whole loads, through the same code a real load runs, against the
+ * simulated device with a few link profiles.  Reports the simulated time
+ * and the number of requests, which only change if fxload changes what it
+ * sends, and for RAM loads the host time spent per load.  Loads through a
+ * fast loader's bulk endpoint also report how many times faster they are
+ * than the same load through vendor requests.
+ */
+static bool bench_loads(uint64_t minTimeUs)
+{
+    // 14 KB of code plus 512 bytes of data RAM, and 32 KB external
+    std::string internalPath = temp_path("load_internal.hex");
+    std::string externalPath = temp_path("load_external.hex");
+    ScopedImage internal, external;
+    std::vector<unsigned char> data(0x8000);
+    for(size_t i = 0; i < data.size(); i++)
+    {
+        data[i] = pattern_byte(static_cast<uint32_t>(i));
+    }
+    ezusb_image_append(&internal.image, 0x0000, data.data(), 0x3800);
+    ezusb_image_append(&internal.image, 0xE000, data.data(), 0x200);
+    ezusb_image_merge(&external.image, &internal.image);
+    ezusb_image_append(&external.image, 0x4000, data.data(), 0x8000);
+    ezusb_image_normalize(&external.image);
+    bool written = write_file(internalPath, [&](FILE *file) { ezusb_image_save_ihex(&internal.image, file); })
+        && write_file(externalPath, [&](FILE *file) { ezusb_image_save_ihex(&external.image, file); });
+
+    const SimulatedDevice profiles[] = {
+        // one request per 1 ms frame, with Linux' 4 KB control transfer
+        // cap; bulk gets up to 19 packets of 64 bytes per frame
+        {"full-speed", 1000, 1000 * 1000, 6 * 1024, 4096, 1216 * 1000},
+        {"high-speed", 125, 30 * 1000 * 1000, 6 * 1024, 4096, 40 * 1000 * 1000},
+        // a round trip over the network per request or transfer
+        {"usbip", 2000, 4 * 1000 * 1000, 6 * 1024, 4096, 4 * 1000 * 1000},
+    };
+
+    // Through the loader's bulk endpoint, which the profiles all offer
+    auto fast = [](std::function<int(libusb_device_handle *)> run)
+    {
+        return [run](libusb_device_handle *dev)
+        {
+            if(ezusb_attach_fast_loader(dev) != 1)
+            {
+                return -1;
+            }
+            int status = run(dev);
+            ezusb_detach_fast_loader();
+            return status;
+        };
+    };
+    auto loadRamExternal = [&](libusb_device_handle *dev) { return ezusb_load_ram(dev, externalPath.c_str(), FX2LP, 1); };
+    auto loadEeprom = [&](libusb_device_handle *dev) { return ezusb_load_eeprom(dev, internalPath.c_str(), FX2LP, 0x40); };
+
+    struct Load
+    {
+        const char *name;
+        bool timed;
+        std::function<int(libusb_device_handle *)> run;
+        const char *comparedWith; // the same load through vendor requests
+    };
+    const Load loads[] = {
+        {"load_ram", true, [&](libusb_device_handle *dev) { return ezusb_load_ram(dev, internalPath.c_str(), FX2LP, 0); }, nullptr},
+        {"load_ram_external", true, loadRamExternal, nullptr},
+        {"load_eeprom", false, loadEeprom, nullptr},
+        {"load_ram_external_fast", false, fast(loadRamExternal), "load_ram_external"},
+        {"load_eeprom_fast", false, fast(loadEeprom), "load_eeprom"},
+    };
+
+    std::map<std::string, double> clocksUs;
+    bool ok = written;
+    for(Load const & load : loads)
+    {
+        for(SimulatedDevice const & profile : profiles)
+        {
+            if(!ok)
+            {
+                break;
+            }
+
+            // Every load starts from the defaults, backing off as it goes
+            SimulatedDevice device = profile;
+            ezusb_ram_chunk = EZUSB_DEFAULT_RAM_CHUNK;
+            ezusb_set_transport(SimulatedDevice::transport, &device);
+            ezusb_set_bulk_transport(SimulatedDevice::bulk_transport, &device);
+            ok = load.run(nullptr) == 0;
+            ezusb_set_transport(nullptr, nullptr);
+            ezusb_set_bulk_transport(nullptr, nullptr);
+
+            std::string name = std::string(load.name) + "/" + profile.profile;
+            report(name + "/simulated", "ms", true, false, device.clockUs / 1000);
+            report(name + "/requests", "requests", true, false, static_cast<double>(device.requests));
+            clocksUs[name] = device.clockUs;
+            if(load.comparedWith != nullptr)
+            {
+                double before = clocksUs[std::string(load.comparedWith) + "/" + profile.profile];
+                report(name + "/speedup", "x", true, true, before / device.clockUs);
+            }
+        }
+
+        // The host side doesn't depend on the link, so time it once.  EEPROM
+        // loads log the config byte every time, so only RAM loads are timed.
+        if(load.timed)
+        {
+            double us = time_runs([&]()
+            {
+                SimulatedDevice device = profiles[0];
+                ezusb_ram_chunk = EZUSB_DEFAULT_RAM_CHUNK;
+                ezusb_set_transport(SimulatedDevice::transport, &device);
+                ok = ok && load.run(nullptr) == 0;
+                ezusb_set_transport(nullptr, nullptr);
+            }, minTimeUs);
+            report(std::string(load.name) + "/host", "loads/s", false, true, 1e6 / us);
+        }
+    }
+
+    std::filesystem::remove(internalPath);
+    std::filesystem::remove(externalPath);
+    if(!ok)
+    {
+        fprintf(stderr, "simulated load failed\n");
+    }
+    return ok;
+}
+
+static void print_json(FILE *out)
+{
+    fprintf(out, "{\n  \"version\": 1,\n  \"cases\": [\n");
+    for(size_t i = 0; i < results.size(); i++)
+    {
+        BenchResult const & result = results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"unit\": \"%s\", \"kind\": \"%s\", \"better\": \"%s\", \"value\": %.3f}%s\n",
+                result.name.c_str(), result.unit.c_str(), result.modelled ? "modelled" : "timed",
+                result.higherIsBetter ? "higher" : "lower", result.value, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+/*
+ * Reads the name and value of each case from a file in the format
+ * print_json() writes, one case per line.
+ */
+static bool read_baseline(std::string const & path, std::map<std::string, double> & baseline)
+{
+    FILE *file = fopen(path.c_str(), "r");
+    if(file == nullptr)
+    {
+        fprintf(stderr, "%s: unable to open for input.\n", path.c_str());
+        return false;
+    }
+    char line[512];
+    while(fgets(line, sizeof(line), file) != nullptr)
+    {
+        const char *name = strstr(line, "\"name\": \"");
+        const char *value = strstr(line, "\"value\": ");
+        if(name == nullptr || value == nullptr)
+        {
+            continue;
+        }
+        name += strlen("\"name\": \"");
+        const char *nameEnd = strchr(name, '"');
+        if(nameEnd != nullptr)
+        {
+            baseline[std::string(name, nameEnd)] = strtod(value + strlen("\"value\": "), nullptr);
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+/*
+ * Modelled cases must not get worse at all.  Timed ones may by tolerance
+ * (a fraction of the baseline), or without limit if it is negative.
+ * Returns the number of regressions.
+ */
+static size_t compare_baseline(std::map<std::string, double> const & baseline, double tolerance)
+{
+    size_t regressions = 0;
+    for(BenchResult const & result : results)
+    {
+        auto found = baseline.find(result.name);
+        if(found == baseline.end())
+        {
+            fprintf(stderr, "%-40s new, not in the baseline\n", result.name.c_str());
+            continue;
+        }
+        double base = found->second;
+        bool checked = result.modelled || tolerance >= 0;
+        double slack = result.modelled ? 0.001 : tolerance * std::fabs(base);
+        double change = base != 0 ? (result.value - base) / base : 0;
+        bool worse = checked && (result.higherIsBetter ? result.value < base - slack : result.value > base + slack);
+        fprintf(stderr, "%-40s %12.3f vs %12.3f %s (%+.1f%%)%s\n", result.name.c_str(), result.value, base,
+                result.unit.c_str(), change * 100, worse ? "  REGRESSION" : "");
+        if(worse)
+        {
+            regressions++;
+        }
+    }
+    return regressions;
+}
+
+int main(int argc, char **argv)
+{
+    bool quick = false;
+    std::string baselinePath;
+    double tolerance = -1; // timed cases aren't checked
+
+    for(int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if(arg == "--quick")
+        {
+            quick = true;
+        }
+        else if(arg == "--baseline" && i + 1 < argc)
+        {
+            baselinePath = argv[++i];
+        }
+        else if(arg == "--tolerance" && i + 1 < argc)
+        {
+            tolerance = strtod(argv[++i], nullptr);
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--quick] [--baseline FILE] [--tolerance FRACTION]\n"
+                            "  --quick      skip the 64 MB files and time each case for less long\n"
+                            "  --baseline   compare with an earlier run's output, exiting with 1 on regressions\n"
+                            "  --tolerance  also fail if a timed case gets worse by more than this fraction;\n"
+                            "               by default timed cases are only reported\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+
+    std::map<std::string, double> baseline;
+    if(!baselinePath.empty() && !read_baseline(baselinePath, baseline))
+    {
+        return 2;
+    }
+
+    uint64_t minTimeUs = quick ? 50 * 1000 : 500 * 1000;
+    bool ok = bench_parsers(quick, minTimeUs) && bench_image_passes(minTimeUs) && bench_loads(minTimeUs);
+    if(!ok)
+    {
+        return 2;
+    }
+
+    print_json(stdout);
+    if(!baseline.empty() && compare_baseline(baseline, tolerance) > 0)
+    {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2026 Mbed CE
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/*
+ * fxload_selftest: checks that need no device, such as malformed firmware
+ * files being refused, and loads through a fast loader landing where
+ * vendor requests would have put them on a simulated device.  Prints one
+ * line per check and exits with status 1 if any failed; run by ctest.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "ezusb.h"
+#include "ezusb_image.h"
+#include "SimulatedDevice.h"
+
+static std::string temp_path(std::string const & name)
+{
+    return (std::filesystem::temp_directory_path() / ("fxload_selftest_" + name)).string();
+}
+
+/*
+ * Writes contents to a temporary file and parses it as the given format.
+ * Returns the parser's status, or 1 if the file couldn't be written.
+ */
+static int parse_text(std::string const & name, std::string const & contents, ezusb_image_format format)
+{
+    std::string path = temp_path(name);
+    FILE *file = fopen(path.c_str(), "wb");
+    if(file == nullptr)
+    {
+        fprintf(stderr, "%s: unable to create\n", path.c_str());
+        return 1;
+    }
+    fwrite(contents.data(), 1, contents.size(), file);
+    if(fclose(file) != 0)
+    {
+        return 1;
+    }
+
+    ScopedImage firmware;
+    int status = ezusb_image_load_file_as(&firmware.image, path.c_str(), format, 0);
+    std::filesystem::remove(path);
+    return status;
+}
+
+/*
+ * Parsing: well-formed files load, and malformed ones are refused rather
+ * than loaded in part or read past their buffers
+ */
+static bool check_ihex_whole()
+{
+    return parse_text("whole.hex", ":0400000001020304F2\n:00000001FF\n", EZUSB_IMAGE_IHEX) == 0;
+}
+
+static bool check_ihex_overlong_record()
+{
+    // more data than its length byte allows, and than a record can hold
+    char line[600];
+    snprintf(line, sizeof(line), ":%0590d\n:00000001FF\n", 0);
+    return parse_text("overlong.hex", line, EZUSB_IMAGE_IHEX) < 0;
+}
+
+static bool check_ihex_truncated()
+{
+    // cut off on a line boundary, before the EOF record
+    return parse_text("truncated.hex", ":0400000001020304F2\n", EZUSB_IMAGE_IHEX) < 0;
+}
+
+static bool check_srec_whole()
+{
+    return parse_text("whole.s19", "S107000001020304EE\nS9030000FC\n", EZUSB_IMAGE_SREC) == 0;
+}
+
+static bool check_srec_truncated()
+{
+    return parse_text("truncated.s19", "S107000001020304EE\n", EZUSB_IMAGE_SREC) < 0;
+}
+
+/*
+ * Fast loader: loads through the bulk endpoint leave the simulated device
+ * as loads through vendor requests do, and fall back to those when the
+ * loader has no bulk endpoint or its bulk writes fail
+ */
+static SimulatedDevice make_device(bool fastLoader)
+{
+    SimulatedDevice device = {"selftest", 0, 1000 * 1000, 1000 * 1000, 4096};
+    device.bulkBytesPerSec = fastLoader ? 1000 * 1000 : 0;
+    return device;
+}
+
+// 14 KB of code, 512 bytes of data RAM, and 32 KB of external memory
+static void make_image(ezusb_image *image, bool external)
+{
+    std::vector<unsigned char> data(0x8000);
+    for(size_t i = 0; i < data.size(); i++)
+    {
+        data[i] = static_cast<unsigned char>((i * 2654435761u) >> 24);
+    }
+    ezusb_image_append(image, 0x0000, data.data(), 0x3800);
+    ezusb_image_append(image, 0xE000, data.data() + 0x100, 0x200);
+    if(external)
+    {
+        ezusb_image_append(image, 0x4000, data.data() + 0x200, 0x8000);
+    }
+}
+
+// Runs fn against the device, attaching to its fast loader first if asked
+static int with_device(SimulatedDevice & device, bool attach, std::function<int()> const & fn)
+{
+    ezusb_ram_chunk = EZUSB_DEFAULT_RAM_CHUNK;
+    ezusb_set_transport(SimulatedDevice::transport, &device);
+    ezusb_set_bulk_transport(SimulatedDevice::bulk_transport, &device);
+    int status = attach && ezusb_attach_fast_loader(nullptr) != 1 ? -1 : fn();
+    ezusb_detach_fast_loader();
+    ezusb_set_transport(nullptr, nullptr);
+    ezusb_set_bulk_transport(nullptr, nullptr);
+    return status;
+}
+
+static bool ram_holds(SimulatedDevice const & device, ezusb_image const *image)
+{
+    for(size_t i = 0; i < image->count; i++)
+    {
+        if(memcmp(device.ram.data() + image->segs[i].addr, image->segs[i].data, image->segs[i].len) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool check_fast_load_ram_external()
+{
+    ScopedImage image;
+    make_image(&image.image, true);
+    SimulatedDevice device = make_device(true);
+    int status = with_device(device, true, [&] { return ezusb_load_ram_image(nullptr, &image.image, FX2LP, 1); });
+    return status == 0 && device.bulkTransfers > 0 && ram_holds(device, &image.image);
+}
+
+static bool check_fast_load_eeprom()
+{
+    ScopedImage image;
+    make_image(&image.image, false);
+    SimulatedDevice reference = make_device(false);
+    SimulatedDevice device = make_device(true);
+    int referenceStatus = with_device(reference, false, [&] { return ezusb_load_eeprom_image(nullptr, &image.image, FX2LP, 0x40); });
+    int status = with_device(device, true, [&] { return ezusb_load_eeprom_image(nullptr, &image.image, FX2LP, 0x40); });
+    return referenceStatus == 0 && status == 0 && device.bulkTransfers > 0 && device.eeprom == reference.eeprom;
+}
+
+static bool check_fast_not_offered()
+{
+    ScopedImage image;
+    make_image(&image.image, true);
+    SimulatedDevice device = make_device(false);
+    int attached = with_device(device, false, [] { return ezusb_attach_fast_loader(nullptr); });
+    int status = with_device(device, false, [&] { return ezusb_load_ram_image(nullptr, &image.image, FX2LP, 1); });
+    return attached == 0 && status == 0 && device.bulkTransfers == 0 && ram_holds(device, &image.image);
+}
+
+static bool check_fast_ram_fallback()
+{
+    // every bulk write fails, so the load goes through vendor requests
+    ScopedImage image;
+    make_image(&image.image, true);
+    SimulatedDevice device = make_device(true);
+    device.bulkFailAfter = 0;
+    int status = with_device(device, true, [&] { return ezusb_load_ram_image(nullptr, &image.image, FX2LP, 1); });
+    return status == 0 && device.bulkTransfers > 0 && ram_holds(device, &image.image);
+}
+
+static bool check_fast_eeprom_progress()
+{
+    // All of the FX2LP's on-chip RAM, which takes two batches.  The second
+    // never lands, so only the first batch's records may be reported, and
+    // those must all be in the EEPROM.
+    ScopedImage onChip;
+    std::vector<unsigned char> data(0x4000, 0x5A);
+    ezusb_image_append(&onChip.image, 0x0000, data.data(), 0x4000);
+    ezusb_image_append(&onChip.image, 0xE000, data.data(), 0x200);
+    SimulatedDevice reference = make_device(false);
+    with_device(reference, false, [&] { return ezusb_load_eeprom_image(nullptr, &onChip.image, FX2LP, 0x40); });
+
+    SimulatedDevice device = make_device(true);
+    device.bulkFailAfter = 1;
+    size_t reported = 0;
+    ezusb_progress_fn progress = [](void *context, size_t done) { *static_cast<size_t *>(context) = done; };
+    int status = with_device(device, true, [&]
+    {
+        return ezusb_resume_eeprom_image(nullptr, &onChip.image, FX2LP, 0x40, 0, progress, &reported);
+    });
+
+    // where the reported records end
+    ezusb_chip_traits const *chip = ezusb_get_chip_traits(FX2LP);
+    struct Layout
+    {
+        size_t records;
+        size_t end;
+    } layout = {reported, chip->eeprom_header_len};
+    ezusb_image_for_each_chunk(&onChip.image, chip, EZUSB_MAX_EEPROM_CHUNK, &layout,
+                               [](void *context, unsigned short, int, const unsigned char *, uint16_t len)
+                               {
+                                   auto *layout = static_cast<Layout *>(context);
+                                   if(layout->records > 0)
+                                   {
+                                       layout->records--;
+                                       layout->end += 4 + len;
+                                   }
+                                   return 0;
+                               });
+    size_t start = chip->eeprom_header_len;
+    return status < 0 && reported > 0
+        && std::equal(reference.eeprom.begin() + start, reference.eeprom.begin() + layout.end, device.eeprom.begin() + start);
+}
+
+int main()
+{
+    struct Check
+    {
+        const char *name;
+        std::function<bool()> run;
+    };
+    const Check checks[] = {
+        {"ihex/whole", check_ihex_whole},
+        {"ihex/overlong_record", check_ihex_overlong_record},
+        {"ihex/truncated", check_ihex_truncated},
+        {"srec/whole", check_srec_whole},
+        {"srec/truncated", check_srec_truncated},
+        {"fast/load_ram_external", check_fast_load_ram_external},
+        {"fast/load_eeprom", check_fast_load_eeprom},
+        {"fast/not_offered", check_fast_not_offered},
+        {"fast/ram_fallback", check_fast_ram_fallback},
+        {"fast/eeprom_progress", check_fast_eeprom_progress},
+    };
+
+    int failed = 0;
+    for(Check const & check : checks)
+    {
+        bool ok = check.run();
+        printf("%-40s %s\n", check.name, ok ? "ok" : "FAILED");
+        if(!ok)
+        {
+            failed++;
+        }
+    }
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,870 @@
+/*
+ * Copyright (c) 2026 Mbed CE
+ *
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/*
+ * fxloadd: a long-running loader that owns the libusb context and the
+ * device handles, and runs jobs for any number of clients connecting over
+ * a Unix domain socket.  Each connection sends one request line and gets
+ * back a stream of event lines, ending with "ok" or "error"; see README.md.
+ *
+ * Everything talking to the clients and devices runs on one thread,
+ * around an EventLoop that waits on the socket, the clients and libusb
+ * together.  Each job is planned up front into a LoadProgram, on a worker
+ * thread since that means parsing files and opening the device, and run
+ * by a LoadEngine with asynchronous transfers, so hundreds of devices can
+ * load at once without a thread each.  Every device runs its jobs in
+ * order; when they may start is up to a TopologyScheduler, which spreads
+ * the load over the USB tree.  Parsed images are cached and only parsed
+ * again when their file changes.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "CLI/CLI.hpp"
+
+#include "libusb.h"
+#include "ezusb.h"
+#include "ezusb_image.h"
+#include "fxload-version.h"
+#include "DeviceCache.h"
+#include "DeviceOps.h"
+#include "EventLoop.h"
+#include "LoadEngine.h"
+#include "TopologyScheduler.h"
+
+// Longest request line accepted from a client
+static const size_t MAX_REQUEST_LEN = 4096;
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void handle_stop_signal(int)
+{
+    stopRequested = 1;
+}
+
+/*
+ * Sends one event line to a client.  Clients are non-blocking, so one
+ * that has gone away, or stopped reading, just misses events; its job
+ * carries on regardless.
+ */
+static void send_event(int fd, const char *format, ...) PRINTF_FORMAT_ATTRIBUTE_AT(2, 3);
+static void send_event(int fd, const char *format, ...)
+{
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if(len < 0)
+    {
+        return;
+    }
+
+    size_t remaining = std::min(static_cast<size_t>(len), sizeof(line) - 1);
+    const char *pos = line;
+    while(remaining > 0)
+    {
+        ssize_t written = write(fd, pos, remaining);
+        if(written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(written <= 0)
+        {
+            return;
+        }
+        pos += written;
+        remaining -= written;
+    }
+}
+
+/*
+ * Parsed firmware images, kept until their file changes.  Only used from
+ * the worker thread.
+ */
+class ImageCache
+{
+    struct Entry
+    {
+        time_t mtime;
+        off_t size;
+        std::shared_ptr<ScopedImage> firmware;
+    };
+
+    std::map<std::string, Entry> entries;
+
+public:
+    // Returns the parsed image, or null if the file can't be read or parsed.
+    std::shared_ptr<ScopedImage const> get(std::string const & path)
+    {
+        struct stat info;
+        if(stat(path.c_str(), &info) != 0)
+        {
+            return nullptr;
+        }
+
+        auto entry = entries.find(path);
+        if(entry != entries.end() && entry->second.mtime == info.st_mtime && entry->second.size == info.st_size)
+        {
+            return entry->second.firmware;
+        }
+
+        auto firmware = std::make_shared<ScopedImage>();
+        if(ezusb_image_load_file(&firmware->image, path.c_str()) != 0)
+        {
+            entries.erase(path);
+            return nullptr;
+        }
+        entries[path] = Entry{info.st_mtime, info.st_size, firmware};
+        return firmware;
+    }
+};
+
+/*
+ * One request from a client, whose socket is closed once the job has
+ * finished.
+ */
+struct Job
+{
+    std::string operation; // load_ram, flash or verify
+    std::string portPath;
+    std::string imagePath;
+    ezusb_chip_t type = NONE;
+    int config = -1;
+    int clientFd = -1;
+};
+
+/*
+ * Rough time a job takes, in microseconds, for scheduling: RAM loads at
+ * about 500 KB/s, and EEPROM writes and reads at the I2C bus's 6 KB/s.
+ */
+static uint64_t estimate_job_us(std::string const & operation, ezusb_image const * image, ezusb_chip_t type)
+{
+    if(operation == "load_ram")
+    {
+        return ezusb_image_size(image) * 2;
+    }
+    ezusb_eeprom_plan plan;
+    if(ezusb_plan_eeprom(image, type, &plan) != 0)
+    {
+        return 0;
+    }
+    return plan.total_bytes * 166;
+}
+
+/*
+ * Opens the device plugged into the given port, and finds where it is in
+ * the USB tree.  Returns null if there is no such device.
+ */
+static libusb_device_handle *open_by_port_path(std::string const & portPath, UsbLocation & location)
+{
+    libusb_device_handle *handle = open_device_at_port(portPath);
+    if(handle != nullptr)
+    {
+        location = get_usb_location(libusb_get_device(handle));
+    }
+    return handle;
+}
+
+/*
+ * Runs tasks that may block, such as parsing files and opening devices, on
+ * a thread of its own, one at a time and in order, so that the event loop
+ * never waits on them.
+ */
+class Worker
+{
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::function<void()>> tasks;
+    bool stopping = false;
+    std::thread thread; // last, so the rest is ready when it starts
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while(true)
+        {
+            wake.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if(stopping)
+            {
+                return;
+            }
+            std::function<void()> task = std::move(tasks.front());
+            tasks.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+public:
+    Worker():
+        thread(&Worker::run, this)
+    {}
+
+    ~Worker()
+    {
+        stop();
+    }
+
+    void submit(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        wake.notify_one();
+    }
+
+    // Waits for the running task to finish, and drops the rest
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        if(thread.joinable())
+        {
+            thread.join();
+        }
+    }
+};
+
+/*
+ * What the worker found when preparing a job: the requests to send, or
+ * why it can't run.  A device it opened is closed again if the result is
+ * never picked up.
+ */
+struct PreparedJob
+{
+    std::string error; // sent to the client as is, if set
+    libusb_device_handle *openedHandle = nullptr;
+    UsbLocation location;
+    LoadProgram program;
+    uint64_t cost = 0;
+
+    PreparedJob() = default;
+    PreparedJob(PreparedJob const &) = delete;
+    PreparedJob & operator=(PreparedJob const &) = delete;
+
+    ~PreparedJob()
+    {
+        if(openedHandle != nullptr)
+        {
+            libusb_close(openedHandle);
+        }
+    }
+};
+
+/*
+ * A device with jobs for it, kept open between them
+ */
+struct Device
+{
+    std::string portPath;
+    libusb_device_handle *handle = nullptr;
+    UsbLocation location;
+
+    std::deque<Job> queue;
+    Job current; // being prepared, scheduled or running, if busy
+    bool busy = false;
+
+    void close()
+    {
+        if(handle != nullptr)
+        {
+            libusb_close(handle);
+            handle = nullptr;
+        }
+    }
+};
+
+/*
+ * Everything the daemon runs, all from its one thread
+ */
+class Daemon
+{
+    EventLoop & loop;
+    LoadEngine engine;
+    TopologyScheduler scheduler;
+    ImageCache images; // worker only
+    std::string stage1Loader;
+    std::map<std::string, Device> devices;
+    Worker worker; // last, so it stops before the rest goes
+
+    void prepareJob(Job const & job, libusb_device_handle *handle, PreparedJob & prepared);
+    void scheduleJob(Device & device, PreparedJob & prepared);
+    void runJob(Device & device, LoadProgram && program, uint64_t cost);
+    void finishJob(Device & device, uint64_t cost, uint64_t startTime, int status, std::string const & error);
+    void failJob(Device & device, std::string const & error);
+    void startNext(Device & device);
+
+public:
+    Daemon(EventLoop & loop, unsigned maxJobs, unsigned maxPerHub, unsigned queueDepth, std::string stage1Loader):
+        loop(loop),
+        engine(queueDepth),
+        scheduler(maxJobs, maxPerHub),
+        stage1Loader(std::move(stage1Loader))
+    {}
+
+    // Cancels the running jobs and fails the queued ones
+    void shutdown();
+
+    // Queues a job, telling the client how many jobs are ahead of it
+    void enqueue(Job job);
+};
+
+void Daemon::shutdown()
+{
+    // Jobs it was preparing are failed below, with the queued ones; any
+    // results it posted are dropped with the loop
+    worker.stop();
+
+    // Stops the transfers before their devices are closed
+    engine.cancel();
+
+    for(auto & entry : devices)
+    {
+        Device & device = entry.second;
+        if(device.busy)
+        {
+            device.queue.push_front(std::move(device.current));
+            device.busy = false;
+        }
+        for(Job const & job : device.queue)
+        {
+            send_event(job.clientFd, "error fxloadd is shutting down\n");
+            close(job.clientFd);
+        }
+        device.queue.clear();
+        device.close();
+    }
+}
+void Daemon::enqueue(Job job)
+{
+    Device & device = devices[job.portPath];
+    device.portPath = job.portPath;
+    send_event(job.clientFd, "queued %s %zu\n", job.portPath.c_str(), device.queue.size());
+    device.queue.push_back(std::move(job));
+    startNext(device);
+}
+
+/*
+ * Gets everything a job needs before it is scheduled: the firmware, the
+ * device, its chip type, and the requests to send.  Runs on the worker;
+ * handle is the device's, if it is already open.
+ */
+void Daemon::prepareJob(Job const & job, libusb_device_handle *handle, PreparedJob & prepared)
+{
+    std::shared_ptr<ScopedImage const> firmware = images.get(job.imagePath);
+    if(!firmware)
+    {
+        prepared.error = "can't read firmware file " + job.imagePath;
+        return;
+    }
+
+    if(handle == nullptr)
+    {
+        handle = prepared.openedHandle = open_by_port_path(job.portPath, prepared.location);
+        if(handle == nullptr)
+        {
+            prepared.error = "no device can be opened at " + job.portPath;
+            return;
+        }
+    }
+
+    // Probing the chip would block the loop on a control transfer, so
+    // only its IDs are looked at; anything else must say what it is
+    ezusb_chip_t type = job.type;
+    if(type == NONE)
+    {
+        struct libusb_device_descriptor desc;
+        if(libusb_get_device_descriptor(libusb_get_device(handle), &desc) == 0)
+        {
+            type = ezusb_chip_from_ids(desc.idVendor, desc.idProduct);
+        }
+    }
+    if(type == NONE)
+    {
+        prepared.error = "can't tell the chip type from its IDs, please pass type=";
+        return;
+    }
+
+    int status;
+    if(job.operation == "load_ram")
+    {
+        status = plan_ram_load(prepared.program, &firmware->image, type);
+    }
+    else
+    {
+        std::shared_ptr<ScopedImage const> loader = images.get(stage1Loader);
+        if(!loader)
+        {
+            prepared.error = "can't read stage 1 loader " + stage1Loader;
+            return;
+        }
+        status = job.operation == "flash"
+            ? plan_eeprom_load(prepared.program, &loader->image, &firmware->image, type, job.config)
+            : plan_eeprom_verify(prepared.program, &loader->image, &firmware->image, type, job.config);
+    }
+    if(status != 0)
+    {
+        prepared.error = job.imagePath + (job.operation == "load_ram" ? " can't be loaded into RAM" : " can't be loaded into EEPROM");
+        return;
+    }
+
+    prepared.cost = estimate_job_us(job.operation, &firmware->image, type);
+}
+
+/*
+ * Starts preparing the device's next job, unless one is already being
+ * prepared, scheduled or running.  Never sends anything to the device
+ * itself, so it is safe to call from a transfer's callback.
+ */
+void Daemon::startNext(Device & device)
+{
+    if(device.busy || device.queue.empty())
+    {
+        return;
+    }
+    device.current = std::move(device.queue.front());
+    device.queue.pop_front();
+    device.busy = true;
+
+    Job job = device.current;
+    libusb_device_handle *handle = device.handle;
+    worker.submit([this, &device, job, handle]
+    {
+        ezusb_log_set_tag(job.portPath.c_str());
+        auto prepared = std::make_shared<PreparedJob>();
+        prepareJob(job, handle, *prepared);
+        ezusb_log_set_tag(nullptr);
+        loop.post([this, &device, prepared] { scheduleJob(device, *prepared); });
+    });
+}
+
+/*
+ * Back on the loop's thread, hands a prepared job to the scheduler, or
+ * fails it
+ */
+void Daemon::scheduleJob(Device & device, PreparedJob & prepared)
+{
+    if(prepared.openedHandle != nullptr)
+    {
+        device.handle = prepared.openedHandle;
+        device.location = prepared.location;
+        prepared.openedHandle = nullptr;
+    }
+    if(!prepared.error.empty())
+    {
+        failJob(device, prepared.error);
+        return;
+    }
+
+    uint64_t cost = prepared.cost;
+    auto program = std::make_shared<LoadProgram>(std::move(prepared.program));
+    scheduler.submit(device.location, cost, [this, &device, program, cost]
+    {
+        runJob(device, std::move(*program), cost);
+    });
+}
+
+/*
+ * Ends a job that couldn't be started, and moves on to the next one
+ */
+void Daemon::failJob(Device & device, std::string const & error)
+{
+    send_event(device.current.clientFd, "error %s\n", error.c_str());
+
+    // It may have gone away, or be in a bad state; start afresh
+    device.close();
+    close(device.current.clientFd);
+    device.busy = false;
+    ezusb_log_flush();
+    startNext(device);
+}
+
+void Daemon::runJob(Device & device, LoadProgram && program, uint64_t cost)
+{
+    int fd = device.current.clientFd;
+    uint64_t startTime = ezusb_clock_us();
+    send_event(fd, "start %s\n", device.portPath.c_str());
+    engine.start(device.handle, std::move(program),
+        [fd](std::string const & event)
+        {
+            send_event(fd, "progress %s\n", event.c_str());
+        },
+        [this, &device, cost, startTime](int status, std::string const & error)
+        {
+            finishJob(device, cost, startTime, status, error);
+        });
+}
+
+void Daemon::finishJob(Device & device, uint64_t cost, uint64_t startTime, int status, std::string const & error)
+{
+    Job const & job = device.current;
+    scheduler.release(device.location, cost);
+
+    if(status == 0)
+    {
+        send_event(job.clientFd, "ok %.1f ms\n", (ezusb_clock_us() - startTime) / 1000.0);
+    }
+    else if(status == 1)
+    {
+        // The device answered, just not as expected
+        send_event(job.clientFd, "error %s\n", error.c_str());
+    }
+    else
+    {
+        send_event(job.clientFd, "error %s failed: %s\n", job.operation.c_str(), error.c_str());
+    }
+
+    // New firmware may well re-enumerate, and a failed device may have gone
+    // away or be in a bad state; either way, open it afresh next time
+    if(status != 0 || job.operation == "load_ram")
+    {
+        device.close();
+    }
+    close(job.clientFd);
+    device.busy = false;
+    ezusb_log_flush();
+
+    // This is a transfer's callback, so the next job starts from the loop
+    loop.post([this, &device] { startNext(device); });
+}
+
+/*
+ * Parses a job request: "OPERATION PORT FILE [type=TYPE] [config=BYTE]".
+ * Returns an error message, or an empty string on success.
+ */
+static std::string parse_job(std::string const & line, Job & job)
+{
+    std::istringstream tokens(line);
+    tokens >> job.operation >> job.portPath >> job.imagePath;
+    if(job.operation != "load_ram" && job.operation != "flash" && job.operation != "verify")
+    {
+        return "unknown request \"" + job.operation + "\"";
+    }
+    if(job.imagePath.empty())
+    {
+        return "expected " + job.operation + " PORT FILE";
+    }
+
+    std::string option;
+    while(tokens >> option)
+    {
+        size_t separator = option.find('=');
+        std::string key = option.substr(0, separator);
+        std::string value = separator == std::string::npos ? "" : option.substr(separator + 1);
+        if(key == "type" && DeviceTypeNames.count(value) > 0)
+        {
+            job.type = DeviceTypeNames.at(value);
+        }
+        else if(key == "config" && !value.empty())
+        {
+            char *end;
+            long config = strtol(value.c_str(), &end, 0);
+            if(*end != 0 || config < 0 || config > 0xFF)
+            {
+                return "bad config byte \"" + value + "\"";
+            }
+            job.config = static_cast<int>(config);
+        }
+        else
+        {
+            return "unknown option \"" + option + "\"";
+        }
+    }
+    return "";
+}
+
+/*
+ * Answers a "list" request with one line per USB device
+ */
+static void list_devices(int fd)
+{
+    libusb_device **devices;
+    ssize_t count = libusb_get_device_list(nullptr, &devices);
+    for(ssize_t i = 0; i < count; i++)
+    {
+        struct libusb_device_descriptor desc;
+        if(libusb_get_device_descriptor(devices[i], &desc) != 0)
+        {
+            continue;
+        }
+        ezusb_chip_t type = ezusb_chip_from_ids(desc.idVendor, desc.idProduct);
+        send_event(fd, "device %s %04x:%04x %s\n", get_device_port_path(devices[i]).c_str(),
+                   desc.idVendor, desc.idProduct, type == NONE ? "-" : ezusb_name[type]);
+    }
+    if(count >= 0)
+    {
+        libusb_free_device_list(devices, 1);
+    }
+    send_event(fd, "ok\n");
+}
+
+static std::string default_socket_path()
+{
+    const char *runtimeDir = getenv("XDG_RUNTIME_DIR");
+    if(runtimeDir != nullptr && runtimeDir[0] != 0)
+    {
+        return std::string(runtimeDir) + "/fxloadd.sock";
+    }
+    return "/tmp/fxloadd-" + std::to_string(getuid()) + ".sock";
+}
+
+/*
+ * Creates the listening socket, refusing to take over one that another
+ * fxloadd is still answering on.  Returns -1 on failure.
+ */
+static int open_listen_socket(std::string const & path)
+{
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(address.sun_path))
+    {
+        logerror("%s: socket path too long\n", path.c_str());
+        return -1;
+    }
+    strcpy(address.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+    {
+        logerror("socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if(connect(fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) == 0)
+    {
+        logerror("%s: another fxloadd is already listening there\n", path.c_str());
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    // Whatever is left there is stale
+    unlink(path.c_str());
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || bind(fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) != 0 || listen(fd, 64) != 0)
+    {
+        logerror("%s: %s\n", path.c_str(), strerror(errno));
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char*argv[])
+{
+    CLI::App app{std::string(FXLOAD_VERSION_STR) + "\nA daemon that loads EZ-USB microcontrollers on behalf of clients connecting over a Unix domain socket."};
+
+    std::string socketPath = default_socket_path();
+    unsigned maxJobs = 4;
+    unsigned maxPerHub = 2;
+    unsigned queueDepth = 4;
+    std::string stage1Loader = get_default_stage1_loader();
+    ezusb_log_sink logFormat = EZUSB_LOG_SINK_TEXT;
+    std::string logFilePath;
+    bool printVersion = false;
+
+    app.add_flag("-v,--verbose", verbose, "Verbose mode.  May be supplied up to 3 times for more verbosity.");
+    app.add_flag("-V,--version", printVersion, "Print version and exit.");
+    app.add_option("--socket", socketPath, "Path of the socket to listen on.  Default: " + socketPath);
+    app.add_option("-j,--jobs", maxJobs, "Most devices to load at once.  Default: 4")
+        ->check(CLI::Range(1, 1024).description(""));
+    app.add_option("--per-hub", maxPerHub, "Most devices to load at once behind any one external hub, since they share its bandwidth.  Default: 2")
+        ->check(CLI::Range(1, 1024).description(""));
+    app.add_option("--queue-depth", queueDepth, "Number of RAM writes to keep in flight per device.  Default: 4")
+        ->check(CLI::Range(1, EZUSB_MAX_QUEUE_DEPTH).description(""));
+    app.add_option("-s,--stage1", stage1Loader, "Path to the stage 1 loader file to use for EEPROM jobs.  Default: " + stage1Loader)
+        ->check(CLI::ExistingFile);
+    app.add_option("--log-format", logFormat, "Format of diagnostic output (from text|json)")
+        ->transform(CLI::CheckedTransformer(std::map<std::string, ezusb_log_sink>{{"text", EZUSB_LOG_SINK_TEXT}, {"json", EZUSB_LOG_SINK_JSON}}, CLI::ignore_case).description(""));
+    app.add_option("--log-file", logFilePath, "Write diagnostic output to this file instead of stderr.  Errors are still printed to stderr.");
+
+    CLI11_PARSE(app, argc, argv);
+
+    if(printVersion)
+    {
+        printf("%s\n", FXLOAD_VERSION_STR);
+        return 0;
+    }
+
+    FILE * logFile = nullptr;
+    if(!logFilePath.empty())
+    {
+        logFile = fopen(logFilePath.c_str(), "a");
+        if(logFile == nullptr)
+        {
+            logerror("%s: unable to open log file for output.\n", logFilePath.c_str());
+            return 1;
+        }
+    }
+    ezusb_log_set_sink(logFormat, logFile);
+
+    int status = libusb_init(nullptr);
+    if(status != 0)
+    {
+        logerror("libusb_init() failed: %s\n", libusb_error_name(status));
+        return 1;
+    }
+
+    int listenFd = open_listen_socket(socketPath);
+    if(listenFd < 0)
+    {
+        libusb_exit(nullptr);
+        return 1;
+    }
+
+    // Stop cleanly on Ctrl-C or kill; no SA_RESTART, so waiting returns
+    struct sigaction stopAction = {};
+    stopAction.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &stopAction, nullptr);
+    sigaction(SIGTERM, &stopAction, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("fxloadd listening on %s, running up to %u jobs at once, %u per hub\n", socketPath.c_str(), maxJobs, maxPerHub);
+    fflush(stdout);
+
+    // Everything using libusb is gone before libusb_exit()
+    {
+        EventLoop loop;
+        loop.attachLibusb();
+        Daemon daemon(loop, maxJobs, maxPerHub, queueDepth, stage1Loader);
+
+        // Connections whose request line hasn't arrived yet
+        std::map<int, std::string> pending;
+
+        auto handleRequest = [&](int fd, std::string line)
+        {
+            if(!line.empty() && line.back() == '\r')
+            {
+                line.pop_back();
+            }
+
+            if(line == "list")
+            {
+                list_devices(fd);
+                close(fd);
+                return;
+            }
+
+            Job job;
+            std::string error = parse_job(line, job);
+            if(!error.empty())
+            {
+                send_event(fd, "error %s\n", error.c_str());
+                close(fd);
+                return;
+            }
+            job.clientFd = fd;
+            daemon.enqueue(std::move(job));
+        };
+
+        auto readClient = [&](int fd)
+        {
+            std::string & request = pending[fd];
+            char buffer[512];
+            ssize_t received = read(fd, buffer, sizeof(buffer));
+            if(received < 0 && (errno == EAGAIN || errno == EINTR))
+            {
+                return;
+            }
+            if(received > 0)
+            {
+                request.append(buffer, received);
+            }
+
+            size_t newline = request.find('\n');
+            if(newline == std::string::npos && received > 0 && request.size() <= MAX_REQUEST_LEN)
+            {
+                return;
+            }
+
+            std::string line = newline == std::string::npos ? "" : request.substr(0, newline);
+            loop.remove(fd);
+            pending.erase(fd);
+            if(newline == std::string::npos)
+            {
+                close(fd);
+                return;
+            }
+            handleRequest(fd, line);
+        };
+
+        loop.add(listenFd, POLLIN, [&](short)
+        {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if(fd < 0)
+            {
+                return;
+            }
+            // So a client that stops reading can't hold up everyone else
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            pending[fd] = "";
+            loop.add(fd, POLLIN, [&readClient, fd](short) { readClient(fd); });
+        });
+
+        while(!stopRequested)
+        {
+            if(!loop.runOnce(-1))
+            {
+                break;
+            }
+        }
+
+        printf("fxloadd stopping\n");
+        for(auto const & client : pending)
+        {
+            close(client.first);
+        }
+        daemon.shutdown();
+    }
+
+    close(listenFd);
+    unlink(socketPath.c_str());
+    libusb_exit(nullptr);
+    return 0;
+}
@@ -22,13 +22,23 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
 
 #include "CLI/CLI.hpp"
 
 #include "libusb.h"
 #include "ezusb.h"
+#include "ezusb_image.h"
 #include "fxload-version.h"
-#include "ApplicationPaths.h"
+#include "DeviceCache.h"
+#include "DeviceOps.h"
+#include "FileWatcher.h"
+#include "Renumeration.h"
+#include "TransferTrace.h"
 
 struct device_spec { int index; bool searchByVidPid; uint16_t vid, pid; int bus, port; };
 
@@ -219,66 +229,865 @@ parse_device_path(const std::string & device_path, struct device_spec *spec) {
     return 0;
 }
 
-// Map of string names to enum values
-const std::map<std::string, ezusb_chip_t> DeviceTypeNames
+/*
+ * Returns the key transfer tuning results are cached under: the port path
+ * (whose bus number stands for the host controller) and the device's IDs,
+ * since the loader answering at that port decides what it accepts.
+ */
+static std::string get_tuning_cache_key(libusb_device_handle *dev_h)
+{
+    libusb_device *dev = libusb_get_device(dev_h);
+    struct libusb_device_descriptor desc;
+    libusb_get_device_descriptor(dev, &desc);
+
+    char ids[16];
+    snprintf(ids, sizeof(ids), "%04x:%04x", desc.idVendor, desc.idProduct);
+    return get_device_port_path(dev) + " " + ids;
+}
+
+/*
+ * Timing model used to estimate how long a load takes: a fixed cost per
+ * control request, plus the time to move the data.  The defaults are
+ * rough figures for a full speed device; tuning measures the real ones.
+ */
+struct transfer_model
+{
+    double latencyUs = 1000;
+    double bytesPerSec = 500 * 1024;
+    double eepromBytesPerSec = 6 * 1024; // I2C at 100 KHz, plus page write cycles
+    std::string source = "defaults";
+};
+
+/*
+ * Looks up tuned transfer settings for a device, and applies them.  The
+ * measured timing model is stored into model, if that's given and the
+ * cache holds one.  Returns false if the device hasn't been tuned.
+ */
+bool apply_cached_tuning(libusb_device_handle *dev_h, transfer_model *model = nullptr)
+{
+    DeviceCache tuningCache("transfer-tuning");
+    std::string cacheKey = get_tuning_cache_key(dev_h);
+
+    unsigned chunk, depth;
+    double latencyUs, bytesPerSec;
+    int fields = sscanf(tuningCache.get(cacheKey).c_str(), "%u %u %lf %lf", &chunk, &depth, &latencyUs, &bytesPerSec);
+    if(fields < 2
+        || chunk < EZUSB_MIN_RAM_CHUNK || chunk > EZUSB_MAX_RAM_CHUNK
+        || depth < 1 || depth > EZUSB_MAX_QUEUE_DEPTH)
+    {
+        return false;
+    }
+
+    logverbose(EZUSB_LOG_INFO, "using tuned transfers for %s: %u byte chunks, %u in flight\n", cacheKey.c_str(), chunk, depth);
+    ezusb_ram_chunk = static_cast<uint16_t>(chunk);
+    ezusb_ram_queue_depth = depth;
+
+    if(model != nullptr && fields == 4 && latencyUs >= 0 && bytesPerSec > 0)
+    {
+        model->latencyUs = latencyUs;
+        model->bytesPerSec = bytesPerSec;
+        model->source = "tuning of " + cacheKey;
+    }
+    return true;
+}
+
+/*
+ * Measures RAM write throughput over a grid of chunk sizes and queue
+ * depths, then applies and caches the fastest combination.  A quick run
+ * tries fewer combinations with less data each.  Leaves the device's CPU
+ * stopped.  Returns false if nothing could be measured.
+ */
+bool tune_transfers(libusb_device_handle *dev_h, ezusb_chip_t type, bool quick)
+{
+    const ezusb_chip_traits *chip = ezusb_get_chip_traits(type);
+    uint32_t regionSize = chip->internal[0].end - chip->internal[0].start + 1;
+
+    // Every write goes to one on-chip region, so none is bigger than the
+    // largest region: 16 KB on the FX2LP, less on the others.  Sizes past
+    // that are left out, for the chip at hand too.
+    std::vector<uint16_t> chunks = quick ? std::vector<uint16_t>{EZUSB_MIN_RAM_CHUNK, 4096, 16384}
+                                         : std::vector<uint16_t>{EZUSB_MIN_RAM_CHUNK, 2048, 4096, 8192, 16384};
+    chunks.erase(std::remove_if(chunks.begin(), chunks.end(), [&](uint16_t chunk) { return chunk > regionSize; }),
+                 chunks.end());
+    std::vector<unsigned> depths = quick ? std::vector<unsigned>{1, 4} : std::vector<unsigned>{1, 2, 4, 8};
+    size_t bytesPerTrial = quick ? 64 * 1024 : 256 * 1024;
+
+    uint16_t bestChunk = 0;
+    unsigned bestDepth = 0;
+    double bestRate = 0;
+
+    // Time per unpipelined request against its size, for the timing model
+    std::vector<std::pair<double, double>> requestTimes;
+
+    // The measurements overwrite RAM
+    forget_device_image(get_device_cache_key(dev_h));
+
+    printf("Tuning RAM transfers (%s):\n", quick ? "quick" : "full");
+    for(uint16_t chunk : chunks)
+    {
+        for(unsigned depth : depths)
+        {
+            double rate = ezusb_measure_ram_write(dev_h, type, chunk, depth, bytesPerTrial);
+            if(rate < 0)
+            {
+                logerror("measuring %u byte chunks, %u in flight: error %d\n", chunk, depth, static_cast<int>(rate));
+                if(static_cast<int>(rate) == LIBUSB_ERROR_NO_DEVICE)
+                {
+                    return false;
+                }
+                continue;
+            }
+            if(rate == 0)
+            {
+                printf("  %5u bytes x %u: not accepted\n", chunk, depth);
+                continue;
+            }
+
+            printf("  %5u bytes x %u: %8.1f KB/s\n", chunk, depth, rate / 1024);
+            if(depth == 1)
+            {
+                requestTimes.emplace_back(chunk, chunk / rate * 1e6);
+            }
+            if(rate > bestRate)
+            {
+                bestRate = rate;
+                bestChunk = chunk;
+                bestDepth = depth;
+            }
+        }
+    }
+
+    if(bestChunk == 0)
+    {
+        logerror("No transfer setting worked, leaving defaults\n");
+        return false;
+    }
+
+    printf("Best: %u byte chunks, %u in flight (%.1f KB/s)\n", bestChunk, bestDepth, bestRate / 1024);
+    ezusb_ram_chunk = bestChunk;
+    ezusb_ram_queue_depth = bestDepth;
+
+    // Fit time = latency + size / throughput to the unpipelined requests
+    std::string settings = std::to_string(bestChunk) + " " + std::to_string(bestDepth);
+    if(requestTimes.size() >= 2)
+    {
+        double n = static_cast<double>(requestTimes.size());
+        double sumX = 0, sumY = 0, sumXX = 0, sumXY = 0;
+        for(auto const & [size, timeUs] : requestTimes)
+        {
+            sumX += size;
+            sumY += timeUs;
+            sumXX += size * size;
+            sumXY += size * timeUs;
+        }
+        double slope = (n * sumXY - sumX * sumY) / (n * sumXX - sumX * sumX);
+        double latencyUs = (sumY - slope * sumX) / n;
+        if(slope > 0)
+        {
+            latencyUs = latencyUs < 0 ? 0 : latencyUs;
+            printf("Model: %.0f us per request, %.1f KB/s\n", latencyUs, 1e6 / slope / 1024);
+            settings += " " + std::to_string(latencyUs) + " " + std::to_string(1e6 / slope);
+        }
+    }
+
+    DeviceCache tuningCache("transfer-tuning");
+    tuningCache.set(get_tuning_cache_key(dev_h), settings);
+    if(!tuningCache.save())
+    {
+        logerror("Unable to save tuning results\n");
+    }
+    return true;
+}
+
+/*
+ * Requests a load would send, collected by --dry-run in place of a device
+ */
+struct planned_request
+{
+    std::string phase;
+    std::string label;
+    uint8_t requestType;
+    uint8_t request;
+    uint16_t value;
+    uint16_t length;
+};
+
+struct transfer_plan
+{
+    std::string phase;
+    std::vector<planned_request> requests;
+};
+
+static int plan_request(void *context, const char *label, unsigned char requestType, unsigned char request,
+                        unsigned short value, unsigned short index, unsigned char *data, uint16_t length)
+{
+    auto *plan = static_cast<transfer_plan *>(context);
+    plan->requests.push_back({plan->phase, label, requestType, request, value, length});
+
+    // Answer reads the way a loader with a 16 bit address EEPROM would
+    if(requestType & LIBUSB_ENDPOINT_IN)
+    {
+        memset(data, 1, length);
+    }
+    return length;
+}
+
+/*
+ * Prints the requests collected for a dry run, with when the CPU is
+ * stopped and started, and an estimate of how long they would take.
+ */
+void print_transfer_plan(transfer_plan const & plan, ezusb_chip_t type, transfer_model const & model)
+{
+    const ezusb_chip_traits *chip = ezusb_get_chip_traits(type);
+    double totalUs = 0;
+    size_t totalBytes = 0;
+
+    printf("%5s  %-16s %-4s %-3s %6s %5s  %s\n", "#", "phase", "req", "dir", "addr", "len", "description");
+    for(size_t i = 0; i < plan.requests.size(); i++)
+    {
+        planned_request const & req = plan.requests[i];
+        bool isIn = req.requestType & LIBUSB_ENDPOINT_IN;
+        bool isCpucs = !isIn && req.request == RW_INTERNAL && req.value == chip->cpucs_addr;
+        bool isRamWrite = !isIn && !isCpucs && (req.request == RW_INTERNAL || req.request == RW_MEMORY);
+
+        const char *note = "";
+        if(isCpucs)
+        {
+            note = req.label == "stop CPU" ? "  <-- CPU halted" : "  <-- CPU runs";
+        }
+        printf("%5zu  %-16s 0x%02X %-3s 0x%04x %5u  %s%s\n", i + 1, req.phase.c_str(), req.request,
+               isIn ? "in" : "out", req.value, req.length, req.label.c_str(), note);
+
+        // Pipelined RAM writes overlap their fixed costs; EEPROM writes
+        // wait for the loader to finish programming
+        double latencyUs = model.latencyUs;
+        if(isRamWrite)
+        {
+            latencyUs /= ezusb_ram_queue_depth;
+        }
+        double bytesPerSec = req.request == RW_EEPROM && !isIn ? model.eepromBytesPerSec : model.bytesPerSec;
+        totalUs += latencyUs + req.length / bytesPerSec * 1e6;
+        totalBytes += req.length;
+    }
+
+    printf("%zu requests, %zu bytes, estimated %.1f ms\n", plan.requests.size(), totalBytes, totalUs / 1000);
+    printf("(model from %s: %.0f us per request, %.1f KB/s RAM, %.1f KB/s EEPROM; %u byte chunks, %u in flight)\n",
+           model.source.c_str(), model.latencyUs, model.bytesPerSec / 1024, model.eepromBytesPerSec / 1024,
+           ezusb_ram_chunk, ezusb_ram_queue_depth);
+}
+
+// For loads that only write what changed: unchanged bytes between changes
+// closer than this are rewritten too, rather than starting another transfer
+const uint32_t DiffMergeGap = 64;
+
+// Map of firmware file format names to enum values
+const std::map<std::string, ezusb_image_format> ImageFormatNames
+{
+    {"auto", EZUSB_IMAGE_AUTO},
+    {"ihex", EZUSB_IMAGE_IHEX},
+    {"srec", EZUSB_IMAGE_SREC},
+    {"elf", EZUSB_IMAGE_ELF},
+    {"bin", EZUSB_IMAGE_BIN},
+};
+
+// Map of log format names to enum values
+const std::map<std::string, ezusb_log_sink> LogFormatNames
+{
+    {"text", EZUSB_LOG_SINK_TEXT},
+    {"json", EZUSB_LOG_SINK_JSON},
+};
+
+
+/*
+ * Options for reshaping an image before it is loaded
+ */
+struct image_options
+{
+    ezusb_image_format format = EZUSB_IMAGE_AUTO;
+    uint32_t baseAddress = 0;
+    unsigned fillGap = 0;
+    int fillByte = 0xFF;
+    bool optimizeBoot = false;
+};
+
+/*
+ * Parses one or more firmware files into a single image, e.g. a boot
+ * loader, an application and its calibration data, so they all go to the
+ * device in one load.  Bytes given by more than one file must agree.
+ * Returns 0, or nonzero (after logging why) on errors.
+ */
+int load_firmware(ezusb_image *image, std::vector<std::string> const & paths, image_options const & options)
+{
+    for(std::string const & path : paths)
+    {
+        ScopedImage part;
+        if(ezusb_image_load_file_as(&part.image, path.c_str(), options.format, options.baseAddress) != 0)
+        {
+            return -2;
+        }
+        if(ezusb_image_merge(image, &part.image) != 0)
+        {
+            logerror("%s: can't be combined with the files before it\n", path.c_str());
+            return -2;
+        }
+    }
+
+    if(paths.size() > 1)
+    {
+        printf("Combined %zu files: %zu segments, %zu bytes\n", paths.size(), image->count, ezusb_image_size(image));
+    }
+    return 0;
+}
+
+/*
+ * Names the firmware files for messages
+ */
+std::string describe_firmware(std::vector<std::string> const & paths)
+{
+    std::string names;
+    for(std::string const & path : paths)
+    {
+        names += (names.empty() ? "" : " + ") + path;
+    }
+    return names;
+}
+
+/*
+ * Applies the requested reshaping passes to an image, and reports how
+ * many transfers of up to maxChunk bytes they saved.
+ */
+void optimize_image(ezusb_image *image, ezusb_chip_t type, uint16_t maxChunk, image_options const & options)
+{
+    const ezusb_chip_traits *chip = ezusb_get_chip_traits(type);
+    size_t transfersBefore = ezusb_image_count_chunks(image, chip, maxChunk);
+    size_t bytesBefore = ezusb_image_size(image);
+
+    if(options.fillGap > 0)
+    {
+        size_t gapsFilled = ezusb_image_fill_gaps(image, chip, options.fillGap, static_cast<unsigned char>(options.fillByte));
+        size_t transfersAfter = ezusb_image_count_chunks(image, chip, maxChunk);
+
+        printf("Gap fill: filled %zu gaps with %zu bytes of 0x%02x, %zu -> %zu transfers (%zu saved)\n",
+               gapsFilled, ezusb_image_size(image) - bytesBefore, options.fillByte,
+               transfersBefore, transfersAfter, transfersBefore - transfersAfter);
+    }
+}
+
+/*
+ * Reshapes an image that is going into EEPROM so the boot ROM reads it
+ * faster at power-up, and reports the estimated boot read time before
+ * and after.  Records are already as long as the format allows; what is
+ * left is holes short enough that filling them costs fewer bytes than the
+ * header of the record that would otherwise follow.
+ */
+void optimize_eeprom_boot(ezusb_image *image, ezusb_chip_t type, int config, image_options const & options)
+{
+    const ezusb_chip_traits *chip = ezusb_get_chip_traits(type);
+    const uint32_t recordHeaderLen = 4;
+
+    ezusb_eeprom_plan before;
+    if(chip == nullptr || ezusb_plan_eeprom(image, type, &before) != 0)
+    {
+        return; // refused again, with the reason, before anything is written
+    }
+
+    ezusb_image_fill_gaps(image, chip, recordHeaderLen, static_cast<unsigned char>(options.fillByte));
+    ezusb_eeprom_plan after;
+    ezusb_plan_eeprom(image, type, &after);
+
+    int fastConfig = config | 0x01;
+    bool fastBus = chip->eeprom_config_mask != 0 && (config & chip->eeprom_config_mask & 0x01) != 0;
+    printf("EEPROM boot: %zu -> %zu records, %zu -> %zu bytes, about %.1f -> %.1f ms at %d KHz\n",
+           before.records, after.records, before.total_bytes, after.total_bytes,
+           ezusb_eeprom_boot_us(&before, type, config) / 1000.0, ezusb_eeprom_boot_us(&after, type, config) / 1000.0,
+           fastBus ? 400 : 100);
+    if(chip->eeprom_config_mask != 0 && !fastBus)
+    {
+        printf("Note: the control byte selects 100 KHz I2C.  If the EEPROM runs at 400 KHz, control byte 0x%02x would cut this to about %.1f ms.\n",
+               fastConfig & chip->eeprom_config_mask, ezusb_eeprom_boot_us(&after, type, fastConfig) / 1000.0);
+    }
+}
+
+/*
+ * Tallies where an image's chunks would go, for the check subcommand
+ */
+struct chunk_tally
+{
+    size_t onChipBytes = 0;
+    size_t externalBytes = 0;
+    size_t transfers = 0;
+};
+
+static int tally_chunk(void *context, unsigned short addr, int external, const unsigned char *data, uint16_t len)
+{
+    auto *tally = static_cast<chunk_tally *>(context);
+    (external ? tally->externalBytes : tally->onChipBytes) += len;
+    tally->transfers++;
+    logverbose(EZUSB_LOG_INFO, "  0x%04x-0x%04x %5u bytes %s\n", addr, addr + len - 1, len, external ? "external" : "on-chip");
+    return 0;
+}
+
+/*
+ * Validates a firmware file without touching any device, and prints a
+ * summary of it.  If a chip type is given, also checks it against that
+ * chip's memory map.  Returns the process exit code.
+ */
+int check_image(std::vector<std::string> const & paths, ezusb_chip_t type, image_options const & options)
+{
+    ScopedImage firmware;
+    if(load_firmware(&firmware.image, paths, options) != 0)
+    {
+        return 1;
+    }
+
+    ezusb_image const & image = firmware.image;
+    printf("%s: %zu segments, %zu bytes", describe_firmware(paths).c_str(), image.count, ezusb_image_size(&image));
+    if(image.count > 0)
+    {
+        ezusb_segment const & last = image.segs[image.count - 1];
+        printf(", 0x%04x-0x%04x", image.segs[0].addr, last.addr + last.len - 1);
+    }
+    printf("\n");
+
+    if(type != NONE)
+    {
+        chunk_tally tally;
+        const ezusb_chip_traits *chip = ezusb_get_chip_traits(type);
+        if(ezusb_image_for_each_chunk(&image, chip, EZUSB_MAX_RAM_CHUNK, &tally, tally_chunk) != 0)
+        {
+            return 1;
+        }
+        printf("%s: %zu bytes on-chip, %zu bytes external, %zu RAM transfers (at most)\n",
+               ezusb_name[type], tally.onChipBytes, tally.externalBytes, tally.transfers);
+        if(tally.externalBytes > 0)
+        {
+            printf("Note: external memory can only be written through a second stage loader, so load_ram alone will not load this image.\n");
+        }
+
+        ezusb_eeprom_plan plan;
+        if(ezusb_plan_eeprom(&image, type, &plan) == 0)
+        {
+            printf("EEPROM: %zu records, %zu of %zu bytes, boot read about %.1f ms at 100 KHz\n",
+                   plan.records, plan.total_bytes, ezusb_eeprom_size, ezusb_eeprom_boot_us(&plan, type, 0) / 1000.0);
+        }
+        else
+        {
+            printf("Note: this image can't be loaded into EEPROM.\n");
+        }
+    }
+
+    printf("OK\n");
+    return 0;
+}
+
+/*
+ * Reloads a device's RAM each time the firmware file is rebuilt, writing
+ * only what changed since the last load if RAM still holds it.  loaded is
+ * the image last loaded; if saveKey isn't empty, each new one is also
+ * saved under it for --incremental.  Firmware that re-enumerates comes
+ * back as a new device on the same port, so device is replaced with a
+ * handle to that one when needed; the caller closes whatever it ends up
+ * as.  Runs until the device or the file goes away; returns the process
+ * exit code.
+ */
+int watch_and_reload(libusb_device_handle *&device, ezusb_chip_t type, std::string const & path,
+                     image_options const & options, ezusb_image *loaded, std::string const & saveKey)
+{
+    // How long a device that has dropped off the bus gets to come back
+    const uint64_t reappearTimeoutUs = 5000000;
+
+    std::string portPath = get_device_port_path(libusb_get_device(device));
+    auto renumWaiter = std::make_unique<RenumerationWaiter>(libusb_get_device(device));
+
+    // Swaps the handle for one to whatever is on the port now
+    auto reopen = [&]()
+    {
+        libusb_close(device);
+        device = open_device_at_port(portPath);
+        if(device == nullptr)
+        {
+            return false;
+        }
+        renumWaiter = std::make_unique<RenumerationWaiter>(libusb_get_device(device));
+        return true;
+    };
+
+    FileWatcher watcher(path);
+    uint64_t lastHash = 0;
+    FileWatcher::hashFile(path, lastHash);
+
+    printf("Watching %s for changes (Ctrl-C to stop)\n", path.c_str());
+    while(watcher.waitForChange())
+    {
+        // Builds often touch files without changing them
+        uint64_t hash;
+        if(!FileWatcher::hashFile(path, hash) || hash == lastHash)
+        {
+            continue;
+        }
+        lastHash = hash;
+
+        uint64_t startTime = ezusb_clock_us();
+        ScopedImage firmware;
+        if(ezusb_image_load_file_as(&firmware.image, path.c_str(), options.format, options.baseAddress) != 0)
+        {
+            printf("%s: not reloading until the errors above are fixed\n", path.c_str());
+            continue;
+        }
+        optimize_image(&firmware.image, type, ezusb_ram_chunk, options);
+
+        ScopedImage delta;
+        if(ezusb_image_diff(&delta.image, &firmware.image, loaded, DiffMergeGap) != 0)
+        {
+            logerror("out of memory\n");
+            return 1;
+        }
+        if(delta.image.count == 0)
+        {
+            printf("%s: contents unchanged, not reloading\n", path.c_str());
+            std::swap(*loaded, firmware.image);
+            continue;
+        }
+
+        // The handle is dead if the firmware re-enumerated since the last
+        // load (or the board was replugged)
+        if(renumWaiter->poll() && !reopen())
+        {
+            logerror("%s: device re-enumerated, and can't be opened again\n", portPath.c_str());
+            return 1;
+        }
+
+        // Only the differences need writing if RAM still holds the last
+        // image, as a sample of it shows
+        ezusb_image const * toWrite = &delta.image;
+        int held = ezusb_sample_ram(device, loaded, type);
+        if(held < 0)
+        {
+            // Gone, or on its way back
+            if(!reopen() && !(renumWaiter->wait(ezusb_clock_us() + reappearTimeoutUs) && reopen()))
+            {
+                logerror("%s: device went away\n", portPath.c_str());
+                return 1;
+            }
+            held = 0;
+        }
+        if(held != 1)
+        {
+            printf("%s: device RAM doesn't hold the last image loaded, reloading all of it\n", portPath.c_str());
+            toWrite = &firmware.image;
+        }
+
+        if(!saveKey.empty())
+        {
+            forget_device_image(saveKey);
+        }
+        int status = ezusb_load_ram_image(device, toWrite, type, 0);
+        if(status != 0)
+        {
+            return status;
+        }
+        size_t written = ezusb_image_size(toWrite);
+        size_t transfers = ezusb_image_count_chunks(toWrite, ezusb_get_chip_traits(type), ezusb_ram_chunk);
+        std::swap(*loaded, firmware.image);
+        if(!saveKey.empty())
+        {
+            save_device_image(saveKey, loaded);
+        }
+
+        printf("Reloaded %zu %sbytes in %zu transfers, %.1f ms\n", written, held == 1 ? "changed " : "",
+               transfers, (ezusb_clock_us() - startTime) / 1000.0);
+    }
+    return 1;
+}
+
+/*
+ * One step of a session: an operation name and the file it works on
+ */
+struct session_step
 {
-    {"AN21", AN21},
-    {"FX", FX},
-    {"FX2", FX2},
-    {"FX2LP", FX2LP},
+    std::string operation;
+    std::string path;
+    std::unique_ptr<ScopedImage> firmware; // parsed up front, except for dump
 };
 
+/*
+ * Runs a list of operations ("program=FILE", "verify=FILE", "dump=FILE" or
+ * "ram=FILE") on one device, downloading the stage 1 loader they all need
+ * only once.  Everything is parsed and checked before the device is
+ * touched.  "ram" restarts the CPU with new firmware, so it must come
+ * last; otherwise the loader is left running for the next session.
+ * Returns the process exit code.
+ */
+int run_session(libusb_device_handle *dev_h, ezusb_chip_t type, std::string const & stage1_loader,
+                std::vector<std::string> const & operations, int config, size_t dumpSize,
+                image_options const & options)
+{
+    std::vector<session_step> steps;
+    for(std::string const & operation : operations)
+    {
+        session_step step;
+        size_t separator = operation.find('=');
+        if(separator != std::string::npos)
+        {
+            step.operation = operation.substr(0, separator);
+            step.path = operation.substr(separator + 1);
+        }
+        if(step.path.empty() || (step.operation != "program" && step.operation != "verify"
+                                 && step.operation != "dump" && step.operation != "ram"))
+        {
+            logerror("%s: expected program=FILE, verify=FILE, dump=FILE or ram=FILE\n", operation.c_str());
+            return 1;
+        }
+        if(!steps.empty() && steps.back().operation == "ram")
+        {
+            logerror("ram=%s: must be the last operation, since it replaces the loader\n", steps.back().path.c_str());
+            return 1;
+        }
+
+        if(step.operation != "dump")
+        {
+            step.firmware = std::make_unique<ScopedImage>();
+            ezusb_image *image = &step.firmware->image;
+            if(ezusb_image_load_file_as(image, step.path.c_str(), options.format, options.baseAddress) != 0)
+            {
+                return 2;
+            }
+            optimize_image(image, type, step.operation == "ram" ? ezusb_ram_chunk : EZUSB_MAX_EEPROM_CHUNK, options);
+            if(options.optimizeBoot && step.operation != "ram")
+            {
+                // verify= must reshape the same way, to match what program= wrote
+                optimize_eeprom_boot(image, type, config, options);
+            }
+
+            ezusb_eeprom_plan plan;
+            if(step.operation != "ram" && ezusb_plan_eeprom(image, type, &plan) != 0)
+            {
+                return 2;
+            }
+        }
+        steps.push_back(std::move(step));
+    }
+
+    int status = load_stage1_loader(dev_h, type, stage1_loader, false);
+    if(status != 0)
+    {
+        return status;
+    }
+
+    for(session_step const & step : steps)
+    {
+        uint64_t startTime = ezusb_clock_us();
+        if(step.operation == "program")
+        {
+            status = program_eeprom(dev_h, &step.firmware->image, type, config);
+        }
+        else if(step.operation == "verify")
+        {
+            status = ezusb_verify_eeprom_image(dev_h, &step.firmware->image, type, config);
+            if(status == 0)
+            {
+                logerror("verify: EEPROM doesn't hold %s\n", step.path.c_str());
+                return 3;
+            }
+            status = status == 1 ? 0 : status;
+        }
+        else if(step.operation == "dump")
+        {
+            std::vector<unsigned char> contents(dumpSize);
+            status = ezusb_read_eeprom(dev_h, 0, contents.data(), contents.size());
+            if(status == 0)
+            {
+                ScopedImage dump;
+                FILE * file = fopen(step.path.c_str(), "w");
+                if(file == nullptr || ezusb_image_append(&dump.image, 0, contents.data(), static_cast<uint32_t>(contents.size())) != 0
+                    || ezusb_image_save_ihex(&dump.image, file) != 0)
+                {
+                    logerror("%s: unable to write EEPROM dump\n", step.path.c_str());
+                    status = 1;
+                }
+                if(file != nullptr && fclose(file) != 0)
+                {
+                    status = 1;
+                }
+            }
+        }
+        else // ram
+        {
+            forget_device_image(get_device_cache_key(dev_h));
+            status = ezusb_load_ram_image(dev_h, &step.firmware->image, type, 1);
+        }
+
+        if(status != 0)
+        {
+            logerror("%s=%s failed\n", step.operation.c_str(), step.path.c_str());
+            return status;
+        }
+        printf("%s %s: OK, %.1f ms\n", step.operation.c_str(), step.path.c_str(), (ezusb_clock_us() - startTime) / 1000.0);
+    }
+
+    if(steps.empty() || steps.back().operation != "ram")
+    {
+        printf("Note: the stage 1 loader has been left running, so the next session can skip loading it.\n");
+    }
+    return 0;
+}
 
 int main(int argc, char*argv[])
 {
     CLI::App app{std::string(FXLOAD_VERSION_STR) + "\nA utility to load the EZ-USB family of microcontrollers over USB."};
 
     // Variables written to by CLI options
-    std::string ihex_path;
+    std::vector<std::string> ihex_paths;
     std::string device_spec_string;
     ezusb_chip_t type = NONE;
     int eeprom_first_byte = -1;
     bool printVersion = false;
+    image_options imageOptions;
+    ezusb_log_sink log_format = EZUSB_LOG_SINK_TEXT;
+    std::string log_file_path;
+    bool autotune = false;
+    bool dryRun = false;
+    std::string recordPath;
+    std::string replayPath;
+    bool watch = false;
+    bool incremental = false;
+    std::string waitRenumSpec;
+    double renumTimeout = 10;
+    std::vector<std::string> sessionOperations;
+    size_t dumpSize = EZUSB_MAX_EEPROM_SIZE;
 
     // Find resources directory
-    std::string app_install_dir = AppPaths::getExecutableDir();
-    std::string stage1_loader = app_install_dir + AppPaths::PATH_SEP + ".." + AppPaths::PATH_SEP + "share" + AppPaths::PATH_SEP + "fxload" + AppPaths::PATH_SEP + "Vend_Ax.hex";
+    std::string stage1_loader = get_default_stage1_loader();
 
     // CLI options for fxload
     app.add_flag("-v,--verbose", verbose, "Verbose mode.  May be supplied up to 3 times for more verbosity."); // note: CLI11 will count the occurrences of a flag when you pass an integer variable to add_flag()
     app.add_flag("-V,--version", printVersion, "Print version and exit.");
+    app.add_option("--log-format", log_format, "Format of diagnostic output (from text|json)")
+        ->transform(CLI::CheckedTransformer(LogFormatNames, CLI::ignore_case).description(""));
+    app.add_option("--log-file", log_file_path, "Write diagnostic output to this file instead of stderr.  Errors are still printed to stderr.");
 
     // Subcommands
     CLI::App * load_ram_subcommand = app.add_subcommand("load_ram", "Load a binary into file into the EZ-USB chip's RAM.");
     CLI::App * load_eeprom_subcommand = app.add_subcommand("load_eeprom", "Load a binary into file into the EZ-USB chip's EEPROM.");
     CLI::App * list_usb_subcommand = app.add_subcommand("list", "List all available USB devices and exit");
+    CLI::App * check_subcommand = app.add_subcommand("check", "Validate a firmware file without any device attached, and print a summary of it.");
+    CLI::App * tune_subcommand = app.add_subcommand("tune", "Measure which RAM transfer size and queue depth load fastest on a device, and remember them for later loads.");
+    CLI::App * session_subcommand = app.add_subcommand("session", "Run several EEPROM and RAM operations on one device, loading the stage 1 loader only once.");
 
     // load_ram options
-    load_ram_subcommand->add_option("-I,--ihex-path", ihex_path, "Hex file to program")
+    load_ram_subcommand->add_option("-I,--ihex-path", ihex_paths, "Firmware file to program (Intel HEX, S-record, ELF or raw binary).  Give it more than once to combine several files into one image.")
         ->required()
         ->check(CLI::ExistingFile);
-    load_ram_subcommand->add_option("-t,--type", type, "Select device type (from AN21|FX|FX2|FX2LP)")
-        ->required()
+    load_ram_subcommand->add_option("-t,--type", type, "Select device type (from AN21|FX|FX2|FX2LP|auto).  Default: auto")
         ->transform(CLI::CheckedTransformer(DeviceTypeNames, CLI::ignore_case).description(""));
     load_ram_subcommand->add_option("-D,--device", device_spec_string,
                                     "Select device by vid:pid(@index) or bus.port(@index).  If not provided, all discovered USB devices will be displayed as options.");
+    load_ram_subcommand->add_flag("--incremental", incremental, "Write only what differs from the image this device was last loaded with by an --incremental run, after reading back a sample of it to make sure it's still there.");
+    CLI::Option * waitRenumOption = load_ram_subcommand->add_option("--wait-renum", waitRenumSpec, "After loading, wait for the firmware to re-enumerate: as this vid:pid if given, else as any new device on the same port.  Prints where it appeared and how long it took.")
+        ->expected(0, 1);
+    load_ram_subcommand->add_option("--timeout", renumTimeout, "Seconds --wait-renum waits before giving up.  Default: 10")
+        ->check(CLI::PositiveNumber);
+    load_ram_subcommand->add_flag("--watch", watch, "After loading, keep watching the firmware file, and reload whatever changed each time it is rebuilt.");
 
     // load_eeprom options
-    load_eeprom_subcommand->add_option("-I,--ihex-path", ihex_path, "Hex file to program")
+    load_eeprom_subcommand->add_option("-I,--ihex-path", ihex_paths, "Firmware file to program (Intel HEX, S-record, ELF or raw binary).  Give it more than once to combine several files into one image.")
         ->required()
         ->check(CLI::ExistingFile);
-    load_eeprom_subcommand->add_option("-t,--type", type, "Select device type (from AN21|FX|FX2|FX2LP)")
-        ->required()
+    load_eeprom_subcommand->add_option("-t,--type", type, "Select device type (from AN21|FX|FX2|FX2LP|auto).  Default: auto")
         ->transform(CLI::CheckedTransformer(DeviceTypeNames, CLI::ignore_case).description(""));
     load_eeprom_subcommand->add_option("-D,--device", device_spec_string,
                                     "Select device by vid:pid(@index) or bus.port(@index).  If not provided, all discovered USB devices will be displayed as options.");
     load_eeprom_subcommand->add_option("-c,--control-byte", eeprom_first_byte, "Value programmed to first byte of EEPROM to set chip behavior.  e.g. for FX2LP this should be 0xC0 or 0xC2")
         ->check(CLI::Range(std::numeric_limits<uint8_t>::min(), std::numeric_limits<uint8_t>::max()).description(""));
+    load_eeprom_subcommand->add_option("--eeprom-size", ezusb_eeprom_size, "Size of the EEPROM in bytes, so images too big for it are refused before anything is written.  Default: " + std::to_string(EZUSB_MAX_EEPROM_SIZE))
+        ->check(CLI::Range(1, EZUSB_MAX_EEPROM_SIZE).description(""));
     load_eeprom_subcommand->add_option("-s,--stage1", stage1_loader, "Path to the stage 1 loader file to use when flashing EEPROM.  Default: " + stage1_loader)
         ->check(CLI::ExistingFile);
 
+    // check options
+    check_subcommand->add_option("-I,--ihex-path", ihex_paths, "Firmware file to check (Intel HEX, S-record, ELF or raw binary).  Give it more than once to check several files combined.")
+        ->required()
+        ->check(CLI::ExistingFile);
+    check_subcommand->add_option("-t,--type", type, "Also check the file against this device type's memory map (from AN21|FX|FX2|FX2LP)")
+        ->transform(CLI::CheckedTransformer(DeviceTypeNames, CLI::ignore_case).description(""));
+    check_subcommand->add_option("--eeprom-size", ezusb_eeprom_size, "Size of the EEPROM to check the file's EEPROM layout against, in bytes.  Default: " + std::to_string(EZUSB_MAX_EEPROM_SIZE))
+        ->check(CLI::Range(1, EZUSB_MAX_EEPROM_SIZE).description(""));
+
+    // tune options
+    tune_subcommand->add_option("-t,--type", type, "Select device type (from AN21|FX|FX2|FX2LP|auto).  Default: auto")
+        ->transform(CLI::CheckedTransformer(DeviceTypeNames, CLI::ignore_case).description(""));
+    tune_subcommand->add_option("-D,--device", device_spec_string,
+                                "Select device by vid:pid(@index) or bus.port(@index).  If not provided, all discovered USB devices will be displayed as options.");
+
+    // session options
+    session_subcommand->add_option("operations", sessionOperations, "Operations to run in order: program=FILE writes FILE to EEPROM, verify=FILE checks the EEPROM holds it, dump=FILE saves the EEPROM's contents as Intel HEX, and ram=FILE loads FILE (which may use external memory) into RAM and starts it.  ram= must come last.")
+        ->required();
+    session_subcommand->add_option("-t,--type", type, "Select device type (from AN21|FX|FX2|FX2LP|auto).  Default: auto")
+        ->transform(CLI::CheckedTransformer(DeviceTypeNames, CLI::ignore_case).description(""));
+    session_subcommand->add_option("-D,--device", device_spec_string,
+                                   "Select device by vid:pid(@index) or bus.port(@index).  If not provided, all discovered USB devices will be displayed as options.");
+    session_subcommand->add_option("-c,--control-byte", eeprom_first_byte, "Value programmed to first byte of EEPROM to set chip behavior (used by program= and verify=).  e.g. for FX2LP this should be 0xC0 or 0xC2")
+        ->check(CLI::Range(std::numeric_limits<uint8_t>::min(), std::numeric_limits<uint8_t>::max()).description(""));
+    session_subcommand->add_option("--eeprom-size", ezusb_eeprom_size, "Size of the EEPROM in bytes, so images too big for it are refused before anything is written.  Default: " + std::to_string(EZUSB_MAX_EEPROM_SIZE))
+        ->check(CLI::Range(1, EZUSB_MAX_EEPROM_SIZE).description(""));
+    session_subcommand->add_option("--dump-size", dumpSize, "Bytes of EEPROM saved by dump=.  Default: " + std::to_string(EZUSB_MAX_EEPROM_SIZE))
+        ->check(CLI::Range(1, EZUSB_MAX_EEPROM_SIZE).description(""));
+    session_subcommand->add_option("-s,--stage1", stage1_loader, "Path to the stage 1 loader file.  Default: " + stage1_loader)
+        ->check(CLI::ExistingFile);
+
+    // Transfer options (shared by load_ram and load_eeprom, which uses them for the stage 1 loader)
+    for(CLI::App * subcommand : {load_ram_subcommand, load_eeprom_subcommand})
+    {
+        subcommand->add_option("--max-chunk", ezusb_ram_chunk, "Largest RAM write to attempt per request.  Smaller sizes are tried automatically if the device rejects it.  Default: tuned value, or " + std::to_string(EZUSB_DEFAULT_RAM_CHUNK))
+            ->check(CLI::Range(EZUSB_MIN_RAM_CHUNK, EZUSB_MAX_RAM_CHUNK).description(""));
+        subcommand->add_option("--queue-depth", ezusb_ram_queue_depth, "Number of RAM writes to keep in flight at once.  Default: tuned value, or 1")
+            ->check(CLI::Range(1, EZUSB_MAX_QUEUE_DEPTH).description(""));
+        subcommand->add_flag("--autotune", autotune, "If this device hasn't been tuned yet, run a quick tune before loading.");
+        subcommand->add_flag("--dry-run", dryRun, "Don't write anything.  Print the requests the load would send, and an estimate of how long it would take.  Needs no device if -t is given.");
+        subcommand->add_option("--replay", replayPath, "Run the load against a trace saved by --record instead of a device: requests get the answers, errors and timing they got then.  Prints how the run compares with the recorded one.")
+            ->check(CLI::ExistingFile);
+    }
+    for(CLI::App * subcommand : {load_ram_subcommand, load_eeprom_subcommand, session_subcommand})
+    {
+        subcommand->add_option("--record", recordPath, "Save every control request sent to the device, with its status and timing, to this trace file for --replay.");
+    }
+
+    // Image options (shared by load_ram, load_eeprom, session, and check)
+    for(CLI::App * subcommand : {load_ram_subcommand, load_eeprom_subcommand, session_subcommand, check_subcommand})
+    {
+        subcommand->add_option("--format", imageOptions.format, "Format of the firmware file (from auto|ihex|srec|elf|bin).  Default: auto")
+            ->transform(CLI::CheckedTransformer(ImageFormatNames, CLI::ignore_case).description(""));
+        subcommand->add_option("--base-address", imageOptions.baseAddress, "Load address of a raw binary firmware file.  Default: 0")
+            ->check(CLI::Range(0, 0xFFFF).description(""));
+    }
+
+    // Image reshaping options (shared by load_ram, load_eeprom, and session)
+    for(CLI::App * subcommand : {load_ram_subcommand, load_eeprom_subcommand, session_subcommand})
+    {
+        subcommand->add_option("--fill-gaps", imageOptions.fillGap, "Merge segments separated by holes of fewer than this many bytes within one on-chip memory region, so they load in fewer transfers.  Default: 0 (off)");
+        subcommand->add_option("--fill-byte", imageOptions.fillByte, "Value written into holes filled by --fill-gaps.  Default: 0xFF")
+            ->check(CLI::Range(std::numeric_limits<uint8_t>::min(), std::numeric_limits<uint8_t>::max()).description(""));
+    }
+    for(CLI::App * subcommand : {load_eeprom_subcommand, session_subcommand})
+    {
+        subcommand->add_flag("--optimize-boot", imageOptions.optimizeBoot, "Fill holes shorter than an EEPROM record header, so the boot ROM reads fewer records at power-up, and report the estimated boot time.  Holes are filled with --fill-byte.");
+    }
+
     CLI11_PARSE(app, argc, argv);
 
+    // Set up logging before anything has a chance to log
+    FILE * log_file = nullptr;
+    if(!log_file_path.empty())
+    {
+        log_file = fopen(log_file_path.c_str(), "w");
+        if(log_file == nullptr)
+        {
+            logerror("%s: unable to open log file for output.\n", log_file_path.c_str());
+            return 1;
+        }
+    }
+    ezusb_log_set_sink(log_format, log_file);
+
     // handle -V
     if(printVersion)
     {
@@ -300,8 +1109,18 @@ int main(int argc, char*argv[])
         search_usb_devices(true, nullptr);
         return 0;
     }
-    else // load_ram or load_eeprom (all commands which open a USB device)
+    else if(check_subcommand->parsed())
+    {
+        return check_image(ihex_paths, type, imageOptions);
+    }
+    else // load_ram, load_eeprom, session, or tune (all commands which open a USB device)
     {
+        if(watch && ihex_paths.size() > 1)
+        {
+            logerror("--watch can only follow a single firmware file\n");
+            return 1;
+        }
+
         // Find USB device to operate on
         struct device_spec spec = {0};
         if(!device_spec_string.empty())
@@ -313,34 +1132,245 @@ int main(int argc, char*argv[])
             }
         }
 
-        libusb_device_handle *device;
+        // A replay is a dry run whose requests are answered from the trace
+        std::unique_ptr<TraceReplay> replay;
+        if(!replayPath.empty())
+        {
+            ezusb_chip_t recordedType;
+            std::vector<TraceEntry> entries;
+            if(!recordPath.empty() || !read_trace(replayPath, recordedType, entries))
+            {
+                if(!recordPath.empty())
+                {
+                    logerror("--record and --replay can't be used together\n");
+                }
+                return 1;
+            }
+            if(type == NONE)
+            {
+                type = recordedType;
+            }
+            replay = std::make_unique<TraceReplay>(std::move(entries));
+            dryRun = true;
+        }
+        else if(!recordPath.empty() && dryRun)
+        {
+            logerror("--record needs a device, so it can't be used with --dry-run\n");
+            return 1;
+        }
+
+        libusb_device_handle *device = nullptr;
 
-        device = search_usb_devices(false, device_spec_string.empty() ? nullptr : &spec);
+        // A dry run only needs a device to find out its type, or the
+        // timing measured when it was tuned
+        if(!dryRun || type == NONE || !device_spec_string.empty())
+        {
+            device = search_usb_devices(false, device_spec_string.empty() ? nullptr : &spec);
 
-        if (device == NULL) {
-            logerror("Failed to select device\n");
-            return -1;
+            if (device == NULL) {
+                logerror("Failed to select device\n");
+                return -1;
+            }
+
+            // Structured logs get tagged with the device so that output from
+            // parallel runs can be merged and still told apart.
+            if(log_format == EZUSB_LOG_SINK_JSON)
+            {
+                ezusb_log_set_tag(get_device_port_path(libusb_get_device(device)).c_str());
+            }
+
+            if(type == NONE)
+            {
+                type = detect_chip_type(device);
+                if(type == NONE)
+                {
+                    libusb_close(device);
+                    return 1;
+                }
+            }
+        }
+
+        // Traced from here on, until the device is closed
+        std::unique_ptr<TraceRecorder> recorder;
+        if(!recordPath.empty())
+        {
+            recorder = std::make_unique<TraceRecorder>(recordPath, type);
+            if(!recorder->isOpen())
+            {
+                libusb_close(device);
+                return 1;
+            }
+        }
+
+        if(tune_subcommand->parsed())
+        {
+            bool tuned = tune_transfers(device, type, false);
+            libusb_close(device);
+            if(!tuned)
+            {
+                return 1;
+            }
+            printf("Note: the device's CPU has been left stopped; load firmware to restart it.\n");
+            return 0;
+        }
+
+        if(session_subcommand->parsed())
+        {
+            apply_cached_tuning(device);
+            int status = run_session(device, type, stage1_loader, sessionOperations, eeprom_first_byte, dumpSize, imageOptions);
+            ezusb_detach_fast_loader();
+            libusb_close(device);
+            return status;
+        }
+
+        // Parse the firmware and reshape it before anything is written
+        ScopedImage firmware;
+        if(load_firmware(&firmware.image, ihex_paths, imageOptions) != 0)
+        {
+            libusb_close(device);
+            return -2;
+        }
+
+        // Settings given on the command line win over tuned ones
+        CLI::App * load_subcommand = load_ram_subcommand->parsed() ? load_ram_subcommand : load_eeprom_subcommand;
+        transfer_model model;
+        bool haveTransferSettings = load_subcommand->count("--max-chunk") > 0 || load_subcommand->count("--queue-depth") > 0;
+        if(device != nullptr)
+        {
+            haveTransferSettings = apply_cached_tuning(device, &model) || haveTransferSettings;
+        }
+
+        optimize_image(&firmware.image, type,
+                       load_ram_subcommand->parsed() ? ezusb_ram_chunk : EZUSB_MAX_EEPROM_CHUNK,
+                       imageOptions);
+
+        // Refuse EEPROM jobs that can't work before anything is written
+        if(load_eeprom_subcommand->parsed())
+        {
+            if(imageOptions.optimizeBoot)
+            {
+                optimize_eeprom_boot(&firmware.image, type, eeprom_first_byte, imageOptions);
+            }
+
+            ezusb_eeprom_plan plan;
+            if(ezusb_plan_eeprom(&firmware.image, type, &plan) != 0)
+            {
+                libusb_close(device);
+                return -2;
+            }
+            printf("EEPROM: %zu records, %zu of %zu bytes, boot read about %.1f ms\n", plan.records, plan.total_bytes, ezusb_eeprom_size,
+                   ezusb_eeprom_boot_us(&plan, type, eeprom_first_byte) / 1000.0);
+        }
+
+        if(!haveTransferSettings && autotune && !dryRun)
+        {
+            tune_transfers(device, type, true);
+        }
+
+        // A dry run goes through all the same steps, with every request
+        // collected instead of sent
+        transfer_plan dryRunPlan;
+        if(replay)
+        {
+            replay->latencyUs = model.latencyUs;
+            replay->bytesPerSec = model.bytesPerSec;
+            ezusb_set_transport(TraceReplay::transport, replay.get());
+        }
+        else if(dryRun)
+        {
+            ezusb_set_transport(plan_request, &dryRunPlan);
         }
 
         if(load_ram_subcommand->parsed())
         {
              /* single stage, put into internal memory */
-            if (verbose)
-                logerror("single stage:  load on-chip memory\n");
-            int status = ezusb_load_ram (device, ihex_path.c_str(), type, 0);
+            logverbose(EZUSB_LOG_INFO, "single stage:  load on-chip memory\n");
+            dryRunPlan.phase = "load RAM";
+
+            // Incremental: if the device still holds the image it was last
+            // loaded with, only write the differences
+            std::string deviceKey = incremental && !dryRun ? get_device_cache_key(device) : "";
+            ezusb_image const * toWrite = &firmware.image;
+            ScopedImage previous, delta;
+            if(!deviceKey.empty() && load_device_image(deviceKey, &previous.image))
+            {
+                if(ezusb_sample_ram(device, &previous.image, type) == 1
+                    && ezusb_image_diff(&delta.image, &firmware.image, &previous.image, DiffMergeGap) == 0)
+                {
+                    printf("Incremental: %zu of %zu bytes changed since the last load\n",
+                           ezusb_image_size(&delta.image), ezusb_image_size(&firmware.image));
+                    toWrite = &delta.image;
+                }
+                else
+                {
+                    printf("Incremental: device RAM doesn't hold the last image loaded, loading all of it\n");
+                }
+            }
+
+            // Start listening before the reset, so the arrival can't be missed
+            std::unique_ptr<RenumerationWaiter> renumWaiter;
+            if(waitRenumOption->count() > 0 && !dryRun)
+            {
+                unsigned renumVid, renumPid;
+                if(waitRenumSpec.empty())
+                {
+                    renumWaiter = std::make_unique<RenumerationWaiter>(libusb_get_device(device));
+                }
+                else if(sscanf(waitRenumSpec.c_str(), "%x:%x", &renumVid, &renumPid) == 2 && renumVid <= 0xFFFF && renumPid <= 0xFFFF)
+                {
+                    renumWaiter = std::make_unique<RenumerationWaiter>(static_cast<uint16_t>(renumVid), static_cast<uint16_t>(renumPid));
+                }
+                else
+                {
+                    logerror("--wait-renum: expected vid:pid, got \"%s\"\n", waitRenumSpec.c_str());
+                    libusb_close(device);
+                    return 1;
+                }
+            }
+
+            // Whatever is saved stops being true as soon as RAM is written;
+            // an incremental load saves the new image once it's in
+            if(!dryRun)
+            {
+                forget_device_image(get_device_cache_key(device));
+            }
+            int status = ezusb_load_ram_image (device, toWrite, type, 0);
+            uint64_t resetTime = ezusb_clock_us();
             if(status != 0)
             {
                 libusb_close(device);
                 return status;
             }
+            if(!deviceKey.empty() && !save_device_image(deviceKey, &firmware.image))
+            {
+                logerror("Unable to save the loaded image for later incremental loads\n");
+            }
 
+            if(renumWaiter)
+            {
+                libusb_close(device);
+                if(!renumWaiter->wait(resetTime + static_cast<uint64_t>(renumTimeout * 1e6)))
+                {
+                    logerror("Device didn't re-enumerate within %.1f s\n", renumTimeout);
+                    return 1;
+                }
+                printf("Re-enumerated as %04x:%04x at %s, %.1f ms after reset\n", renumWaiter->vid, renumWaiter->pid,
+                       renumWaiter->portPath.c_str(), (renumWaiter->arrivalTimeUs - resetTime) / 1000.0);
+                return 0;
+            }
+
+            if(watch && !dryRun)
+            {
+                status = watch_and_reload(device, type, ihex_paths[0], imageOptions, &firmware.image, deviceKey);
+                libusb_close(device);
+                return status;
+            }
         }
         else if(load_eeprom_subcommand->parsed())
         {
             /* first stage:  put loader into internal memory */
-            if (verbose)
-                logerror("1st stage:  load 2nd stage loader\n");
-            int status = ezusb_load_ram (device, stage1_loader.c_str(), type, 0);
+            dryRunPlan.phase = "stage 1 loader";
+            int status = load_stage1_loader(device, type, stage1_loader, dryRun);
             if (status != 0)
             {
                 libusb_close(device);
@@ -348,7 +1378,16 @@ int main(int argc, char*argv[])
             }
 
             /* second stage ... write EEPROM  */
-            status = ezusb_load_eeprom (device, ihex_path.c_str(), type, eeprom_first_byte);
+            dryRunPlan.phase = "write EEPROM";
+            if(dryRun)
+            {
+                status = ezusb_load_eeprom_image (device, &firmware.image, type, eeprom_first_byte);
+            }
+            else
+            {
+                status = program_eeprom(device, &firmware.image, type, eeprom_first_byte);
+            }
+            ezusb_detach_fast_loader();
             if (status != 0)
             {
                 libusb_close(device);
@@ -357,6 +1396,20 @@ int main(int argc, char*argv[])
         }
 
         libusb_close(device);
+
+        if(replay)
+        {
+            ezusb_set_transport(nullptr, nullptr);
+            replay->printReport(replayPath);
+            return 0;
+        }
+        if(dryRun)
+        {
+            ezusb_set_transport(nullptr, nullptr);
+            printf("Dry run of %s %s on %s:\n", load_subcommand->get_name().c_str(), describe_firmware(ihex_paths).c_str(), ezusb_name[type]);
+            print_transfer_plan(dryRunPlan, type, model);
+            return 0;
+        }
         printf("Done.\n");
     }
 